@@ -19,11 +19,14 @@
 //#define INSTRUMENT_L298N
 //#define INSTRUMENT_SHIFTED_FLOPPIES
 //#define INSTRUMENT_SHIFT_REGISTER
+//#define INSTRUMENT_COMPOSITE
 #define INSTRUMENT_GATEWAY
 
 ////
 // Uncomment **ONLY ONE** of these networks
 // If the device is a **GATEWAY**, make sure that INSTRUMENT_GATEWAY is defined as well  
+// On ESP8266/ESP32, NETWORK_SERIAL, NETWORK_UDP and NETWORK_ESPNOW can be combined to receive
+// the same messages over several networks at once (see MoppyNetworkMux.h)
 ////
 //#define NETWORK_SERIAL
 //#define NETWORK_UDP
@@ -46,5 +49,43 @@
 #define MIN_SUB_ADDRESS 1
 #define MAX_SUB_ADDRESS 4
 
+// For INSTRUMENT_COMPOSITE, the {device address, min sub-address, max sub-address} answered by
+// each of the instruments listed in main.cpp, in the same order (see MoppyComposite.h).  Each
+// instrument numbers its own sub-addresses from MIN_SUB_ADDRESS, so MIN_SUB_ADDRESS and
+// MAX_SUB_ADDRESS above must cover the widest range.  Stats and traces are reported for
+// DEVICE_ADDRESS, and on-device players and MIDI play on it.
+#define COMPOSITE_ADDRESSES {0x01, 1, 4}, {0x02, 1, 4}
+
+// Hold incoming UDP/ESP-Now messages in a jitter buffer (see MoppyJitterBuffer.h) so that
+// notes keep their rhythm even when wireless delivery times vary.  This adds a few
+// milliseconds of fixed latency.  Define this on the **GATEWAY** as well so that it
+// timestamps the messages it relays.
+//#define MOPPY_JITTER_BUFFER
+
+// Record how long each note takes to get from the network to its first step (see
+// MoppyTrace.h).  The records are fetched with NETBYTE_SYS_TRACE, e.g. by tools/moppytrace.
+// This costs some RAM and a few cycles per step, so leave it off unless you're chasing latency.
+//#define MOPPY_TRACE
+
+////
+// Uncomment **AT MOST ONE** of these players to play music stored on the device.  The network
+// still works alongside the player, and the Controller can start/stop it or change its tempo
+// with NETBYTE_SYS_PLAYER_*.
+////
+// A MIDI file (ESP8266/ESP32 only), read from LittleFS or from an SD card if MOPPY_PLAYER_SD
+// is defined
+//#define PLAYER_SMF
+#define MOPPY_PLAYER_FILE "/song.mid"
+//#define MOPPY_PLAYER_SD
+#define MOPPY_PLAYER_SD_CS 5
+// An event stream compiled by tools/mid2moppy and kept in program memory (any board).  The
+// header it generates defines moppyEvents.
+//#define PLAYER_EVENTS
+#define MOPPY_PLAYER_EVENTS_HEADER "song.h"
+
+// Start playing as soon as the instrument has finished its startup sequence
+#define MOPPY_PLAYER_AUTOSTART true
+#define MOPPY_PLAYER_LOOP true
+
 
 #endif /* SRC_MOPPYCONFIG_H_ */
@@ -42,8 +42,13 @@ namespace instruments
   // The period originally set by incoming messages (prior to any modifications from pitch-bending)
   unsigned int Buzzers::originalPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
+  MoppyModulation Buzzers::modulation;
+  MoppyArpeggiator Buzzers::arpeggiator(Buzzers::arpNote);
+
   void Buzzers::setup()
   {
+    allocator.setRange(0, 0, MAX_BUZZER_NOTE);
+    voiceAllocator = &allocator;
 
     // Prepare pins (0 and 1 are reserved for Serial communications)
     for (int i = FIRST_BUZZER; i <= LAST_BUZZER; i++)
@@ -53,40 +58,24 @@ namespace instruments
 
     // With all pins setup, let's do a first run reset
     resetAll();
-    delay(500); // Wait a half second for safety
 
     // Setup timer to handle interrupts for floppy driving
     MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+    MoppyTimer::addCallback(controlTick, MOPPY_CONTROL_PERIOD);
 
-    // If MoppyConfig wants a startup sound, play the startupSound on the
-    // first drive.
-    if (PLAY_STARTUP_SOUND)
-    {
-      startupSound(FIRST_BUZZER);
-      delay(500);
-      resetAll();
-    }
+    // Nothing to home, so this just plays the startup sound (in the background)
+    beginStartup(false);
   }
 
-  // Play startup sound to confirm drive functionality
-  void Buzzers::startupSound(byte buzzerNum)
+  // Play startup sound on the first buzzer to confirm buzzer functionality
+  void Buzzers::startupNote(uint8_t note)
   {
-    unsigned int chargeNotes[] = {
-        noteDoubleTicks[31],
-        noteDoubleTicks[36],
-        noteDoubleTicks[38],
-        noteDoubleTicks[43],
-        0};
-    byte i = 0;
-    unsigned long lastRun = 0;
-    while (i < 5)
-    {
-      if (millis() - 200 > lastRun)
-      {
-        lastRun = millis();
-        currentPeriod[buzzerNum] = chargeNotes[i++];
-      }
-    }
+    currentPeriod[FIRST_BUZZER] = noteDoubleTicks[note];
+  }
+
+  void Buzzers::startupReset()
+  {
+    resetAll();
   }
 
   //
@@ -117,15 +106,20 @@ namespace instruments
 
   void Buzzers::dev_noteOn(uint8_t subAddress, uint8_t payload[])
   {
-    if (payload[0] <= MAX_BUZZER_NOTE)
+    if (payload[0] <= MAX_BUZZER_NOTE && arpeggiator.noteOn(subAddress, payload[0]))
     {
-      currentPeriod[subAddress] = originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+      originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+      modulation.noteOn(subAddress, payload[0]);
+      currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
     }
   }
 
   void Buzzers::dev_noteOff(uint8_t subAddress, uint8_t payload[])
   {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    if (arpeggiator.noteOff(subAddress, payload[0]))
+    {
+      currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    }
   }
 
   void Buzzers::dev_bendPitch(uint8_t subAddress, uint8_t payload[])
@@ -133,10 +127,8 @@ namespace instruments
     // A value from -8192 to 8191 representing the pitch deflection
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
-    // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
-    //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    modulation.setBend(subAddress, bendDeflection);
+    currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
   }
 
   void Buzzers::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[])
@@ -146,6 +138,16 @@ namespace instruments
     case NETBYTE_DEV_SETMOVEMENT:
       //setMovement(subAddress, payload[0] == 0); // MIDI bytes only go to 127, so * 2
       break;
+    case NETBYTE_DEV_SETMODULATION:
+      modulation.setModulation(subAddress, payload);
+      break;
+    case NETBYTE_DEV_SETGLIDE:
+      modulation.setGlide(payload);
+      break;
+    case NETBYTE_DEV_SETARPEGGIO:
+      arpeggiator.setArpeggio(payload);
+      allocator.setStackDepth(arpeggiator.isEnabled() ? MOPPY_ARP_NOTES : 1);
+      break;
     }
   }
 
@@ -183,6 +185,7 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
         if (currentTick[i] >= currentPeriod[i])
         {
           togglePin(buzzerPins[i]);
+          MOPPY_TRACE_EDGE(voiceOf(i));
           currentTick[i] = 0;
         }
       }
@@ -194,6 +197,43 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
     digitalWrite(pin, currentState[pin]);
     currentState[pin] = ~currentState[pin];
   }
+
+  // Called by the timer every MOPPY_CONTROL_PERIOD to move the arpeggios and LFOs along
+#ifdef ARDUINO_ARCH_ESP8266
+  void ICACHE_RAM_ATTR Buzzers::controlTick()
+  {
+#elif ARDUINO_ARCH_ESP32
+  void IRAM_ATTR Buzzers::controlTick()
+  {
+#else
+  void Buzzers::controlTick()
+  {
+#endif
+    arpeggiator.update();
+    modulation.update();
+    for (byte i = FIRST_BUZZER; i <= LAST_BUZZER; i++)
+    {
+      if (originalPeriod[i] > 0 && modulation.isModulated(i))
+      {
+        currentPeriod[i] = modulation.period(i, originalPeriod[i]);
+      }
+    }
+  }
+
+  // Switches a buzzer to the next note of its arpeggio
+#ifdef ARDUINO_ARCH_ESP8266
+  void ICACHE_RAM_ATTR Buzzers::arpNote(uint8_t subAddress, uint8_t note)
+  {
+#elif ARDUINO_ARCH_ESP32
+  void IRAM_ATTR Buzzers::arpNote(uint8_t subAddress, uint8_t note)
+  {
+#else
+  void Buzzers::arpNote(uint8_t subAddress, uint8_t note)
+  {
+#endif
+    originalPeriod[subAddress] = noteDoubleTicks[note];
+    currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
+  }
 #pragma GCC pop_options
 
   //
@@ -211,16 +251,20 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
   // Immediately stops all drives
   void Buzzers::haltAllBuzzers()
   {
+    arpeggiator.reset(0);
+    modulation.reset(0);
     for (unsigned int i = FIRST_BUZZER; i <= LAST_BUZZER; i++)
     {
-      currentPeriod[i] = 0;
+      currentPeriod[i] = originalPeriod[i] = 0;
     }
   }
 
   //For a given floppy number, runs the read-head all the way back to 0
   void Buzzers::reset(byte buzzerNum)
   {
-    currentPeriod[buzzerNum] = 0; // Stop note
+    arpeggiator.reset(buzzerNum);
+    currentPeriod[buzzerNum] = originalPeriod[buzzerNum] = 0; // Stop note
+    modulation.reset(buzzerNum);
     currentState[buzzerNum] = LOW;
     digitalWrite(buzzerPins[buzzerNum], LOW);
   }
@@ -230,12 +274,14 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
   {
 
     // Stop all drives and set to reverse
+    arpeggiator.reset(0);
     for (byte i = FIRST_BUZZER; i <= LAST_BUZZER; i++)
     {
-      currentPeriod[i] = 0; // Stop note
+      currentPeriod[i] = originalPeriod[i] = 0; // Stop note
       currentState[i] = LOW;
       digitalWrite(buzzerPins[i], LOW);
     }
+    modulation.reset(0);
   }
 
 } // namespace instruments
@@ -8,12 +8,16 @@
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyModulation.h"
+#include "MoppyArpeggiator.h"
 #include "MoppyInstrument.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
 namespace instruments {
-  class Buzzers : public MoppyInstrument {
+  class Buzzers final : public MoppyStaticInstrument<Buzzers> {
+      friend class MoppyDispatcher<Buzzers>;
+
   public:
       void setup();
 
@@ -28,7 +32,14 @@ namespace instruments {
 
       void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
 
+      void startupNote(uint8_t note) override;
+      void startupReset() override;
+
   private:
+    MoppyVoiceAllocator allocator; // Picks buzzers for NETBYTE_DEV_CHANNEL_NOTEON
+    static MoppyModulation modulation; // Pitch bend and LFOs
+    static MoppyArpeggiator arpeggiator; // Cycles through chords given to one buzzer
+
     static int currentState[];
     static unsigned int currentPeriod[];
     static unsigned int currentTick[];
@@ -50,8 +61,9 @@ namespace instruments {
     static void haltAllBuzzers();
     static void reset(byte buzzerNum);
     static void tick();
+    static void controlTick();
+    static void arpNote(uint8_t subAddress, uint8_t note);
     static void blinkLED();
-    static void startupSound(byte buzzerNum);
   };
 }
 
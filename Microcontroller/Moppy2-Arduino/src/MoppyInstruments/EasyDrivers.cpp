@@ -13,7 +13,7 @@ const byte LAST_DRIVER = 3;  // This sketch can handle only up to 3 drivers (the
 
 
 // Maximum note number to attempt to play on easydrivers.  It's possible higher notes may work,
-// but they need to be added in "MoppyInstrument.h".
+// but they need to be added in "MoppyNotes.h".
 const byte MAX_DRIVER_NOTE = 119;
 
 
@@ -24,28 +24,37 @@ const byte MAX_DRIVER_NOTE = 119;
  */
 
 
-// Microstep Resolution of each stepper motor:
-//                              {MS1,MS2,MS1,MS2,MS1,MS2}
-unsigned int stepResolution[] = {LOW,LOW,LOW,LOW,LOW,LOW};
 /*
-+------+-------+-------------------------+
-| MS1  |  MS2  |   Microstep Resolution  |
-+------+-------+-------------------------+
-| L    | L     | Full Step (2 Phase)     |
-+------+-------+-------------------------+
-| H    | L     | Half Step               |
-+------+-------+-------------------------+
-| L    | H     | Quarter Step            |
-+------+-------+-------------------------+
-| H    | H     | Eigth Step              |
-+------+-------+-------------------------+
+Microstep resolution is picked for each note: the finest one (up to EASYDRIVER_MAX_MICROSTEP)
+that still leaves at least MICROSTEP_MIN_TICKS between step-pin toggles.  Low notes then move
+smoothly instead of lurching from one full step to the next, while high notes stay at full
+steps with as few toggles as possible.  A note sounds at its pitch in any mode, since the step
+rate goes up with the resolution.
+
++------+-------+-------------------------+------+
+| MS1  |  MS2  |   Microstep Resolution  | Mode |
++------+-------+-------------------------+------+
+| L    | L     | Full Step (2 Phase)     | 0    |
++------+-------+-------------------------+------+
+| H    | L     | Half Step               | 1    |
++------+-------+-------------------------+------+
+| L    | H     | Quarter Step            | 2    |
++------+-------+-------------------------+------+
+| H    | H     | Eigth Step              | 3    |
++------+-------+-------------------------+------+
  */
+// Set this to 0 to always use full steps
+#define EASYDRIVER_MAX_MICROSTEP 3
+// Keeps a note's period within 1% of its pitch
+#define MICROSTEP_MIN_TICKS 50
+const byte MICROSTEP_LEVELS[][2] = {{LOW,LOW},{HIGH,LOW},{LOW,HIGH},{HIGH,HIGH}}; // {MS1,MS2} per mode
 
 /*
-NOTE: This integer controls the "resetAll" function, and should contain the highest value maximum poisitions of all EasyDrivers
+NOTE: This controls the "reset" functions, and should contain the highest value maximum poisitions of all EasyDrivers.
+Drivers are homed until their rear direction-switch triggers, or until they've made this many steps.
  */
 // Uncomment this if you want to be able to reset the drivers!
-//unsigned int max_position = 7200;
+//#define EASYDRIVER_HOMING_STEPS 7200
 
 
 /*Array to keep track of state of each pin.  Even indexes track the step-pins for toggle purposes.  Odd indexes
@@ -63,7 +72,18 @@ unsigned int EasyDrivers::currentTick[] = {0,0,0,0,0};
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
 unsigned int EasyDrivers::originalPeriod[] = {0,0,0,0,0};
 
+// Drivers are homed by the tick (see homeStep() below) rather than in a blocking loop
+unsigned int EasyDrivers::homingSteps[] = {0,0,0,0,0};
+
+// Microstep mode each driver's MS1/MS2 pins are set to
+byte EasyDrivers::microstepMode[] = {0,0,0,0,0};
+
+MoppyModulation EasyDrivers::modulation;
+MoppyArpeggiator EasyDrivers::arpeggiator(EasyDrivers::arpNote);
+
 void EasyDrivers::setup() {
+  allocator.setRange(0, 0, MAX_DRIVER_NOTE);
+  voiceAllocator = &allocator;
 
   // Prepare pins (0 and 1 are reserved for Serial communications)
   pinMode(2, OUTPUT); // Step pin 1
@@ -88,46 +108,35 @@ void EasyDrivers::setup() {
   pinMode(19, INPUT_PULLUP); // Rear Direction-Switch 3
 
 
-  // Set the step resolution of each driver
-  for(byte respin = 0;respin<LAST_DRIVER;respin++) {
-    digitalWrite(respin*4+4,stepResolution[respin*2]);
-    digitalWrite(respin*4+5,stepResolution[respin*2+1]);
+  // Start every driver at full steps
+  for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
+    microstepMode[d] = 1; // Anything else, so the pins are written
+    setMicrostep(d, 0);
   }
 
-  // With all pins setup, let's do a first run reset
-  resetAll();
+  // Setup timer to handle interrupts for drivers driving (homing happens in the tick too)
+  MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+  MoppyTimer::addCallback(controlTick, MOPPY_CONTROL_PERIOD);
 
-  delay(500); // Wait a half second for safety
+  // With all pins setup, let's do a first run reset.  Homing and the startup sound
+  // happen in the background.
+  resetAll();
+  beginStartup(false);
+}
 
-  // Setup timer to handle interrupts for drivers driving
-  MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+bool EasyDrivers::startupHoming() {
+  return homing();
+}
 
-  // If MoppyConfig wants a startup sound, play the startupSound on the
-  // first driver.
-  if (PLAY_STARTUP_SOUND) {
-    startupSound(FIRST_DRIVER);
-    delay(500);
-    resetAll();
-  }
+// Play startup sound on the first driver to confirm driver functionality
+void EasyDrivers::startupNote(uint8_t note) {
+  noInterrupts();
+  currentPeriod[FIRST_DRIVER] = notePeriod(FIRST_DRIVER, note);
+  interrupts();
 }
 
-// Play startup sound to confirm driver functionality
-void EasyDrivers::startupSound(byte driverNum) {
-  unsigned int chargeNotes[] = {
-      noteDoubleTicks[31],
-      noteDoubleTicks[36],
-      noteDoubleTicks[38],
-      noteDoubleTicks[43],
-      0
-  };
-  byte i = 0;
-  unsigned long lastRun = 0;
-  while(i < 5) {
-    if (millis() - 200 > lastRun) {
-      lastRun = millis();
-      currentPeriod[driverNum] = chargeNotes[i++];
-    }
-  }
+void EasyDrivers::startupReset() {
+  resetAll();
 }
 
 //
@@ -153,23 +162,42 @@ void EasyDrivers::dev_reset(uint8_t subAddress) {
 void EasyDrivers::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
     // Set the current period to the new value to play it immediately
     // Also set the originalPeriod in-case we pitch-bend
-    if (payload[0] <= MAX_DRIVER_NOTE) {
-        currentPeriod[subAddress] = originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+    if (payload[0] <= MAX_DRIVER_NOTE && arpeggiator.noteOn(subAddress, payload[0])) {
+        modulation.noteOn(subAddress, payload[0]);
+        noInterrupts(); // The microstep mode and period have to change together
+        originalPeriod[subAddress] = notePeriod(subAddress, payload[0]);
+        currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
+        interrupts();
     }
 }
 
 void EasyDrivers::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    if (arpeggiator.noteOff(subAddress, payload[0])) {
+        currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    }
 }
 
 void EasyDrivers::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     // A value from -8192 to 8191 representing the pitch deflection
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
-    // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
-    //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    modulation.setBend(subAddress, bendDeflection);
+    currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
+}
+
+void EasyDrivers::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    switch (command) {
+    case NETBYTE_DEV_SETMODULATION:
+        modulation.setModulation(subAddress, payload);
+        break;
+    case NETBYTE_DEV_SETGLIDE:
+        modulation.setGlide(payload);
+        break;
+    case NETBYTE_DEV_SETARPEGGIO:
+        arpeggiator.setArpeggio(payload);
+        allocator.setStackDepth(arpeggiator.isEnabled() ? MOPPY_ARP_NOTES : 1);
+        break;
+    }
 }
 
 //
@@ -186,21 +214,27 @@ void EasyDrivers::tick()
    If there is a period set for step pin 2, count the number of
    ticks that pass, and toggle the pin if the current period is reached.
    */
-  if (currentPeriod[1]>0){
+  if (homingSteps[1]>0){
+    homeStep(1,2,3);
+  } else if (currentPeriod[1]>0){
     currentTick[1]++;
     if (currentTick[1] >= currentPeriod[1]){
       togglePin(1,2,3); // Drive 1 is on pins 2 and 3
       currentTick[1]=0;
     }
   }
-  if (currentPeriod[2]>0){
+  if (homingSteps[2]>0){
+    homeStep(2,6,7);
+  } else if (currentPeriod[2]>0){
     currentTick[2]++;
     if (currentTick[2] >= currentPeriod[2]){
       togglePin(2,6,7);
       currentTick[2]=0;
     }
   }
-  if (currentPeriod[3]>0){
+  if (homingSteps[3]>0){
+    homeStep(3,10,11);
+  } else if (currentPeriod[3]>0){
     currentTick[3]++;
     if (currentTick[3] >= currentPeriod[3]){
       togglePin(3,10,11);
@@ -210,6 +244,7 @@ void EasyDrivers::tick()
 }
 
 void EasyDrivers::togglePin(byte driverNum, byte pin, byte direction_pin) {
+  MOPPY_TRACE_EDGE(voiceOf(driverNum));
 // Switch directions if either end has been reached.
   if (digitalRead(driverNum*2+12)==LOW) { // If front direction pin is on, change direction.
     currentState[direction_pin] = HIGH;
@@ -225,6 +260,70 @@ void EasyDrivers::togglePin(byte driverNum, byte pin, byte direction_pin) {
   currentState[pin] = ~currentState[pin];
 }
 
+// Called by the timer every MOPPY_CONTROL_PERIOD to move the arpeggios and LFOs along
+void EasyDrivers::controlTick() {
+  arpeggiator.update();
+  modulation.update();
+  for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
+    if (originalPeriod[d] > 0 && modulation.isModulated(d)) {
+      currentPeriod[d] = modulation.period(d, originalPeriod[d]);
+    }
+  }
+}
+
+// Switches a driver to the next note of its arpeggio
+void EasyDrivers::arpNote(uint8_t subAddress, uint8_t note) {
+  originalPeriod[subAddress] = notePeriod(subAddress, note);
+  currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
+}
+
+/*
+Picks the microstep mode for a note, switches the driver to it and returns the note's period in
+two-tick units for that mode.  Must be called with interrupts off (or from the timer interrupt),
+so the tick can't step while MS1 and MS2 only half match the new mode or before the period does.
+ */
+unsigned int EasyDrivers::notePeriod(byte driverNum, uint8_t note) {
+  byte mode = EASYDRIVER_MAX_MICROSTEP;
+  while (mode > 0 && notePeriods[note] < (unsigned long)MICROSTEP_MIN_TICKS * (DOUBLE_T_RESOLUTION << mode)) {
+    mode--;
+  }
+  setMicrostep(driverNum, mode);
+
+  unsigned long modeTicks = (unsigned long)DOUBLE_T_RESOLUTION << mode;
+  return (notePeriods[note] + modeTicks / 2) / modeTicks;
+}
+
+// Sets a driver's MS1/MS2 pins for a microstep mode (see notePeriod() about interrupts)
+void EasyDrivers::setMicrostep(byte driverNum, byte mode) {
+  if (microstepMode[driverNum] == mode) {
+    return;
+  }
+  byte ms1Pin = (driverNum - 1) * 4 + 4; //4, 8, 12
+  digitalWrite(ms1Pin,MICROSTEP_LEVELS[mode][0]);
+  digitalWrite(ms1Pin+1,MICROSTEP_LEVELS[mode][1]);
+  microstepMode[driverNum] = mode;
+}
+
+// Moves a homing driver back a step at a time until the rear direction-switch triggers (or it
+// runs out of steps), then leaves it ready to go forward
+void EasyDrivers::homeStep(byte driverNum, byte pin, byte direction_pin) {
+  if (++currentTick[driverNum] < HOMING_TICKS) {
+    return;
+  }
+  currentTick[driverNum] = 0;
+
+  if (digitalRead(driverNum*2+13)==LOW || --homingSteps[driverNum]==0) {
+    homingSteps[driverNum] = 0;
+    digitalWrite(pin,LOW);
+    currentState[pin] = LOW;
+    digitalWrite(direction_pin,LOW);
+    currentState[direction_pin] = LOW; // Ready to go forward.
+    return;
+  }
+  digitalWrite(pin,HIGH);
+  digitalWrite(pin,LOW);
+}
+
 
 //
 //// UTILITY FUNCTIONS
@@ -239,66 +338,57 @@ void EasyDrivers::blinkLED(){
 
 // Immediately stops all drivers
 void EasyDrivers::haltAllDrivers() {
+  arpeggiator.reset(0);
+  modulation.reset(0);
   for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
-    currentPeriod[d] = 0;
+    currentPeriod[d] = originalPeriod[d] = 0;
   }
 }
 
-// For a given driver number, runs e.g. the scanner-head all the way back to the rear
+// For a given driver number, starts running e.g. the scanner-head all the way back to the rear.
+// The tick does the stepping, so this returns immediately.
 void EasyDrivers::reset(byte driverNum)
 {
-  currentPeriod[driverNum] = 0; // Stop note
+  arpeggiator.reset(driverNum);
+  currentPeriod[driverNum] = originalPeriod[driverNum] = 0; // Stop note
+  modulation.reset(driverNum);
 
   byte stepPin = (driverNum - 1) * 4 + 2; //2, 6, 10
 
-  // Uncomment this if you want to be able to reset the drivers!
-  /*
-  digitalWrite(stepPin+1,HIGH); // Go in reverse
-  while(digitalRead(driverNum*2+13)==HIGH) { //While the rear direction-switch is not triggered move backwards.
-    digitalWrite(stepPin,HIGH);
-    digitalWrite(stepPin,LOW);
-  }
-  */
   digitalWrite(stepPin,LOW);
   currentState[stepPin] = LOW;
+  noInterrupts();
+  setMicrostep(driverNum, 0); // Home at full steps
+  interrupts();
+#ifdef EASYDRIVER_HOMING_STEPS
+  digitalWrite(stepPin+1,HIGH); // Go in reverse
+  currentState[stepPin+1] = HIGH;
+  noInterrupts(); // Two bytes on AVR, don't let the tick see half of it
+  currentTick[driverNum] = 0;
+  homingSteps[driverNum] = EASYDRIVER_HOMING_STEPS;
+  interrupts();
+#else
   digitalWrite(stepPin+1,LOW);
   currentState[stepPin+1] = LOW; // Ready to go forward.
+#endif
 }
 
 // Resets all the drivers simultaneously
 void EasyDrivers::resetAll()
 {
-
-  // Stop all drivers and set to reverse
   for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
-    byte stepPin = (d - 1) * 4 + 2; //2, 6, 10
-    currentPeriod[d] = 0;
-    digitalWrite(stepPin+1,HIGH);
+    reset(d);
   }
+}
 
-  // Reset all drivers together
-  // Uncomment this if you want to be able to reset the drivers!
-  /*
-  for (unsigned int s=0;s<max_position;s++){ // This is kept because it provides the convenience, that all drivers reset at the same time.
-    for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
-      byte stepPin = (d - 1) * 4 + 2; //2, 6, 10
-      if(digitalRead(d*2+13)==HIGH) { //If the rear direction-switch is not triggered move backwards.
-        digitalWrite(stepPin,HIGH);
-        digitalWrite(stepPin,LOW);
-      } else {
-        digitalWrite(stepPin,LOW);
-      }
-    }
-    delay(5);
-  }
-*/
-
-  // Return tracking to ready state
+// True while any driver is still homing
+bool EasyDrivers::homing()
+{
   for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
-    byte stepPin = (d - 1) * 4 + 2; //2, 6, 10
-    currentState[stepPin] = LOW;
-    digitalWrite(stepPin+1,LOW);
-    currentState[stepPin+1] = LOW; // Ready to go forward.
+    if (homingSteps[d] > 0) {
+      return true;
+    }
   }
+  return false;
 }
 } // namespace instruments
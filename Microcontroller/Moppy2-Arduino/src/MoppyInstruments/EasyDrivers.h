@@ -8,12 +8,16 @@
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyModulation.h"
+#include "MoppyArpeggiator.h"
 #include "MoppyInstrument.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
 namespace instruments {
-  class EasyDrivers : public MoppyInstrument {
+  class EasyDrivers final : public MoppyStaticInstrument<EasyDrivers> {
+    friend class MoppyDispatcher<EasyDrivers>;
+
   public:
     void setup();
   protected:
@@ -24,21 +28,38 @@ namespace instruments {
       void dev_noteOn(uint8_t subAddress, uint8_t payload[]) override;
       void dev_noteOff(uint8_t subAddress, uint8_t payload[]) override;
       void dev_bendPitch(uint8_t subAddress, uint8_t payload[]) override;
+
+      void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) override;
+
+      bool startupHoming() override;
+      void startupNote(uint8_t note) override;
+      void startupReset() override;
   private:
+    MoppyVoiceAllocator allocator; // Picks drivers for NETBYTE_DEV_CHANNEL_NOTEON
+    static MoppyModulation modulation; // Pitch bend and LFOs
+    static MoppyArpeggiator arpeggiator; // Cycles through chords given to one driver
+
     static unsigned int MAX_POSITION[];
     static unsigned int currentPosition[];
     static int currentState[];
     static unsigned int currentPeriod[];
     static unsigned int currentTick[];
     static unsigned int originalPeriod[];
+    static unsigned int homingSteps[]; // Steps left before each driver gives up homing (0 when not homing)
+    static byte microstepMode[];
 
     static void resetAll();
     static void togglePin(byte driverNum, byte pin, byte direction_pin);
     static void haltAllDrivers();
     static void reset(byte driverNum);
+    static bool homing();
     static void tick();
+    static void controlTick();
+    static void arpNote(uint8_t subAddress, uint8_t note);
+    static unsigned int notePeriod(byte driverNum, uint8_t note);
+    static void setMicrostep(byte driverNum, byte mode);
+    static void homeStep(byte driverNum, byte pin, byte direction_pin);
     static void blinkLED();
-    static void startupSound(byte driverNum);
   };
 }
 
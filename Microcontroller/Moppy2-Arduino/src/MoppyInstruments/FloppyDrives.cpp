@@ -4,6 +4,7 @@
  * Output for controlling floppy drives.  The _original_ Moppy instrument!
  */
 #include "MoppyInstrument.h"
+#include "MoppyWarmBoot.h"
 #include "FloppyDrives.h"
 
 namespace instruments
@@ -57,6 +58,12 @@ namespace instruments
   unsigned int FloppyDrives::originalPeriod[] = {0, 0, 0, 0, 0};
 #endif
 
+  MoppyModulation FloppyDrives::modulation;
+  MoppyArpeggiator FloppyDrives::arpeggiator(FloppyDrives::arpNote);
+
+  // Drives are homed by the tick (see homeStep() below) rather than in a blocking loop
+  uint8_t FloppyDrives::homingSteps[LAST_DRIVE + 1];
+
 #ifdef ARDUINO_AVR_UNO
   // Array of STEP pin numbers for the used board pinout 
   const unsigned int FloppyDrives::STEP_PIN[] = {0, 2, 4, 6, 8, 10, 12, 14, 16, 18};
@@ -75,48 +82,43 @@ namespace instruments
 
   void FloppyDrives::setup()
   {
+    allocator.setRange(0, 0, MAX_FLOPPY_NOTE);
+    voiceAllocator = &allocator;
+
     // Prepare pins
     for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
       pinMode(STEP_PIN[d], OUTPUT);
       pinMode(DIR_PIN[d], OUTPUT);
     }
-    // With all pins setup, let's do a first run reset
-    resetAll();
-    delay(500); // Wait a half second for safety
-
-    // Setup timer to handle interrupts for floppy driving
+    // Setup timer to handle interrupts for floppy driving (homing happens in the tick too)
     MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+    MoppyTimer::addCallback(controlTick, MOPPY_CONTROL_PERIOD);
 
-    // If MoppyConfig wants a startup sound, play the startupSound on the
-    // first drive.
-    if (PLAY_STARTUP_SOUND)
+    // If the heads' positions survived a restart they don't need to be homed, otherwise
+    // start a first run reset.  Either way the rest of startup happens in the background.
+    bool warmBoot = MoppyWarmBoot::restore(&currentPosition[FIRST_DRIVE], LAST_DRIVE - FIRST_DRIVE + 1, homing);
+    if (!warmBoot)
     {
-      startupSound(FIRST_DRIVE);
-      delay(500);
       resetAll();
     }
+    beginStartup(warmBoot);
   }
 
-  // Play startup sound to confirm drive functionality
-  void FloppyDrives::startupSound(byte driveNum)
-  {
-    unsigned int chargeNotes[] = {
-        noteDoubleTicks[31],
-        noteDoubleTicks[36],
-        noteDoubleTicks[38],
-        noteDoubleTicks[43],
-        0};
-    byte i = 0;
-    unsigned long lastRun = 0;
-    while (i < 5)
-    {
-      if (millis() - 200 > lastRun)
-      {
-        lastRun = millis();
-        currentPeriod[driveNum] = chargeNotes[i++];
-      }
-    }
+  bool FloppyDrives::startupHoming()
+  {
+    return homing();
+  }
+
+  // Play startup sound on the first drive to confirm drive functionality
+  void FloppyDrives::startupNote(uint8_t note)
+  {
+    currentPeriod[FIRST_DRIVE] = noteDoubleTicks[note];
+  }
+
+  void FloppyDrives::startupReset()
+  {
+    resetAll();
   }
 
   //
@@ -147,15 +149,20 @@ namespace instruments
 
   void FloppyDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[])
   {
-    if (payload[0] <= MAX_FLOPPY_NOTE)
+    if (payload[0] <= MAX_FLOPPY_NOTE && arpeggiator.noteOn(subAddress, payload[0]))
     {
-      currentPeriod[subAddress] = originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+      originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+      modulation.noteOn(subAddress, payload[0]);
+      currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
     }
   }
 
   void FloppyDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[])
   {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    if (arpeggiator.noteOff(subAddress, payload[0]))
+    {
+      currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    }
   }
 
   void FloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[])
@@ -163,10 +170,8 @@ namespace instruments
     // A value from -8192 to 8191 representing the pitch deflection
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
-    // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
-    //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    modulation.setBend(subAddress, bendDeflection);
+    currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
   }
 
   void FloppyDrives::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[])
@@ -176,6 +181,16 @@ namespace instruments
     case NETBYTE_DEV_SETMOVEMENT:
       setMovement(subAddress, payload[0] == 0); // MIDI bytes only go to 127, so * 2
       break;
+    case NETBYTE_DEV_SETMODULATION:
+      modulation.setModulation(subAddress, payload);
+      break;
+    case NETBYTE_DEV_SETGLIDE:
+      modulation.setGlide(payload);
+      break;
+    case NETBYTE_DEV_SETARPEGGIO:
+      arpeggiator.setArpeggio(payload);
+      allocator.setStackDepth(arpeggiator.isEnabled() ? MOPPY_ARP_NOTES : 1);
+      break;
     }
   }
 
@@ -221,7 +236,15 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
    */
     for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
-      if (currentPeriod[d] > 0)
+      if (homingSteps[d] > 0)
+      {
+        if (++currentTick[d] >= HOMING_TICKS)
+        {
+          homeStep(d);
+          currentTick[d] = 0;
+        }
+      }
+      else if (currentPeriod[d] > 0)
       {
         currentTick[d]++;
         if (currentTick[d] >= currentPeriod[d])
@@ -269,6 +292,67 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
     //Pulse the STEP pin
     digitalWrite(STEP_PIN[driveNum], currentStepState[driveNum]);
     currentStepState[driveNum] = ~currentStepState[driveNum];
+    MOPPY_TRACE_EDGE(voiceOf(driveNum));
+  }
+
+  // Called by the timer every MOPPY_CONTROL_PERIOD to move the arpeggios and LFOs along
+#ifdef ARDUINO_ARCH_ESP8266
+  void ICACHE_RAM_ATTR FloppyDrives::controlTick()
+  {
+#elif ARDUINO_ARCH_ESP32
+  void IRAM_ATTR FloppyDrives::controlTick()
+  {
+#else
+  void FloppyDrives::controlTick()
+  {
+#endif
+    arpeggiator.update();
+    modulation.update();
+    for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
+    {
+      if (originalPeriod[d] > 0 && modulation.isModulated(d))
+      {
+        currentPeriod[d] = modulation.period(d, originalPeriod[d]);
+      }
+    }
+  }
+
+  // Moves a homing drive one half-step further back, and leaves it ready to go forward
+  // from position 0 once it's done
+#ifdef ARDUINO_ARCH_ESP8266
+  void ICACHE_RAM_ATTR FloppyDrives::homeStep(byte driveNum)
+  {
+#elif ARDUINO_ARCH_ESP32
+  void IRAM_ATTR FloppyDrives::homeStep(byte driveNum)
+  {
+#else
+  void FloppyDrives::homeStep(byte driveNum)
+  {
+#endif
+    digitalWrite(STEP_PIN[driveNum], currentStepState[driveNum]);
+    currentStepState[driveNum] = ~currentStepState[driveNum];
+
+    if (--homingSteps[driveNum] == 0)
+    {
+      currentPosition[driveNum] = 0; // We're reset.
+      digitalWrite(DIR_PIN[driveNum], LOW);
+      currentDirState[driveNum] = LOW; // Ready to go forward.
+    }
+  }
+
+  // Switches a drive to the next note of its arpeggio
+#ifdef ARDUINO_ARCH_ESP8266
+  void ICACHE_RAM_ATTR FloppyDrives::arpNote(uint8_t subAddress, uint8_t note)
+  {
+#elif ARDUINO_ARCH_ESP32
+  void IRAM_ATTR FloppyDrives::arpNote(uint8_t subAddress, uint8_t note)
+  {
+#else
+  void FloppyDrives::arpNote(uint8_t subAddress, uint8_t note)
+  {
+#endif
+    originalPeriod[subAddress] = noteDoubleTicks[note];
+    currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
   }
 #pragma GCC pop_options
 
@@ -287,61 +371,50 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
   // Immediately stops all drives
   void FloppyDrives::haltAllDrives()
   {
+    arpeggiator.reset(0);
+    modulation.reset(0);
     for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
-      currentPeriod[d] = 0;
+      currentPeriod[d] = originalPeriod[d] = 0;
     }
   }
 
-  //For a given floppy number, runs the read-head all the way back to 0
+  //For a given floppy number, starts running the read-head all the way back to 0.  The
+  //tick does the stepping, so this returns immediately.
   void FloppyDrives::reset(byte driveNum)
   {
-    currentPeriod[driveNum] = 0; // Stop note
-
+    arpeggiator.reset(driveNum);
+    modulation.reset(driveNum);
+    noInterrupts(); // The tick reads all of these
+    currentPeriod[driveNum] = originalPeriod[driveNum] = 0; // Stop note
+    setMovement(driveNum, true);      // Set movement to true by default
+    currentStepState[driveNum] = LOW; // Even number of toggles, so this ends LOW
+    currentDirState[driveNum] = HIGH;
     digitalWrite(DIR_PIN[driveNum], HIGH); // Go in reverse
-    for (unsigned int s = 0; s < MAX_POSITION[driveNum]; s += 2)
-    { // Half max because we're stepping directly (no toggle)
-      digitalWrite(STEP_PIN[driveNum], HIGH);
-      digitalWrite(STEP_PIN[driveNum], LOW);
-      delay(5);
-    }
-    currentPosition[driveNum] = 0;    // We're reset.
-    currentStepState[driveNum] = LOW; // Last step state is LOW
-    digitalWrite(DIR_PIN[driveNum], LOW);
-    currentDirState[driveNum] = LOW; // Ready to go forward.
-    setMovement(driveNum, true);     // Set movement to true by default
+    currentTick[driveNum] = 0;
+    homingSteps[driveNum] = MAX_POSITION[0]; // Full travel, whatever this drive's movement limits were
+    interrupts();
   }
 
   // Resets all the drives simultaneously
   void FloppyDrives::resetAll()
   {
-
-    // Stop all drives and set to reverse
     for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
-      currentPeriod[d] = 0;
-      digitalWrite(DIR_PIN[d], HIGH);
-    }
-
-    // Reset all drives together
-    for (unsigned int s = 0; s < MAX_POSITION[0]; s += 2)
-    { //Half max because we're stepping directly (no toggle); grab max from index 0
-      for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
-      {
-        digitalWrite(STEP_PIN[d], HIGH);
-        digitalWrite(STEP_PIN[d], LOW);
-      }
-      delay(5);
+      reset(d);
     }
+  }
 
-    // Return tracking to ready state
+  // True while any drive is still homing
+  bool FloppyDrives::homing()
+  {
     for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
-      currentPosition[d] = 0;    // We're reset.
-      currentStepState[d] = LOW; // Last step state is LOW
-      digitalWrite(DIR_PIN[d], LOW);
-      currentDirState[d] = LOW; // Ready to go forward.
-      setMovement(d, true);     // Set movement to true by default
+      if (homingSteps[d] > 0)
+      {
+        return true;
+      }
     }
+    return false;
   }
 } // namespace instruments
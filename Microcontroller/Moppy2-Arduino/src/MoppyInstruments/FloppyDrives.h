@@ -8,12 +8,16 @@
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyModulation.h"
+#include "MoppyArpeggiator.h"
 #include "MoppyInstrument.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
 namespace instruments {
-  class FloppyDrives : public MoppyInstrument {
+  class FloppyDrives final : public MoppyStaticInstrument<FloppyDrives> {
+      friend class MoppyDispatcher<FloppyDrives>;
+
   public:
       void setup();
 
@@ -28,7 +32,15 @@ namespace instruments {
 
       void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
 
+      bool startupHoming() override;
+      void startupNote(uint8_t note) override;
+      void startupReset() override;
+
   private:
+    MoppyVoiceAllocator allocator; // Picks drives for NETBYTE_DEV_CHANNEL_NOTEON
+    static MoppyModulation modulation; // Pitch bend and LFOs
+    static MoppyArpeggiator arpeggiator; // Cycles through chords given to one drive
+
     static unsigned int MIN_POSITION[];
     static unsigned int MAX_POSITION[];
     static unsigned int currentPosition[];
@@ -37,6 +49,7 @@ namespace instruments {
     static unsigned int currentPeriod[];
     static unsigned int currentTick[];
     static unsigned int originalPeriod[];
+    static uint8_t homingSteps[]; // Step-pin toggles left before each drive is homed (0 when not homing)
     static const unsigned int STEP_PIN[];
     static const unsigned int DIR_PIN[];
 
@@ -49,8 +62,8 @@ namespace instruments {
     static const byte FIRST_DRIVE = 1;
     static const byte LAST_DRIVE = 16;
     #elif ARDUINO_ARCH_ESP8266
-    static const byte FIRST_DRIVE = 1
-    static const byte LAST_DRIVE = 4
+    static const byte FIRST_DRIVE = 1;
+    static const byte LAST_DRIVE = 4;
     #endif
 
     // Maximum note number to attempt to play on floppy drives.  It's possible higher notes may work,
@@ -61,9 +74,12 @@ namespace instruments {
     static void togglePin(byte driveNum);
     static void haltAllDrives();
     static void reset(byte driveNum);
+    static bool homing();
     static void tick();
+    static void controlTick();
+    static void arpNote(uint8_t subAddress, uint8_t note);
+    static void homeStep(byte driveNum);
     static void blinkLED();
-    static void startupSound(byte driveNum);
     static void setMovement(byte driveNum, bool movementEnabled);
   };
 }
@@ -15,14 +15,14 @@ namespace instruments
  *
  */
 
-  // Array to keep track of the state of each drive.
-  uint8_t HardDrives::currentDriveState[] = {0, LOW, LOW, LOW, LOW};
-  // Current period assigned to each drive.  0 = off.  Each period is two-ticks (as defined by
-  // TIMER_RESOLUTION in MoppyInstrument.h) long.
-  uint32_t HardDrives::currentTick[] = {0, 0, 0, 0, 0};
-  const uint32_t HardDrives::PULSE_LENGTH[] = {300, 300, 300, 300, 300};
-
-#ifdef ARDUINO_AVR_UNO
+  // The velocity of incoming notes sets how long the coil is energized, from MIN_PULSE_MICROS
+  // up to MIN_PULSE_MICROS + PULSE_MICROS_RANGE (a 12ms pulse at full velocity)
+#define MIN_PULSE_MICROS 4000
+#define PULSE_MICROS_RANGE 8000
+
+  // On a Mega these stay clear of the floppy drive pins (22 and up), so both can be used at once
+  // with INSTRUMENT_COMPOSITE
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_MEGA2560)
   // Array of A pin numbers for the used board pinout (input A of the L293D) 
   const uint8_t HardDrives::A_PIN[] = {0, 2, 4, 6, 8};
   // Array of B pin numbers for the used board pinout (input B of the L293D) 
@@ -45,25 +45,27 @@ namespace instruments
     }
     // With all pins setup, let's do a first run reset
     resetAll();
-    delay(500); // Wait a half second for safety
 
-    // Setup timer to handle interrupts for floppy driving
-    MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+    // Coils are released by the pulse timer, nothing runs between hits
+    MoppyPulses::begin();
 
-    // If MoppyConfig wants a startup sound, play the startupSound on the
-    // first drive.
-    if (PLAY_STARTUP_SOUND)
+    // Nothing to home, so this just plays the startup sound (in the background)
+    beginStartup(false);
+  }
+
+  // Play startup sound on the first drive to confirm drive functionality.  Hard drives only
+  // click, so any note does.
+  void HardDrives::startupNote(uint8_t note)
+  {
+    if (note != 0)
     {
-      startupSound(FIRST_DRIVE);
-      delay(500);
-      resetAll();
+      hit(FIRST_DRIVE, 127);
     }
   }
 
-  // Play startup sound to confirm drive functionality
-  void HardDrives::startupSound(uint8_t driveNum)
+  void HardDrives::startupReset()
   {
-    currentDriveState[driveNum] = HIGH;
+    resetAll();
   }
 
   //
@@ -94,9 +96,7 @@ namespace instruments
 
   void HardDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[])
   {
-    //blinkLED(); // TODO
-    currentDriveState[subAddress] = HIGH; //TODO Reenable
-    //energizeCoil(subAddress, 0);
+    hit(subAddress, payload[1]);
   }
 
   void HardDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[])
@@ -121,48 +121,8 @@ namespace instruments
 //// Floppy driving functions
 //
 
-/*
-Called by the timer interrupt at the specified resolution.  Because this is called extremely often,
-it's crucial that any computations here be kept to a minimum!
-
-Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but may increase speed generally anyway
- */
 #pragma GCC push_options
-#pragma GCC optimize("Ofast") // Required to unroll this loop, but useful to try to keep this speedy
-#ifdef ARDUINO_ARCH_ESP8266
-  void ICACHE_RAM_ATTR HardDrives::tick()
-#elif ARDUINO_ARCH_ESP32
-  void IRAM_ATTR HardDrives::tick()
-#else
-  void HardDrives::tick()
-#endif
-  {
-    /*
-   For each drive, count the number of
-   ticks that pass, and toggle the pin if the current period is reached.
-   */
-    for (uint8_t d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
-    {
-      if (currentDriveState[d] == HIGH)
-      {
-        currentTick[d]++;
-        if (currentTick[d] < PULSE_LENGTH[d])
-        {
-          energizeCoil(d, 0);
-        }
-        else
-        {
-          currentDriveState[d] = LOW;
-          deenergizeCoil(d);
-        }
-      }
-      else
-      {
-        currentTick[d] = 0;
-      }
-    }
-  }
-  
+#pragma GCC optimize("Ofast")
   inline void HardDrives::energizeCoil(uint8_t driveNum, uint8_t direction)
   {
     digitalWrite(A_PIN[driveNum], !direction);
@@ -175,6 +135,29 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
     digitalWrite(B_PIN[driveNum], LOW);
   }
 
+  // Energize the coil now and have the pulse timer release it (a hit while the coil is still
+  // energized just extends the pulse)
+  void HardDrives::hit(uint8_t driveNum, uint8_t velocity)
+  {
+    energizeCoil(driveNum, 0);
+    MOPPY_TRACE_EDGE(voiceOf(driveNum));
+    MoppyPulses::schedule(releaseCoil, driveNum, MoppyPulses::velocityLength(velocity, MIN_PULSE_MICROS, PULSE_MICROS_RANGE));
+  }
+
+/*
+Called by the pulse timer interrupt, so the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries
+ */
+#ifdef ARDUINO_ARCH_ESP8266
+  void ICACHE_RAM_ATTR HardDrives::releaseCoil(uint8_t driveNum)
+#elif ARDUINO_ARCH_ESP32
+  void IRAM_ATTR HardDrives::releaseCoil(uint8_t driveNum)
+#else
+  void HardDrives::releaseCoil(uint8_t driveNum)
+#endif
+  {
+    deenergizeCoil(driveNum);
+  }
+
 #pragma GCC pop_options
 
   //
@@ -192,31 +175,28 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
   // Immediately stops all drives
   void HardDrives::haltAllDrives()
   {
+    MoppyPulses::cancelAll(releaseCoil);
     for (uint8_t d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
-      currentDriveState[d] = LOW;
+      deenergizeCoil(d);
     }
   }
 
   //For a given floppy number, runs the read-head all the way back to 0
   void HardDrives::reset(uint8_t driveNum)
   {
-    currentDriveState[driveNum] = LOW; // Stop note
-    currentTick[driveNum] = 0; 
+    MoppyPulses::cancel(releaseCoil, driveNum); // Stop note
     deenergizeCoil(driveNum);
-    delay(5);
   }
 
   // Resets all the drives simultaneously
   void HardDrives::resetAll()
   {
-    // Stop all drives and set to reverse
+    // Stop all drives
+    MoppyPulses::cancelAll(releaseCoil);
     for (uint8_t d = FIRST_DRIVE; d <= LAST_DRIVE; d++)
     {
-      currentDriveState[d] = LOW; // Stop note
-      currentTick[d] = 0;
       deenergizeCoil(d);
     }
-    delay(5);
   }
 } // namespace instruments
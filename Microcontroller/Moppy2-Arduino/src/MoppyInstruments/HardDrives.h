@@ -7,13 +7,15 @@
 #define SRC_MOPPYINSTRUMENTS_HARDDRIVES_H_
 
 #include <Arduino.h>
-#include "MoppyTimer.h"
+#include "MoppyPulses.h"
 #include "MoppyInstrument.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
 namespace instruments {
-  class HardDrives : public MoppyInstrument {
+  class HardDrives final : public MoppyStaticInstrument<HardDrives> {
+      friend class MoppyDispatcher<HardDrives>;
+
   public:
       void setup();
 
@@ -28,12 +30,12 @@ namespace instruments {
 
       void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
 
+      void startupNote(uint8_t note) override;
+      void startupReset() override;
+
   private:
-    static uint8_t currentDriveState[];
-    static uint32_t currentTick[];
     static const uint8_t A_PIN[];
     static const uint8_t B_PIN[];
-    static const uint32_t PULSE_LENGTH[];
     // First drive being used for floppies, and the last drive.  Used for calculating
     // step and direction pins.
     static const uint8_t FIRST_DRIVE = 1;
@@ -46,9 +48,9 @@ namespace instruments {
     static void resetAll();
     static void haltAllDrives();
     static void reset(uint8_t driveNum);
-    static void tick();
     static void blinkLED();
-    static void startupSound(uint8_t driveNum);
+    static void hit(uint8_t driveNum, uint8_t velocity);
+    static void releaseCoil(uint8_t driveNum);
     static void energizeCoil(uint8_t driveNum, uint8_t direction);
     static void deenergizeCoil(uint8_t driveNum);
   };
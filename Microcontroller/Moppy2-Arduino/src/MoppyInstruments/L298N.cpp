@@ -7,8 +7,27 @@
 #include "L298N.h"
 
 namespace instruments {
-// Used to keep track of what to do for the next step according to the table of bipolar stepper motors.
-int L298N::currentStep[] = {0,0,0,0,0}; 
+// Coil patterns for the eight half-steps of a bipolar stepper, from bit 0 for IN1 to bit 3 for IN4.
+// Wave drive uses the even ones (one coil on), full steps the odd ones (both coils on), and
+// half steps all of them.
+const byte HALF_STEP_COILS[8] = {0b0001, 0b0101, 0b0100, 0b0110, 0b0010, 0b1010, 0b1000, 0b1001};
+
+// IN1-IN4 pins of each bridge
+const byte BRIDGE_PINS[][4] = {{0,0,0,0},{2,3,4,5},{6,7,8,9},{10,11,12,13},{14,15,16,17}};
+
+// Used to keep track of what to do for the next step: the half-step pattern each bridge is at.
+byte L298N::currentStep[] = {1,1,1,1,1};
+
+// How each bridge steps (see StepMode in L298N.h)
+L298N::StepMode L298N::stepMode[] = {STEP_FULL,STEP_FULL,STEP_FULL,STEP_FULL,STEP_FULL};
+
+#ifdef ARDUINO_ARCH_AVR
+// Output registers for each bridge's pins (NULL past the last one used), the bits of them that
+// are the bridge's, and the value of those bits for each half-step pattern
+volatile uint8_t *L298N::stepPort[5][BRIDGE_PORTS];
+uint8_t L298N::stepPortMask[5][BRIDGE_PORTS];
+uint8_t L298N::stepPortBits[5][BRIDGE_PORTS][8];
+#endif
 
 // First and last bridge
 int L298N::FIRST_BRIDGE = 1;
@@ -42,7 +61,16 @@ unsigned int L298N::currentTick[] = {0,0,0,0,0};
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
 unsigned int L298N::originalPeriod[] = {0,0,0,0,0};
 
+MoppyModulation L298N::modulation;
+MoppyArpeggiator L298N::arpeggiator(L298N::arpNote);
+
 void L298N::setup() {
+  // Only sub-addresses with a bridge get channel notes
+  allocator.setRange(0, 1, 0);
+  for (int b = FIRST_BRIDGE; b <= LAST_BRIDGE; b++) {
+    allocator.setRange(b, 0, 127);
+  }
+  voiceAllocator = &allocator;
 
   // Prepare pins (0 and 1 are reserved for Serial communications)
   pinMode(2, OUTPUT); // IN1 for bridge 1
@@ -61,41 +89,28 @@ void L298N::setup() {
   pinMode(15, OUTPUT); // IN2 for bridge 4
   pinMode(16, OUTPUT); // IN3 for bridge 4
   pinMode(17, OUTPUT); // IN4 for bridge 4
-
+#ifdef ARDUINO_ARCH_AVR
+  buildStepTables();
+#endif
 
   // With all pins setup, let's do a first run reset
   resetAll();
-  delay(500); // Wait a half second for safety
 
   // Setup timer to handle interrupts for driving the bridges
   MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+  MoppyTimer::addCallback(controlTick, MOPPY_CONTROL_PERIOD);
 
-  // If MoppyConfig wants a startup sound, play the startupSound on the
-  // first drive.
-  if (PLAY_STARTUP_SOUND) {
-    startupSound(FIRST_BRIDGE);
-    delay(500);
-    resetAll();
-  }
+  // Nothing to home, so this just plays the startup sound (in the background)
+  beginStartup(false);
 }
 
-// Play startup sound to confirm drive functionality
-void L298N::startupSound(byte driveNum) {
-  unsigned int chargeNotes[] = {
-      noteTicks[31],
-      noteTicks[36],
-      noteTicks[38],
-      noteTicks[43],
-      0
-  };
-  byte i = 0;
-  unsigned long lastRun = 0;
-  while(i < 5) {
-    if (millis() - 200 > lastRun) {
-      lastRun = millis();
-      currentPeriod[driveNum] = chargeNotes[i++];
-    }
-  }
+// Play startup sound on the first bridge to confirm drive functionality
+void L298N::startupNote(uint8_t note) {
+  currentPeriod[FIRST_BRIDGE] = noteTicks[note];
+}
+
+void L298N::startupReset() {
+  resetAll();
 }
 
 //
@@ -119,23 +134,51 @@ void L298N::dev_reset(uint8_t subAddress) {
 }
 
 void L298N::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = noteTicks[payload[0]];
+    if (arpeggiator.noteOn(subAddress, payload[0])) {
+        originalPeriod[subAddress] = noteTicks[payload[0]];
+        modulation.noteOn(subAddress, payload[0]);
+        currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
+    }
 }
 
 void L298N::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    if (arpeggiator.noteOff(subAddress, payload[0])) {
+        currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    }
 };
 
 void L298N::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     // A value from -8192 to 8191 representing the pitch deflection
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
-    // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
-    //L298N::currentPeriod[subAddress] = L298N::originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    modulation.setBend(subAddress, bendDeflection);
+    currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
 };
 
+void L298N::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    switch (command) {
+    case NETBYTE_DEV_SETMODULATION:
+        modulation.setModulation(subAddress, payload);
+        break;
+    case NETBYTE_DEV_SETGLIDE:
+        modulation.setGlide(payload);
+        break;
+    case NETBYTE_DEV_SETARPEGGIO:
+        arpeggiator.setArpeggio(payload);
+        allocator.setStackDepth(arpeggiator.isEnabled() ? MOPPY_ARP_NOTES : 1);
+        break;
+    case NETBYTE_DEV_SETSTEPMODE:
+        if (payload[0] <= STEP_HALF) {
+            for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
+                if (subAddress == 0 || subAddress == d) {
+                    setStepMode(d, (StepMode)payload[0]);
+                }
+            }
+        }
+        break;
+    }
+}
+
 //
 //// Bridge driving functions
 //
@@ -147,41 +190,39 @@ it's crucial that any computations here be kept to a minimum!
 void L298N::tick()
 {
   /*
-   If there is a period set for bridge 1, count the number of
-   ticks that pass, and toggle the pin if the current period is reached.
+   If there is a period set for a bridge, count the number of
+   ticks that pass, and step it if the current period is reached.
    */
-  if (currentPeriod[1]>0){
-    currentTick[1]++;
-    if (currentTick[1] >= currentPeriod[1]){
-      step(1,2,3,4,5); // Bridge 1 is on pin 2,3,4,5
-      currentTick[1]=0;
-    }
-  }
-  if (currentPeriod[2]>0){
-    currentTick[2]++;
-    if (currentTick[2] >= currentPeriod[2]){
-      step(2,6,7,8,9);
-      currentTick[2]=0;
-    }
-  }
-  if (currentPeriod[3]>0){
-    currentTick[3]++;
-    if (currentTick[3] >= currentPeriod[3]){
-      step(3,10,11,12,13);
-      currentTick[3]=0;
+  for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
+    if (currentPeriod[d]>0){
+      currentTick[d]++;
+      if (currentTick[d] >= currentPeriod[d]){
+        step(d);
+        currentTick[d]=0;
+      }
     }
   }
-  if (currentPeriod[3]>0){
-    currentTick[3]++;
-    if (currentTick[3] >= currentPeriod[3]){
-      step(4,14,15,16,17);
-      currentTick[3]=0;
+}
+
+// Called by the timer every MOPPY_CONTROL_PERIOD to move the arpeggios and LFOs along
+void L298N::controlTick() {
+  arpeggiator.update();
+  modulation.update();
+  for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
+    if (originalPeriod[d] > 0 && modulation.isModulated(d)) {
+      currentPeriod[d] = modulation.period(d, originalPeriod[d]);
     }
   }
 }
 
+// Switches a bridge to the next note of its arpeggio
+void L298N::arpNote(uint8_t subAddress, uint8_t note) {
+  originalPeriod[subAddress] = noteTicks[note];
+  currentPeriod[subAddress] = modulation.period(subAddress, originalPeriod[subAddress]);
+}
 
-void L298N::step(byte bridgeNum, byte pin1, byte pin2, byte pin3, byte pin4) {
+void L298N::step(byte bridgeNum) {
+  MOPPY_TRACE_EDGE(voiceOf(bridgeNum));
   //Switch directions if end has been reached
   if (currentPosition[bridgeNum] >= MAX_POSITION[bridgeNum]) {
     currentDir[bridgeNum] = 1;
@@ -197,53 +238,64 @@ void L298N::step(byte bridgeNum, byte pin1, byte pin2, byte pin3, byte pin4) {
   else {
     currentPosition[bridgeNum]++;
   }
-	if (currentDir[bridgeNum] == 0) {
-	if (currentStep[bridgeNum] >= 3) {
-		currentStep[bridgeNum] = 0;
-	}
-	else {
-		currentStep[bridgeNum]++;
-	}
-	}
-	if (currentDir[bridgeNum] == 1) {
-	if (currentStep[bridgeNum] <= 0) {
-		currentStep[bridgeNum] = 3;
-	}
-	else {
-		currentStep[bridgeNum]--;
-	}
-	}
-
-  //Make a step in the right direction
-switch (currentStep[bridgeNum]) { // Table of steps. Steps need to follow this order. If in reverse,
-// we start from the bottom.
-      case 0:  
-        digitalWrite(pin1, HIGH);
-        digitalWrite(pin2, LOW);
-        digitalWrite(pin3, HIGH);
-        digitalWrite(pin4, LOW);
-      break;
-      case 1:   
-        digitalWrite(pin1, LOW);
-        digitalWrite(pin2, HIGH);
-        digitalWrite(pin3, HIGH);
-        digitalWrite(pin4, LOW);
-
-      break;
-      case 2:  	 
-        digitalWrite(pin1, LOW);
-        digitalWrite(pin2, HIGH);
-        digitalWrite(pin3, LOW);
-        digitalWrite(pin4, HIGH);
-      break;
-      case 3:  
- 
-        digitalWrite(pin1, HIGH);
-        digitalWrite(pin2, LOW);
-        digitalWrite(pin3, LOW);
-        digitalWrite(pin4, HIGH);
-      break;
+
+  // Wave and full steps skip every other half-step pattern
+  byte stride = stepMode[bridgeNum] == STEP_HALF ? 1 : 2;
+  if (currentDir[bridgeNum] == 0) {
+    currentStep[bridgeNum] = (currentStep[bridgeNum] + stride) & 7;
+  }
+  else {
+    currentStep[bridgeNum] = (currentStep[bridgeNum] - stride) & 7;
+  }
+  writeCoils(bridgeNum, currentStep[bridgeNum]);
+}
+
+// Sets the bridge's IN1-IN4 to a half-step pattern
+void L298N::writeCoils(byte bridgeNum, byte halfStep) {
+#ifdef ARDUINO_ARCH_AVR
+  for (byte p = 0; p < BRIDGE_PORTS && stepPort[bridgeNum][p] != NULL; p++) {
+    *stepPort[bridgeNum][p] = (*stepPort[bridgeNum][p] & ~stepPortMask[bridgeNum][p]) | stepPortBits[bridgeNum][p][halfStep];
+  }
+#else
+  for (byte i = 0; i < 4; i++) {
+    digitalWrite(BRIDGE_PINS[bridgeNum][i], (HALF_STEP_COILS[halfStep] >> i) & 1);
+  }
+#endif
+}
+
+#ifdef ARDUINO_ARCH_AVR
+// Works out which port bits each bridge's pins are, and what to write to them for every half-step
+void L298N::buildStepTables() {
+  for (byte b=FIRST_BRIDGE;b<=LAST_BRIDGE;b++) {
+    for (byte i = 0; i < 4; i++) {
+      volatile uint8_t *port = portOutputRegister(digitalPinToPort(BRIDGE_PINS[b][i]));
+      uint8_t bit = digitalPinToBitMask(BRIDGE_PINS[b][i]);
+      byte p = 0;
+      while (stepPort[b][p] != NULL && stepPort[b][p] != port) {
+        p++;
+      }
+      stepPort[b][p] = port;
+      stepPortMask[b][p] |= bit;
+      for (byte s = 0; s < 8; s++) {
+        if ((HALF_STEP_COILS[s] >> i) & 1) {
+          stepPortBits[b][p][s] |= bit;
+        }
+      }
     }
+  }
+}
+#endif
+
+// Sets how a bridge steps, lining its position up with the patterns that mode uses
+void L298N::setStepMode(byte bridgeNum, StepMode mode) {
+  noInterrupts(); // Don't let the tick step in between
+  stepMode[bridgeNum] = mode;
+  if (mode == STEP_WAVE) {
+    currentStep[bridgeNum] &= ~1;
+  } else if (mode == STEP_FULL) {
+    currentStep[bridgeNum] |= 1;
+  }
+  interrupts();
 }
 
 
@@ -260,15 +312,19 @@ void L298N::blinkLED(){
 
 // Immediately stops all drives
 void L298N::haltAllDrives() {
+  arpeggiator.reset(0);
+  modulation.reset(0);
   for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
-    currentPeriod[d] = 0;
+    currentPeriod[d] = originalPeriod[d] = 0;
   }
 }
 
 //For a given bridge number, stop the note and set its position to zero
 void L298N::reset(byte bridgeNum)
 {
-  currentPeriod[bridgeNum] = 0; // Stop note
+  arpeggiator.reset(bridgeNum);
+  currentPeriod[bridgeNum] = originalPeriod[bridgeNum] = 0; // Stop note
+  modulation.reset(bridgeNum);
   currentPosition[bridgeNum] = 0; // We're reset.
 }
 
@@ -276,20 +332,11 @@ void L298N::reset(byte bridgeNum)
 void L298N::resetAll()
 {
 
-  // Stop all bridges and set to reverse
-  for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
-    currentPeriod[d] = 0;
-  }
-
-  // Reset all drives together
-  for (unsigned int s=0;s<MAX_POSITION[0];s+=2){ //Half max because we're stepping directly (no toggle); grab max from index 0
-    for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
-    }
-    delay(5);
-  }
-
-  // Return tracking to ready state
+  // Steppers have no end stops to home against, so just stop them and zero the tracking
+  arpeggiator.reset(0);
   for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
+    currentPeriod[d] = originalPeriod[d] = 0;
+    modulation.reset(d);
     currentPosition[d] = 0; // We're reset.
   }
 }
@@ -17,6 +17,9 @@ pin 14 (A0), IN1 for bridge 4
 pin 15 (A1), IN2 for bridge 4
 pin 16 (A2), IN3 for bridge 4
 pin 17 (A3), IN4 for bridge 4
+
+Each bridge can step in one of the StepModes, set with NETBYTE_DEV_SETSTEPMODE and a payload of
+[mode] (to sub-address 0 for all bridges).  A note's pitch is its step rate in every mode.
  */
 
 #ifndef SRC_MOPPYINSTRUMENTS_L298N_H_
@@ -24,13 +27,26 @@ pin 17 (A3), IN4 for bridge 4
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyModulation.h"
+#include "MoppyArpeggiator.h"
 #include "MoppyInstrument.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
+// A bridge's pins span at most two ports (bridge 2 is on PORTD and PORTB on an Uno)
+#define BRIDGE_PORTS 2
+
 namespace instruments {
-  class L298N : public MoppyInstrument {
+  class L298N final : public MoppyStaticInstrument<L298N> {
+    friend class MoppyDispatcher<L298N>;
+
   public:
+    enum StepMode : uint8_t {
+      STEP_WAVE, // One coil on at a time
+      STEP_FULL, // Both coils on, the most torque (the default)
+      STEP_HALF  // Alternates between the two, smaller steps
+    };
+
     void setup();
   protected:
     void sys_sequenceStop() override;
@@ -40,23 +56,44 @@ namespace instruments {
     void dev_noteOn(uint8_t subAddress, uint8_t payload[]) override;
     void dev_noteOff(uint8_t subAddress, uint8_t payload[]) override;
     void dev_bendPitch(uint8_t subAddress, uint8_t payload[]) override;
+
+    void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) override;
+
+    void startupNote(uint8_t note) override;
+    void startupReset() override;
   private:
+    MoppyVoiceAllocator allocator; // Picks bridges for NETBYTE_DEV_CHANNEL_NOTEON
+    static MoppyModulation modulation; // Pitch bend and LFOs
+    static MoppyArpeggiator arpeggiator; // Cycles through chords given to one bridge
+
     static int FIRST_BRIDGE;
     static int LAST_BRIDGE;
     static unsigned int MAX_POSITION[];
     static unsigned int currentPosition[];
-    static int currentStep[];
+    static byte currentStep[];
+    static StepMode stepMode[];
+#ifdef ARDUINO_ARCH_AVR
+    static volatile uint8_t *stepPort[5][BRIDGE_PORTS];
+    static uint8_t stepPortMask[5][BRIDGE_PORTS];
+    static uint8_t stepPortBits[5][BRIDGE_PORTS][8];
+#endif
     static int currentDir[];
     static unsigned int currentPeriod[];
     static unsigned int currentTick[];
     static unsigned int originalPeriod[];
     static void resetAll();
-    static void step(byte bridgeNum, byte pin1, byte pin2, byte pin3, byte pin4);
+    static void step(byte bridgeNum);
+    static void writeCoils(byte bridgeNum, byte halfStep);
+    static void setStepMode(byte bridgeNum, StepMode mode);
+#ifdef ARDUINO_ARCH_AVR
+    static void buildStepTables();
+#endif
     static void haltAllDrives();
     static void reset(byte bridgeNum);
     static void tick();
+    static void controlTick();
+    static void arpNote(uint8_t subAddress, uint8_t note);
     static void blinkLED();
-    static void startupSound(byte bridgeNum);
     static void L298Nvariables();
   };
 }
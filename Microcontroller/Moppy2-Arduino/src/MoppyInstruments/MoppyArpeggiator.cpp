@@ -0,0 +1,208 @@
+/*
+ * MoppyArpeggiator.cpp
+ *
+ * Each voice keeps its notes sorted, so the patterns are just a matter of which way the
+ * position moves.  Voices with a single note are left alone by update().
+ */
+#include "MoppyArpeggiator.h"
+
+#ifdef ARDUINO_ARCH_ESP32
+static portMUX_TYPE arpeggiatorMux = portMUX_INITIALIZER_UNLOCKED;
+#define ARPEGGIATOR_LOCK() portENTER_CRITICAL(&arpeggiatorMux)
+#define ARPEGGIATOR_UNLOCK() portEXIT_CRITICAL(&arpeggiatorMux)
+#else
+#define ARPEGGIATOR_LOCK() noInterrupts()
+#define ARPEGGIATOR_UNLOCK() interrupts()
+#endif
+
+MoppyArpeggiator::MoppyArpeggiator(NoteFunction playNote) : playNote(playNote) {
+    reset(0);
+}
+
+void MoppyArpeggiator::setArpeggio(uint8_t payload[]) {
+    uint16_t updates = 0;
+    if (payload[0] > 0) {
+        updates = (1000000UL / MOPPY_CONTROL_PERIOD + payload[0] / 2) / payload[0];
+        if (updates == 0) {
+            updates = 1;
+        }
+    }
+
+    ARPEGGIATOR_LOCK();
+    stepUpdates = updates;
+    pattern = payload[1] <= ARP_UP_DOWN ? (ArpPattern)payload[1] : ARP_UP;
+    if (updates == 0) {
+        // Voices keep only the note they're sounding
+        for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+            if (voices[v].count > 1) {
+                voices[v].notes[0] = voices[v].notes[voices[v].position];
+                voices[v].count = 1;
+                voices[v].position = 0;
+            }
+        }
+    }
+    ARPEGGIATOR_UNLOCK();
+}
+
+bool MoppyArpeggiator::noteOn(uint8_t subAddress, uint8_t note) {
+    if (subAddress < MIN_SUB_ADDRESS || subAddress > MAX_SUB_ADDRESS) {
+        return true;
+    }
+    Voice &voice = voices[subAddress - MIN_SUB_ADDRESS];
+    ARPEGGIATOR_LOCK();
+    if (stepUpdates == 0 || voice.count == 0) {
+        voice.notes[0] = note;
+        voice.age[0] = 0;
+        voice.count = 1;
+        voice.position = 0;
+        voice.descending = false;
+        voice.countdown = stepUpdates;
+        ARPEGGIATOR_UNLOCK();
+        return true;
+    }
+
+    for (uint8_t n = 0; n < voice.count; n++) {
+        if (voice.notes[n] == note) {
+            ARPEGGIATOR_UNLOCK();
+            return false; // Already in the cycle
+        }
+    }
+
+    if (voice.count == MOPPY_ARP_NOTES) {
+        uint8_t oldest = 0;
+        for (uint8_t n = 1; n < voice.count; n++) {
+            if (voice.age[n] > voice.age[oldest]) {
+                oldest = n;
+            }
+        }
+        removeAt(voice, oldest);
+    }
+
+    uint8_t index = voice.count;
+    while (index > 0 && voice.notes[index - 1] > note) {
+        voice.notes[index] = voice.notes[index - 1];
+        voice.age[index] = voice.age[index - 1];
+        index--;
+    }
+    for (uint8_t n = 0; n <= voice.count; n++) {
+        if (voice.age[n] < 0xFF) {
+            voice.age[n]++;
+        }
+    }
+    voice.notes[index] = note;
+    voice.age[index] = 0;
+    voice.count++;
+    if (index <= voice.position) {
+        voice.position++; // Keep sounding the same note
+    }
+    ARPEGGIATOR_UNLOCK();
+    return false;
+}
+
+bool MoppyArpeggiator::noteOff(uint8_t subAddress, uint8_t note) {
+    if (subAddress < MIN_SUB_ADDRESS || subAddress > MAX_SUB_ADDRESS) {
+        return true;
+    }
+    Voice &voice = voices[subAddress - MIN_SUB_ADDRESS];
+    ARPEGGIATOR_LOCK();
+    if (stepUpdates == 0) {
+        voice.count = 0; // Any note off stops the voice, like without an arpeggiator
+        ARPEGGIATOR_UNLOCK();
+        return true;
+    }
+
+    for (uint8_t n = 0; n < voice.count; n++) {
+        if (voice.notes[n] == note) {
+            bool sounding = n == voice.position;
+            removeAt(voice, n);
+            if (sounding && voice.count > 0) {
+                // Move straight on rather than hold a released note until the next step
+                playNote(subAddress, voice.notes[voice.position]);
+                voice.countdown = stepUpdates;
+            }
+            break;
+        }
+    }
+    bool silent = voice.count == 0;
+    ARPEGGIATOR_UNLOCK();
+    return silent;
+}
+
+void MoppyArpeggiator::reset(uint8_t subAddress) {
+    ARPEGGIATOR_LOCK();
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (subAddress == 0 || subAddress == v + MIN_SUB_ADDRESS) {
+            voices[v].count = 0;
+            voices[v].position = 0;
+            voices[v].descending = false;
+            voices[v].countdown = 0;
+        }
+    }
+    ARPEGGIATOR_UNLOCK();
+}
+
+void MoppyArpeggiator::removeAt(Voice &voice, uint8_t index) {
+    voice.count--;
+    for (uint8_t n = index; n < voice.count; n++) {
+        voice.notes[n] = voice.notes[n + 1];
+        voice.age[n] = voice.age[n + 1];
+    }
+    if (index < voice.position) {
+        voice.position--;
+    }
+    if (voice.position >= voice.count) {
+        voice.position = 0;
+    }
+}
+
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyArpeggiator::update()
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyArpeggiator::update()
+#else
+void MoppyArpeggiator::update()
+#endif
+{
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        Voice &voice = voices[v];
+        if (voice.count < 2) {
+            continue;
+        }
+        if (voice.countdown > 1) {
+            voice.countdown--;
+            continue;
+        }
+        voice.countdown = stepUpdates;
+        advance(voice);
+        playNote(v + MIN_SUB_ADDRESS, voice.notes[voice.position]);
+    }
+}
+
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyArpeggiator::advance(Voice &voice)
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyArpeggiator::advance(Voice &voice)
+#else
+void MoppyArpeggiator::advance(Voice &voice)
+#endif
+{
+    switch (pattern) {
+    case ARP_DOWN:
+        voice.position = voice.position == 0 ? voice.count - 1 : voice.position - 1;
+        break;
+    case ARP_UP_DOWN:
+        if (voice.descending && voice.position == 0) {
+            voice.descending = false;
+        } else if (!voice.descending && voice.position + 1 >= voice.count) {
+            voice.descending = true;
+        }
+        voice.position += voice.descending ? -1 : 1;
+        break;
+    default:
+        voice.position = voice.position + 1 >= voice.count ? 0 : voice.position + 1;
+        break;
+    }
+}
+#pragma GCC pop_options
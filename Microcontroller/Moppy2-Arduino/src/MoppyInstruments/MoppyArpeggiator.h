@@ -0,0 +1,83 @@
+/*
+ * MoppyArpeggiator.h
+ * Lets one voice play a chord by cycling through its notes quickly (the chiptune trick), so an
+ * instrument can sound more notes than it has drives.
+ *
+ * Arpeggiation is set with NETBYTE_DEV_SETARPEGGIO and a payload of [rate, pattern], the same
+ * for every voice:
+ *  - rate: notes per second (0 turns it off, so a new note just replaces the sounding one)
+ *  - pattern: one of the ArpPattern values
+ *
+ * While it's on, a note started on a voice that's already sounding is added to the voice's
+ * notes instead of replacing them, and a note off only stops that note.  The voice allocator
+ * does the same for NETBYTE_DEV_CHANNEL_NOTEON once every voice is busy (see
+ * MoppyVoiceAllocator::setStackDepth()).
+ *
+ * Instruments call update() from their control-rate MoppyTimer callback, and it calls the
+ * instrument's NoteFunction whenever a voice moves on to its next note.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYARPEGGIATOR_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYARPEGGIATOR_H_
+
+#include "../MoppyConfig.h"
+#include "MoppyModulation.h"
+#include "MoppyVoiceAllocator.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+// Most notes a voice cycles through.  Starting another replaces the oldest.
+#define MOPPY_ARP_NOTES 4
+
+enum ArpPattern : uint8_t {
+    ARP_UP,     // Lowest to highest
+    ARP_DOWN,   // Highest to lowest
+    ARP_UP_DOWN // Up and back down again
+};
+
+class MoppyArpeggiator {
+public:
+    // Starts the given note on a voice.  Called from the timer interrupt, so it must be quick
+    // (and in IRAM on ESP).
+    typedef void (*NoteFunction)(uint8_t subAddress, uint8_t note);
+
+    MoppyArpeggiator(NoteFunction playNote);
+
+    // Handle a NETBYTE_DEV_SETARPEGGIO payload
+    void setArpeggio(uint8_t payload[]);
+
+    bool isEnabled() const { return stepUpdates > 0; }
+
+    // Add a note to a voice.  Returns true if the instrument should start it now (the voice was
+    // silent, or arpeggiation is off), false if it'll come around in turn.
+    bool noteOn(uint8_t subAddress, uint8_t note);
+
+    // Remove a note from a voice.  Returns true if the voice has nothing left to play.
+    bool noteOff(uint8_t subAddress, uint8_t note);
+
+    // Forget the notes of a sub-address (0 for all)
+    void reset(uint8_t subAddress);
+
+    // Advance every arpeggiating voice by one control period.  Called from the timer interrupt.
+    void update();
+
+private:
+    struct Voice {
+        uint8_t notes[MOPPY_ARP_NOTES]; // Sorted lowest first
+        uint8_t age[MOPPY_ARP_NOTES];   // Order the notes were started in, for replacing the oldest
+        uint8_t count;
+        uint8_t position; // Index of the sounding note
+        bool descending;  // For ARP_UP_DOWN
+        uint16_t countdown; // Updates until the next note
+    };
+
+    NoteFunction playNote;
+    Voice voices[MOPPY_NUM_VOICES];
+    uint16_t stepUpdates = 0; // Updates per note, 0 when off
+    ArpPattern pattern = ARP_UP;
+
+    void removeAt(Voice &voice, uint8_t index);
+    void advance(Voice &voice);
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYARPEGGIATOR_H_ */
@@ -0,0 +1,58 @@
+/*
+ * MoppyComposite.cpp
+ *
+ * The ranges are few and fixed, so a message is routed by checking each in turn.
+ */
+#include "MoppyComposite.h"
+
+// True if every range from index r on can be renumbered to start at MIN_SUB_ADDRESS
+constexpr bool rangesFit(uint8_t r) {
+    return r >= MOPPY_ADDRESS_COUNT ||
+           (MOPPY_ADDRESSES[r].minSubAddress > 0 &&
+            MOPPY_ADDRESSES[r].minSubAddress <= MOPPY_ADDRESSES[r].maxSubAddress &&
+            MOPPY_ADDRESSES[r].maxSubAddress - MOPPY_ADDRESSES[r].minSubAddress <= MAX_SUB_ADDRESS - MIN_SUB_ADDRESS &&
+            rangesFit(r + 1));
+}
+static_assert(rangesFit(0), "Every COMPOSITE_ADDRESSES range must be no wider than MIN_SUB_ADDRESS to MAX_SUB_ADDRESS");
+
+MoppyComposite::MoppyComposite(MoppyInstrument *const (&instruments)[MOPPY_ADDRESS_COUNT]) {
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        this->instruments[r] = instruments[r];
+    }
+}
+
+void MoppyComposite::setup() {
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        instruments[r]->useAddressRange(r);
+        instruments[r]->setup();
+    }
+}
+
+// Each instrument runs its own startup sequence (and holds its own early messages), so they
+// can home at the same time.  The composite counts as started once they all have.
+void MoppyComposite::update() {
+    bool allStarted = true;
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        instruments[r]->update();
+        allStarted = allStarted && instruments[r]->isStarted();
+    }
+    if (allStarted && !isStarted()) {
+        beginStartup(true);
+    }
+}
+
+void MoppyComposite::handleSystemMessage(uint8_t command, uint8_t payload[]) {
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        instruments[r]->handleSystemMessage(command, payload);
+    }
+}
+
+void MoppyComposite::handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        const MoppyAddressRange &range = MOPPY_ADDRESSES[r];
+        if (MoppyAddresses::inRange(range, deviceAddress, subAddress)) {
+            uint8_t instrumentSub = subAddress == 0x00 ? 0x00 : subAddress - range.minSubAddress + MIN_SUB_ADDRESS;
+            instruments[r]->handleDeviceMessage(deviceAddress, instrumentSub, command, payload);
+        }
+    }
+}
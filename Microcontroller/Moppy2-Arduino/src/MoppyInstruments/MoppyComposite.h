@@ -0,0 +1,41 @@
+/*
+ * MoppyComposite.h
+ * Runs several instruments on one board, each answering its own device address and range of
+ * sub-addresses from COMPOSITE_ADDRESSES (see MoppyConfig.h and MoppyAddresses.h).  E.g. a Mega
+ * can play 8 floppy drives as device 1 and 4 hard drives as device 2, rather than needing a
+ * board (and a serial port on the Controller) for each.
+ *
+ * Each instrument sees its own sub-addresses numbered from MIN_SUB_ADDRESS, so instruments work
+ * unchanged and MIN_SUB_ADDRESS/MAX_SUB_ADDRESS only have to be wide enough for the largest
+ * range.  Messages for sub-address 0 go to every instrument on that device address, and system
+ * messages go to all of them.
+ *
+ * The instruments share MoppyTimer (so they must agree on TIMER_RESOLUTION, as the built-in ones
+ * do) and its MOPPY_MAX_TIMER_CALLBACKS.  Their pins mustn't overlap, and instruments needing
+ * the same extra hardware can't be combined.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYCOMPOSITE_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYCOMPOSITE_H_
+
+#include "../MoppyConfig.h"
+#include "../MoppyNetworks/MoppyAddresses.h"
+#include "MoppyInstrument.h"
+#include <Arduino.h>
+
+class MoppyComposite final : public MoppyInstrument {
+public:
+    // One instrument for each range of MOPPY_ADDRESSES, in the same order
+    MoppyComposite(MoppyInstrument *const (&instruments)[MOPPY_ADDRESS_COUNT]);
+
+    void setup() override;
+    void update() override;
+
+    void handleSystemMessage(uint8_t command, uint8_t payload[]) override;
+    void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) override;
+
+private:
+    MoppyInstrument *instruments[MOPPY_ADDRESS_COUNT];
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYCOMPOSITE_H_ */
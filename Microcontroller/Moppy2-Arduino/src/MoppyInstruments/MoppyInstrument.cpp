@@ -0,0 +1,110 @@
+/*
+ * MoppyInstrument.cpp
+ * Startup sequence shared by all instruments
+ */
+#include "MoppyInstrument.h"
+
+// Notes of the startup chime, ending with silence
+static const uint8_t chimeNotes[] = {31, 36, 38, 43, 0};
+
+void MoppyInstrument::beginStartup(bool warmBoot) {
+    chimeStep = 0;
+    nextStage(warmBoot ? STARTUP_DONE : STARTUP_HOMING);
+}
+
+void MoppyInstrument::update() {
+    unsigned long elapsed = millis() - stageStarted;
+
+    switch (startupStage) {
+    case STARTUP_HOMING:
+        if (startupHoming()) {
+            break;
+        }
+        // Play the chime once, after the first homing only
+        if (PLAY_STARTUP_SOUND && chimeStep < sizeof(chimeNotes)) {
+            nextStage(STARTUP_CHIME);
+        } else {
+            nextStage(STARTUP_DONE);
+        }
+        break;
+    case STARTUP_CHIME:
+        if (elapsed >= STARTUP_PAUSE + (unsigned long)chimeStep * STARTUP_NOTE_LENGTH) {
+            startupNote(chimeNotes[chimeStep]);
+            if (++chimeStep == sizeof(chimeNotes)) {
+                nextStage(STARTUP_RESET);
+            }
+        }
+        break;
+    case STARTUP_RESET:
+        if (elapsed >= STARTUP_PAUSE) {
+            startupReset();
+            nextStage(STARTUP_HOMING);
+        }
+        break;
+    case STARTUP_WAITING:
+    case STARTUP_DONE:
+        break;
+    }
+
+    if (heldCount > 0) {
+        releaseHeld();
+    }
+}
+
+void MoppyInstrument::nextStage(StartupStage stage) {
+    startupStage = stage;
+    stageStarted = millis();
+}
+
+// System messages only have to wait for setup(), device messages for the whole startup sequence
+bool MoppyInstrument::mustHold(uint8_t deviceAddress) const {
+    return deviceAddress == SYSTEM_ADDRESS ? startupStage == STARTUP_WAITING : startupStage != STARTUP_DONE;
+}
+
+bool MoppyInstrument::holdDuringStartup(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    // Anything behind a held message has to wait too, to stay in order
+    if (releasing || (heldCount == 0 && !mustHold(deviceAddress))) {
+        return false;
+    }
+    int8_t length = moppyPayloadLength(deviceAddress, command);
+    if (length < 0 || length > MOPPY_HELD_PAYLOAD || heldCount >= MOPPY_HELD_MESSAGES) {
+        return true; // Dropped
+    }
+    HeldMessage &message = held[heldCount++];
+    message.deviceAddress = deviceAddress;
+    message.subAddress = subAddress;
+    message.command = command;
+    memset(message.payload, 0, MOPPY_HELD_PAYLOAD);
+    memcpy(message.payload, payload, length);
+#ifdef MOPPY_TRACE
+    message.stamp = MoppyTrace::stamp();
+#endif
+    return true;
+}
+
+// Pass on the held messages that can be handled now, oldest first
+void MoppyInstrument::releaseHeld() {
+    uint8_t released = 0;
+    while (released < heldCount && !mustHold(held[released].deviceAddress)) {
+        released++;
+    }
+    if (released == 0) {
+        return;
+    }
+
+    releasing = true; // Or the handlers would just hold them again
+    for (uint8_t i = 0; i < released; i++) {
+        HeldMessage &message = held[i];
+#ifdef MOPPY_TRACE
+        MoppyTrace::restore(message.stamp);
+#endif
+        if (message.deviceAddress == SYSTEM_ADDRESS) {
+            handleSystemMessage(message.command, message.payload);
+        } else {
+            handleDeviceMessage(message.deviceAddress, message.subAddress, message.command, message.payload);
+        }
+    }
+    releasing = false;
+    heldCount -= released;
+    memmove(held, held + released, heldCount * sizeof(HeldMessage));
+}
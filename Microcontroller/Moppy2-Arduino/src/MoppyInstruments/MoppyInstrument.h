@@ -7,11 +7,13 @@
 #define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYINSTRUMENT_H_
 
 #include "../MoppyMessageConsumer.h"
+#include "../MoppyNetworks/MoppyAddresses.h"
+#include "MoppyNotes.h"
 #include <Arduino.h>
 
-// Number of octaves to bend notes by at full-deflection (MIDI pitch bending is weird).
-// Described as cents/cents-in-an-octave
-#define BEND_OCTAVES 200/(float)1200
+// Number of cents to bend notes by at full-deflection (MIDI pitch bending is weird).
+// Bending is done by MoppyModulation.
+#define BEND_CENTS 200
 
 /*
  * Number of microseconds in a timer-tick for setting timer resolution
@@ -30,23 +32,11 @@
 // the already ugly arrays below, multiply the RESOLUTION by 2 here.
 #define DOUBLE_T_RESOLUTION (TIMER_RESOLUTION*2)
 
-// The period of notes in microseconds
-const unsigned int notePeriods[128] = {
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-  61162, 57737, 54496, 51414, 48544, 45809, 43253, 40816, 38521, 36364, 34317, 32394, //C0 - B0
-  30581, 28860, 27241, 25714, 24272, 22910, 21622, 20408, 19264, 18182, 17161, 16197, //C1 - B1
-  15288, 14430, 13620, 12857, 12134, 11453, 10811, 10204, 9631, 9091, 8581, 8099, //C2 - B2
-  7645, 7216, 6811, 6428, 6068, 5727, 5405, 5102, 4816, 4545, 4290, 4050, //C3 - B3
-  3822, 3608, 3405, 3214, 3034, 2863, 2703, 2551, 2408, 2273, 2145, 2025, //C4 - B4
-  1911, 1804, 1703, 1607, 1517, 1432, 1351, 1276, 1204, 1136, 1073, 1012, //C5 - B5
-  956, 902, 851, 804, 758, 716, 676, 638, 602, 568, 536, 506, //C6 - B6
-  478, 451, 426, 402, 379, 358, 338, 319, 301, 284, 268, 253, //C7 - B7
-  239, 225, 213, 201, 190, 179, 169, 159, 150, 142, 134, 127,//C8 - B8
-  0, 0, 0, 0, 0, 0, 0, 0
-};
+// Ticks between step-pin toggles while a drive is homing (a full step every 5ms)
+#define HOMING_TICKS (2500 / TIMER_RESOLUTION)
 
 // NOTE: Yes this is super ugly, but it avoids having to calculate this at runtime.  Changes
-// to notePeriods above will require matching changes here
+// to notePeriods in MoppyNotes.h will require matching changes here
 // The period of notes in two-tick units
 const unsigned int noteDoubleTicks[128] = {
     0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION, 0/DOUBLE_T_RESOLUTION,
@@ -76,9 +66,157 @@ const unsigned int noteTicks[128] = {
     0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION, 0/TIMER_RESOLUTION
 };
 
+// Timing of the startup sequence in milliseconds: pause after homing, length of each chime
+// note, and pause after the chime before the drives are reset again
+#define STARTUP_PAUSE 500
+#define STARTUP_NOTE_LENGTH 200
+
+// Messages that can be held until the instrument is ready for them, and the longest payload held
+#ifndef MOPPY_HELD_MESSAGES
+#define MOPPY_HELD_MESSAGES 8
+#endif
+#define MOPPY_HELD_PAYLOAD 4
+
+/*
+ * Instruments start homing and call beginStartup() from setup(), then return right away so the
+ * network can come up.  The rest of the startup sequence (waiting for homing, the startup chime
+ * and the final reset) is advanced by update() from the main loop.
+ *
+ * The network is started before setup(), so messages can arrive early.  System messages are
+ * held until setup() has run, and device messages until the startup sequence is done, then
+ * update() passes them on in order.  Messages that don't fit (see moppyPayloadLength() and
+ * MOPPY_HELD_MESSAGES) are dropped.
+ */
 class MoppyInstrument : public MoppyMessageConsumer {
 public:
     virtual void setup() = 0;
+
+    // Advance the startup sequence, called from the main loop
+    virtual void update();
+
+    bool isStarted() const { return startupStage == STARTUP_DONE; }
+
+    // Called by MoppyComposite before setup() with the index of the instrument's range in
+    // MOPPY_ADDRESSES, so its voices don't overlap the other instruments' in stats and traces
+    virtual void useAddressRange(uint8_t index){};
+
+    // Handlers are timed for MoppyStats::handlerMicros
+    void handleSystemMessage(uint8_t command, uint8_t payload[]) override {
+        if (!holdMessage(SYSTEM_ADDRESS, 0x00, command, payload)) {
+            unsigned long started = micros();
+            MoppyMessageConsumer::handleSystemMessage(command, payload);
+            MoppyStats::handlerTime(micros() - started);
+        }
+    };
+
+    void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) override {
+        if (!holdMessage(deviceAddress, subAddress, command, payload)) {
+            unsigned long started = micros();
+            MoppyMessageConsumer::handleDeviceMessage(deviceAddress, subAddress, command, payload);
+            MoppyStats::handlerTime(micros() - started);
+        }
+    };
+
+protected:
+    // Start the startup sequence.  After a warm boot the heads are already where they were left
+    // (and instruments without anything to home can say the same), so there's nothing to do.
+    void beginStartup(bool warmBoot);
+
+    // Returns true if the message can't be handled yet, after holding on to it if possible
+    bool holdMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+        return startupStage != STARTUP_DONE && holdDuringStartup(deviceAddress, subAddress, command, payload);
+    }
+
+    // True while the instrument is still homing
+    virtual bool startupHoming() { return false; };
+    // Play a note of the startup chime on the first voice (note 0 means silence)
+    virtual void startupNote(uint8_t note){};
+    // Reset the instrument after the chime
+    virtual void startupReset(){};
+
+private:
+    enum StartupStage : uint8_t {
+        STARTUP_WAITING, // setup() hasn't run yet
+        STARTUP_HOMING,
+        STARTUP_CHIME,
+        STARTUP_RESET,
+        STARTUP_DONE
+    };
+
+    struct HeldMessage {
+        uint8_t deviceAddress;
+        uint8_t subAddress;
+        uint8_t command;
+        uint8_t payload[MOPPY_HELD_PAYLOAD];
+#ifdef MOPPY_TRACE
+        MoppyTrace::Stamp stamp;
+#endif
+    };
+
+    StartupStage startupStage = STARTUP_WAITING;
+    uint8_t chimeStep = 0;
+    unsigned long stageStarted = 0;
+    HeldMessage held[MOPPY_HELD_MESSAGES];
+    uint8_t heldCount = 0;
+    bool releasing = false;
+
+    void nextStage(StartupStage stage);
+    bool mustHold(uint8_t deviceAddress) const;
+    bool holdDuringStartup(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]);
+    void releaseHeld();
+};
+
+/*
+ * Instruments derive from this with their own type, and are declared final, e.g.
+ *   class FloppyDrives final : public MoppyStaticInstrument<FloppyDrives>
+ * so the message switch calls their handlers directly rather than through the vtable.  A network
+ * that's given the instrument's own type (see MoppySerial) calls straight into it as well, while
+ * anything holding a MoppyInstrument or MoppyMessageConsumer pointer (players, MoppyComposite)
+ * still works through the virtual handlers.
+ *
+ * The instrument has to declare MoppyDispatcher<Instrument> a friend so it can reach the
+ * handlers.
+ */
+template <class Instrument>
+class MoppyStaticInstrument : public MoppyInstrument {
+public:
+    void useAddressRange(uint8_t index) override {
+        firstVoice = moppyVoiceBase(index);
+        voices = moppyVoiceBase(index + 1) - firstVoice;
+    }
+
+    void handleSystemMessage(uint8_t command, uint8_t payload[]) override {
+        if (!holdMessage(SYSTEM_ADDRESS, 0x00, command, payload)) {
+            unsigned long started = micros();
+            MoppyDispatcher<Instrument>::systemMessage(static_cast<Instrument &>(*this), command, payload);
+            MoppyStats::handlerTime(micros() - started);
+        }
+    };
+
+    void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) override {
+        if (!holdMessage(deviceAddress, subAddress, command, payload)) {
+            unsigned long started = micros();
+            MoppyDispatcher<Instrument>::deviceMessage(static_cast<Instrument &>(*this), subAddress, command, payload);
+            MoppyStats::handlerTime(micros() - started);
+        }
+    };
+
+protected:
+    // Static, like the rest of the instruments' state, so timer callbacks can trace their voices
+    static inline __attribute__((always_inline)) uint8_t voiceOf(uint8_t subAddress) {
+        uint8_t voice = subAddress - MIN_SUB_ADDRESS;
+        return voice < voices ? firstVoice + voice : 0xFF;
+    }
+    static uint8_t voiceCount() { return voices; }
+
+private:
+    static uint8_t firstVoice;
+    static uint8_t voices;
 };
 
+template <class Instrument>
+uint8_t MoppyStaticInstrument<Instrument>::firstVoice = 0;
+template <class Instrument>
+uint8_t MoppyStaticInstrument<Instrument>::voices = MOPPY_NUM_VOICES;
+
 #endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYINSTRUMENT_H_ */
@@ -0,0 +1,264 @@
+/*
+ * MoppyModulation.cpp
+ *
+ * Periods are scaled by a factor with 14 fractional bits.  The factor for a pitch offset comes
+ * from a table every 32 cents, interpolated linearly for the cents in between (well within a cent
+ * of the exact value).  32 cents keeps the interpolation to shifts and a 16-bit multiply,
+ * since it runs for every voice in the timer interrupt.
+ */
+#include "MoppyModulation.h"
+#include "MoppyInstrument.h"
+
+#define FACTOR_ONE (1 << 14)
+#define MAX_CENTS 1199 // Offsets are limited to an octave either way
+#define FINE_PER_CENT 16 // Bends and glides are in sixteenths of a cent
+#define CENTS_PER_STEP_BITS 5 // CENT_FACTORS has an entry every 32 cents
+
+// 2^(-cents/1200) for cents = -1200 to 1200 in steps of 32
+const uint16_t CENT_FACTORS[76] PROGMEM = {
+    32768, 32168, 31579, 31000, 30433, 29875, 29328, 28791, 28264, 27746, 27238, 26739, 26249,
+    25769, 25297, 24834, 24379, 23932, 23494, 23064, 22641, 22227, 21820, 21420, 21028, 20643,
+    20264, 19893, 19529, 19171, 18820, 18476, 18137, 17805, 17479, 17159, 16845, 16536, 16233,
+    15936, 15644, 15358, 15076, 14800, 14529, 14263, 14002, 13745, 13494, 13247, 13004, 12766,
+    12532, 12303, 12077, 11856, 11639, 11426, 11216, 11011, 10809, 10611, 10417, 10226, 10039,
+    9855, 9675, 9498, 9324, 9153, 8985, 8821, 8659, 8501, 8345, 8192};
+
+// One cycle of a sine, 64 steps
+const int8_t SINE_TABLE[64] PROGMEM = {
+    0, 12, 25, 37, 49, 60, 71, 81, 90, 98, 106, 112, 117, 122, 125, 126,
+    127, 126, 125, 122, 117, 112, 106, 98, 90, 81, 71, 60, 49, 37, 25, 12,
+    0, -12, -25, -37, -49, -60, -71, -81, -90, -98, -106, -112, -117, -122, -125, -126,
+    -127, -126, -125, -122, -117, -112, -106, -98, -90, -81, -71, -60, -49, -37, -25, -12};
+
+#ifdef ARDUINO_ARCH_ESP32
+static portMUX_TYPE modulationMux = portMUX_INITIALIZER_UNLOCKED;
+#define MODULATION_LOCK() portENTER_CRITICAL(&modulationMux)
+#define MODULATION_UNLOCK() portEXIT_CRITICAL(&modulationMux)
+#else
+#define MODULATION_LOCK() noInterrupts()
+#define MODULATION_UNLOCK() interrupts()
+#endif
+
+MoppyModulation::MoppyModulation() {
+    reset(0);
+}
+
+void MoppyModulation::setModulation(uint8_t subAddress, uint8_t payload[]) {
+    ModulationTarget target = payload[0] <= MOD_GATE ? (ModulationTarget)payload[0] : MOD_OFF;
+    LfoWaveform waveform = payload[1] <= LFO_SAW ? (LfoWaveform)payload[1] : LFO_SINE;
+    uint16_t step = ((uint32_t)payload[2] * 65536UL * MOPPY_CONTROL_PERIOD + 5000000UL) / 10000000UL;
+
+    MODULATION_LOCK();
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (subAddress == 0 || subAddress == v + MIN_SUB_ADDRESS) {
+            voices[v].target = target;
+            voices[v].waveform = waveform;
+            voices[v].step = step;
+            voices[v].depth = payload[3];
+            updateFactor(voices[v]);
+        }
+    }
+    MODULATION_UNLOCK();
+}
+
+void MoppyModulation::setGlide(uint8_t payload[]) {
+    glideUpdates = (uint32_t)payload[0] * 10000UL / MOPPY_CONTROL_PERIOD;
+    bendSlewMillis = payload[1];
+}
+
+void MoppyModulation::setBend(uint8_t subAddress, int16_t bendDeflection) {
+    if (subAddress < MIN_SUB_ADDRESS || subAddress > MAX_SUB_ADDRESS) {
+        return;
+    }
+    Voice &voice = voices[subAddress - MIN_SUB_ADDRESS];
+    int16_t target = ((int32_t)bendDeflection * BEND_CENTS * FINE_PER_CENT) / 8192;
+
+    // Spread the change over the gap since the last bend, so it's done about when the next
+    // one is expected
+    uint16_t now = millis();
+    uint16_t slewMillis = now - voice.lastBendMillis;
+    if (slewMillis > bendSlewMillis) {
+        slewMillis = bendSlewMillis;
+    }
+    uint16_t updates = (uint32_t)slewMillis * 1000UL / MOPPY_CONTROL_PERIOD;
+
+    MODULATION_LOCK();
+    voice.lastBendMillis = now;
+    voice.bendTarget = target;
+    if (updates == 0) {
+        voice.bend = target;
+    } else {
+        voice.bendStep = abs(target - voice.bend) / updates;
+        if (voice.bendStep == 0) {
+            voice.bendStep = 1;
+        }
+    }
+    updateFactor(voice);
+    MODULATION_UNLOCK();
+}
+
+void MoppyModulation::noteOn(uint8_t subAddress, uint8_t note) {
+    if (subAddress < MIN_SUB_ADDRESS || subAddress > MAX_SUB_ADDRESS) {
+        return;
+    }
+    Voice &voice = voices[subAddress - MIN_SUB_ADDRESS];
+    int16_t glide = 0;
+    int16_t glideStep = 0;
+    if (glideUpdates > 0 && voice.lastNote != 0) {
+        int16_t cents = ((int16_t)voice.lastNote - note) * 100;
+        glide = constrain(cents, -MAX_CENTS, MAX_CENTS) * FINE_PER_CENT;
+        glideStep = abs(glide) / glideUpdates;
+        if (glideStep == 0) {
+            glideStep = 1;
+        }
+    }
+
+    MODULATION_LOCK();
+    voice.phase = 0;
+    voice.glide = glide;
+    voice.glideStep = glideStep;
+    voice.lastNote = note;
+    updateFactor(voice);
+    MODULATION_UNLOCK();
+}
+
+void MoppyModulation::reset(uint8_t subAddress) {
+    MODULATION_LOCK();
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (subAddress == 0 || subAddress == v + MIN_SUB_ADDRESS) {
+            voices[v].phase = 0;
+            voices[v].step = 0;
+            voices[v].bend = 0;
+            voices[v].bendTarget = 0;
+            voices[v].glide = 0;
+            voices[v].lastNote = 0;
+            voices[v].factor = FACTOR_ONE;
+            voices[v].target = MOD_OFF;
+            voices[v].waveform = LFO_SINE;
+            voices[v].depth = 0;
+        }
+    }
+    MODULATION_UNLOCK();
+}
+
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyModulation::update()
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyModulation::update()
+#else
+void MoppyModulation::update()
+#endif
+{
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        Voice &voice = voices[v];
+        if (isActive(voice)) {
+            voice.phase += voice.step;
+            voice.bend = slide(voice.bend, voice.bendTarget, voice.bendStep);
+            voice.glide = slide(voice.glide, 0, voice.glideStep);
+            updateFactor(voice);
+        }
+    }
+}
+
+// Moves value up to step closer to target
+#ifdef ARDUINO_ARCH_ESP8266
+int16_t ICACHE_RAM_ATTR MoppyModulation::slide(int16_t value, int16_t target, int16_t step)
+#elif ARDUINO_ARCH_ESP32
+int16_t IRAM_ATTR MoppyModulation::slide(int16_t value, int16_t target, int16_t step)
+#else
+int16_t MoppyModulation::slide(int16_t value, int16_t target, int16_t step)
+#endif
+{
+    if (value < target) {
+        return target - value > step ? value + step : target;
+    }
+    return value - target > step ? value - step : target;
+}
+
+#ifdef ARDUINO_ARCH_ESP8266
+unsigned int ICACHE_RAM_ATTR MoppyModulation::period(uint8_t subAddress, unsigned int notePeriod) const
+#elif ARDUINO_ARCH_ESP32
+unsigned int IRAM_ATTR MoppyModulation::period(uint8_t subAddress, unsigned int notePeriod) const
+#else
+unsigned int MoppyModulation::period(uint8_t subAddress, unsigned int notePeriod) const
+#endif
+{
+    if (subAddress < MIN_SUB_ADDRESS || subAddress > MAX_SUB_ADDRESS || notePeriod == 0) {
+        return notePeriod;
+    }
+    uint16_t factor = voices[subAddress - MIN_SUB_ADDRESS].factor;
+    if (factor == 0) {
+        return 0; // Gated
+    }
+    unsigned int scaled = ((uint32_t)notePeriod * factor + FACTOR_ONE / 2) >> 14;
+    return scaled > 0 ? scaled : 1;
+}
+
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyModulation::updateFactor(Voice &voice)
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyModulation::updateFactor(Voice &voice)
+#else
+void MoppyModulation::updateFactor(Voice &voice)
+#endif
+{
+    int16_t cents = (voice.bend + voice.glide + FINE_PER_CENT / 2) / FINE_PER_CENT;
+    if (voice.target == MOD_PITCH) {
+        cents += ((int16_t)lfoValue(voice.waveform, voice.phase) * voice.depth) >> 7; // Divided by 128, near enough
+    } else if (voice.target == MOD_GATE && (voice.phase >> 9) < voice.depth) {
+        voice.factor = 0; // Silent for depth/128 of the cycle
+        return;
+    }
+    voice.factor = centsToFactor(cents);
+}
+
+// A value from -127 to 127 for the phase (a whole cycle is 65536)
+#ifdef ARDUINO_ARCH_ESP8266
+int8_t ICACHE_RAM_ATTR MoppyModulation::lfoValue(LfoWaveform waveform, uint16_t phase)
+#elif ARDUINO_ARCH_ESP32
+int8_t IRAM_ATTR MoppyModulation::lfoValue(LfoWaveform waveform, uint16_t phase)
+#else
+int8_t MoppyModulation::lfoValue(LfoWaveform waveform, uint16_t phase)
+#endif
+{
+    uint8_t position = phase >> 8;
+    switch (waveform) {
+    case LFO_TRIANGLE: // Starts at the middle going up, like the sine
+        if (position < 64) {
+            return position * 2;
+        } else if (position < 192) {
+            return 255 - position * 2;
+        }
+        return position * 2 - 511;
+    case LFO_SQUARE:
+        return position < 128 ? 127 : -127;
+    case LFO_SAW:
+        return position < 128 ? position : position - 256;
+    default:
+        return (int8_t)pgm_read_byte(&SINE_TABLE[position >> 2]);
+    }
+}
+
+#ifdef ARDUINO_ARCH_ESP8266
+uint16_t ICACHE_RAM_ATTR MoppyModulation::centsToFactor(int16_t cents)
+#elif ARDUINO_ARCH_ESP32
+uint16_t IRAM_ATTR MoppyModulation::centsToFactor(int16_t cents)
+#else
+uint16_t MoppyModulation::centsToFactor(int16_t cents)
+#endif
+{
+    if (cents == 0) {
+        return FACTOR_ONE;
+    }
+    cents = constrain(cents, -MAX_CENTS, MAX_CENTS);
+    uint16_t offset = cents + 1200; // 1 to 2399
+    uint8_t step = offset >> CENTS_PER_STEP_BITS;
+    uint8_t remainder = offset & ((1 << CENTS_PER_STEP_BITS) - 1);
+    uint16_t lower = pgm_read_word(&CENT_FACTORS[step]);
+    uint16_t upper = pgm_read_word(&CENT_FACTORS[step + 1]);
+    // Neighbouring entries are at most 600 apart, so this fits in 16 bits
+    return lower - ((uint16_t)((lower - upper) * remainder) >> CENTS_PER_STEP_BITS);
+}
+#pragma GCC pop_options
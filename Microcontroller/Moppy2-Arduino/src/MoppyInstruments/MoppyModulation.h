@@ -0,0 +1,114 @@
+/*
+ * MoppyModulation.h
+ * Control-rate pitch handling for instruments that play notes as a period in ticks.  Each voice
+ * (sub-address) has a pitch bend and an LFO, combined into a fixed-point factor for the note's
+ * period, so bending and vibrato don't need any floating point math.
+ *
+ * The LFO is set with NETBYTE_DEV_SETMODULATION and a payload of [target, waveform, rate, depth]:
+ *  - target: MOD_OFF, MOD_PITCH (vibrato) or MOD_GATE (tremolo, by silencing the voice for part
+ *    of each cycle)
+ *  - waveform: one of the LfoWaveform values (ignored for MOD_GATE)
+ *  - rate: LFO frequency in tenths of a Hz (0-127, so up to 12.7Hz)
+ *  - depth: for MOD_PITCH the deviation in cents either side of the note, for MOD_GATE how much
+ *    of each cycle is silent (0-127 for 0-100%)
+ * Sent to sub-address 0 it sets every voice.
+ *
+ * Pitch changes can also be smoothed on the device with NETBYTE_DEV_SETGLIDE and a payload of
+ * [glide, bendSlew], the same for every voice:
+ *  - glide: portamento time in hundredths of a second.  Each note starts from the pitch of the
+ *    voice's previous note (up to an octave away) and slides to its own.  0 turns it off.
+ *  - bendSlew: longest time in milliseconds to spread a bend change over.  A new bend is reached
+ *    over the time since the last bend message (up to this), so bends sent at 50Hz still change
+ *    pitch smoothly on every update.  0 jumps straight to each bend.
+ *
+ * Instruments call update() from a MoppyTimer callback every MOPPY_CONTROL_PERIOD and then
+ * recalculate the period of every voice that isModulated().
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYMODULATION_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYMODULATION_H_
+
+#include "../MoppyConfig.h"
+#include "MoppyVoiceAllocator.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+// Microseconds between control-rate updates (1kHz)
+#define MOPPY_CONTROL_PERIOD 1000
+
+enum ModulationTarget : uint8_t {
+    MOD_OFF,
+    MOD_PITCH,
+    MOD_GATE
+};
+
+enum LfoWaveform : uint8_t {
+    LFO_SINE,
+    LFO_TRIANGLE,
+    LFO_SQUARE,
+    LFO_SAW
+};
+
+class MoppyModulation {
+public:
+    MoppyModulation();
+
+    // Handle a NETBYTE_DEV_SETMODULATION payload for a sub-address (0 for all)
+    void setModulation(uint8_t subAddress, uint8_t payload[]);
+
+    // Handle a NETBYTE_DEV_SETGLIDE payload
+    void setGlide(uint8_t payload[]);
+
+    // Bend is the raw NETBYTE_DEV_BENDPITCH value, -8192 to 8191 for -/+ BEND_CENTS
+    void setBend(uint8_t subAddress, int16_t bendDeflection);
+
+    // Restart the LFO so every note starts at the same point of the cycle, and start a glide
+    // from the previous note if there is one
+    void noteOn(uint8_t subAddress, uint8_t note);
+
+    // Clear the bend and LFO of a sub-address (0 for all)
+    void reset(uint8_t subAddress);
+
+    // Advance the LFOs by one control period.  Called from the timer interrupt.
+    void update();
+
+    // True if the voice has an LFO running or is gliding, so its period changes on update()
+    bool isModulated(uint8_t subAddress) const {
+        return subAddress >= MIN_SUB_ADDRESS && subAddress <= MAX_SUB_ADDRESS && isActive(voices[subAddress - MIN_SUB_ADDRESS]);
+    }
+
+    // The note's period with the current bend and LFO applied (0 while gated)
+    unsigned int period(uint8_t subAddress, unsigned int notePeriod) const;
+
+private:
+    // Bends and glides are kept in sixteenths of a cent so slow slides still move every update()
+    struct Voice {
+        uint16_t phase;   // Position in the LFO cycle
+        uint16_t step;    // Phase advance per update()
+        int16_t bend;       // Current bend
+        int16_t bendTarget; // Bend from the last NETBYTE_DEV_BENDPITCH
+        int16_t bendStep;   // Bend change per update() until the target is reached
+        int16_t glide;      // Offset from the note's pitch, slides back to 0
+        int16_t glideStep;  // Glide change per update()
+        uint16_t lastBendMillis;
+        uint16_t factor;  // Period multiplier (1 << 14 is unchanged), 0 while gated
+        ModulationTarget target;
+        LfoWaveform waveform;
+        uint8_t depth;
+        uint8_t lastNote; // Note to glide from, 0 for none
+    };
+
+    Voice voices[MOPPY_NUM_VOICES];
+    uint16_t glideUpdates = 0;   // Updates a glide takes, 0 for no portamento
+    uint8_t bendSlewMillis = 0;
+
+    static bool isActive(const Voice &voice) {
+        return voice.target != MOD_OFF || voice.glide != 0 || voice.bend != voice.bendTarget;
+    }
+    static int16_t slide(int16_t value, int16_t target, int16_t step);
+    void updateFactor(Voice &voice);
+    static int8_t lfoValue(LfoWaveform waveform, uint16_t phase);
+    static uint16_t centsToFactor(int16_t cents);
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYMODULATION_H_ */
@@ -0,0 +1,25 @@
+/*
+ * MoppyNotes.h
+ * Note periods shared by the instruments and the host-side tools, so it must not depend on
+ * anything Arduino-specific.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYNOTES_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYNOTES_H_
+
+// The period of notes in microseconds
+const unsigned int notePeriods[128] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  61162, 57737, 54496, 51414, 48544, 45809, 43253, 40816, 38521, 36364, 34317, 32394, //C0 - B0
+  30581, 28860, 27241, 25714, 24272, 22910, 21622, 20408, 19264, 18182, 17161, 16197, //C1 - B1
+  15288, 14430, 13620, 12857, 12134, 11453, 10811, 10204, 9631, 9091, 8581, 8099, //C2 - B2
+  7645, 7216, 6811, 6428, 6068, 5727, 5405, 5102, 4816, 4545, 4290, 4050, //C3 - B3
+  3822, 3608, 3405, 3214, 3034, 2863, 2703, 2551, 2408, 2273, 2145, 2025, //C4 - B4
+  1911, 1804, 1703, 1607, 1517, 1432, 1351, 1276, 1204, 1136, 1073, 1012, //C5 - B5
+  956, 902, 851, 804, 758, 716, 676, 638, 602, 568, 536, 506, //C6 - B6
+  478, 451, 426, 402, 379, 358, 338, 319, 301, 284, 268, 253, //C7 - B7
+  239, 225, 213, 201, 190, 179, 169, 159, 150, 142, 134, 127,//C8 - B8
+  0, 0, 0, 0, 0, 0, 0, 0
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYNOTES_H_ */
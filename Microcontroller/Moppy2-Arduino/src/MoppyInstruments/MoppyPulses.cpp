@@ -0,0 +1,177 @@
+#include "MoppyPulses.h"
+
+/*
+ * The timer is only ever armed for the earliest pending deadline, and stopped once nothing is
+ * pending.  Deadlines are compared as signed differences so they survive micros() wrapping.
+ */
+
+#ifdef ARDUINO_ARCH_ESP32
+static portMUX_TYPE pulseMux = portMUX_INITIALIZER_UNLOCKED;
+static hw_timer_t *pulseTimer = NULL;
+#define PULSE_LOCK() portENTER_CRITICAL(&pulseMux)
+#define PULSE_UNLOCK() portEXIT_CRITICAL(&pulseMux)
+#define PULSE_ISR_LOCK() portENTER_CRITICAL_ISR(&pulseMux)
+#define PULSE_ISR_UNLOCK() portEXIT_CRITICAL_ISR(&pulseMux)
+#define PULSE_ISR_ATTR IRAM_ATTR
+#else
+#define PULSE_LOCK() noInterrupts()
+#define PULSE_UNLOCK() interrupts()
+#define PULSE_ISR_LOCK()
+#define PULSE_ISR_UNLOCK()
+#ifdef ARDUINO_ARCH_ESP8266
+#define PULSE_ISR_ATTR ICACHE_RAM_ATTR
+#else
+#define PULSE_ISR_ATTR
+#endif
+#endif
+
+#ifdef ARDUINO_ARCH_AVR
+// Timer2 is 8 bits, so with the /1024 prescaler it can wait about 16ms at most (at 16MHz).
+// Longer pulses just take a couple of extra interrupts that release nothing.
+#define PULSE_MAX_ARM_MICROS 16000
+#endif
+
+MoppyPulses::Pulse MoppyPulses::pending[MOPPY_MAX_PULSES];
+volatile uint8_t MoppyPulses::pulseCount = 0;
+
+#ifdef ARDUINO_ARCH_AVR
+ISR(TIMER2_COMPA_vect) {
+    MoppyPulses::onTimer();
+}
+#endif
+
+void MoppyPulses::begin() {
+#ifdef ARDUINO_ARCH_AVR
+    TCCR2B = 0; // Stopped until something is scheduled
+    TCCR2A = _BV(WGM21); // Clear on compare match
+    TIMSK2 = 0;
+#elif ARDUINO_ARCH_ESP8266
+    timer0_isr_init();
+#elif ARDUINO_ARCH_ESP32
+    if (pulseTimer == NULL) {
+        pulseTimer = timerBegin(1, 80, true);
+        timerAttachInterrupt(pulseTimer, onTimer, true);
+    }
+#endif
+}
+
+void MoppyPulses::schedule(ReleaseFunction release, uint8_t channel, uint32_t lengthMicros) {
+    Pulse evicted = {0, NULL, 0};
+    PULSE_LOCK();
+    removeMatching(release, channel, false);
+    if (pulseCount == MOPPY_MAX_PULSES) {
+        evicted = pending[0]; // Released once the lock is dropped
+        remove(0);
+    }
+
+    uint32_t deadline = micros() + lengthMicros;
+    uint8_t p = pulseCount;
+    while (p > 0 && (int32_t)(pending[p - 1].deadline - deadline) > 0) {
+        pending[p] = pending[p - 1];
+        p--;
+    }
+    pending[p].deadline = deadline;
+    pending[p].release = release;
+    pending[p].channel = channel;
+    pulseCount++;
+
+    if (p == 0) {
+        armTimer(lengthMicros); // New earliest deadline
+    }
+    PULSE_UNLOCK();
+
+    if (evicted.release != NULL) {
+        evicted.release(evicted.channel);
+    }
+}
+
+void MoppyPulses::cancel(ReleaseFunction release, uint8_t channel) {
+    PULSE_LOCK();
+    removeMatching(release, channel, false);
+    PULSE_UNLOCK();
+}
+
+void MoppyPulses::cancelAll(ReleaseFunction release) {
+    PULSE_LOCK();
+    removeMatching(release, 0, true);
+    PULSE_UNLOCK();
+}
+
+// Leaves the timer armed even if the earliest pulse was removed; it'll just find nothing due
+void MoppyPulses::removeMatching(ReleaseFunction release, uint8_t channel, bool anyChannel) {
+    for (uint8_t p = pulseCount; p > 0; p--) {
+        if (pending[p - 1].release == release && (anyChannel || pending[p - 1].channel == channel)) {
+            remove(p - 1);
+        }
+    }
+}
+
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+void PULSE_ISR_ATTR MoppyPulses::onTimer() {
+    PULSE_ISR_LOCK();
+    uint32_t now = micros();
+    uint8_t due = 0;
+    while (due < pulseCount && (int32_t)(pending[due].deadline - now) <= 0) {
+        pending[due].release(pending[due].channel);
+        due++;
+    }
+    if (due > 0) {
+        pulseCount -= due;
+        for (uint8_t p = 0; p < pulseCount; p++) {
+            pending[p] = pending[p + due];
+        }
+    }
+
+    if (pulseCount > 0) {
+        armTimer(pending[0].deadline - now);
+    } else {
+        stopTimer();
+    }
+    PULSE_ISR_UNLOCK();
+}
+
+void PULSE_ISR_ATTR MoppyPulses::remove(uint8_t index) {
+    pulseCount--;
+    for (uint8_t p = index; p < pulseCount; p++) {
+        pending[p] = pending[p + 1];
+    }
+}
+
+void PULSE_ISR_ATTR MoppyPulses::armTimer(uint32_t delayMicros) {
+#ifdef ARDUINO_ARCH_AVR
+    if (delayMicros > PULSE_MAX_ARM_MICROS) {
+        delayMicros = PULSE_MAX_ARM_MICROS;
+    }
+    uint16_t ticks = ((delayMicros * (F_CPU / 1000000UL)) + 1023) >> 10; // Rounded up, never early
+    if (ticks > 256) {
+        ticks = 256;
+    }
+    TCCR2B = 0;
+    TCNT2 = 0;
+    GTCCR = _BV(PSRASY); // Restart the prescaler too, so the first tick is a whole one
+    OCR2A = ticks > 0 ? ticks - 1 : 0;
+    TIFR2 = _BV(OCF2A); // Drop a match that happened while rearming
+    TIMSK2 = _BV(OCIE2A);
+    TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20); // Start, clock / 1024
+#elif ARDUINO_ARCH_ESP8266
+    timer0_attachInterrupt(onTimer);
+    timer0_write(ESP.getCycleCount() + (delayMicros + 1) * ESP.getCpuFreqMHz());
+#elif ARDUINO_ARCH_ESP32
+    timerWrite(pulseTimer, 0);
+    timerAlarmWrite(pulseTimer, delayMicros + 1, false);
+    timerAlarmEnable(pulseTimer);
+#endif
+}
+
+void PULSE_ISR_ATTR MoppyPulses::stopTimer() {
+#ifdef ARDUINO_ARCH_AVR
+    TCCR2B = 0;
+    TIMSK2 = 0;
+#elif ARDUINO_ARCH_ESP8266
+    timer0_detachInterrupt();
+#elif ARDUINO_ARCH_ESP32
+    timerAlarmDisable(pulseTimer);
+#endif
+}
+#pragma GCC pop_options
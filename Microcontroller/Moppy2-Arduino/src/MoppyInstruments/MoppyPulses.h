@@ -0,0 +1,65 @@
+/*
+ * MoppyPulses.h
+ * One-shot pulse timing for percussive instruments (solenoids, hard drive coils).  The
+ * instrument energizes an output itself and schedules its release; pending releases are kept
+ * in a list sorted by deadline, and a one-shot timer is armed for the earliest one.  Nothing
+ * runs between hits.
+ *
+ * The timer used is separate from MoppyTimer's: Timer2 on AVR (so tone() can't be used along
+ * with it), timer0 on ESP8266, and hardware timer 1 on ESP32.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYPULSES_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYPULSES_H_
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Most releases that can be pending at once.  If the list is full, the pulse closest to its
+// deadline is released early to make room.
+#ifndef MOPPY_MAX_PULSES
+#define MOPPY_MAX_PULSES 24
+#endif
+
+class MoppyPulses {
+public:
+    // Called from the timer interrupt to release an output, so it must be quick (and in IRAM on ESP)
+    typedef void (*ReleaseFunction)(uint8_t channel);
+
+    static void begin();
+
+    /*
+     * Call release(channel) lengthMicros from now.  If a release for the same function and channel
+     * is already pending it's replaced, so retriggering a sounding output extends the pulse.
+     */
+    static void schedule(ReleaseFunction release, uint8_t channel, uint32_t lengthMicros);
+
+    // Drop pending releases without calling them (the caller is turning the outputs off itself)
+    static void cancel(ReleaseFunction release, uint8_t channel);
+    static void cancelAll(ReleaseFunction release);
+
+    // Pulse length for a note velocity (1-127), from minMicros up to minMicros + rangeMicros
+    static uint32_t velocityLength(uint8_t velocity, uint32_t minMicros, uint32_t rangeMicros) {
+        return minMicros + (rangeMicros * velocity) / 127;
+    }
+
+    // Timer interrupt handler, not to be called directly
+    static void onTimer();
+
+private:
+    struct Pulse {
+        uint32_t deadline; // micros() to release at
+        ReleaseFunction release;
+        uint8_t channel;
+    };
+
+    static Pulse pending[MOPPY_MAX_PULSES]; // Sorted by deadline, earliest first
+    static volatile uint8_t pulseCount;
+
+    static void remove(uint8_t index);
+    static void removeMatching(ReleaseFunction release, uint8_t channel, bool anyChannel);
+    static void armTimer(uint32_t delayMicros);
+    static void stopTimer();
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYPULSES_H_ */
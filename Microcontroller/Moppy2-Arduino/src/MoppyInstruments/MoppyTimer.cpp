@@ -1,24 +1,190 @@
 #include "MoppyTimer.h"
+#include "../MoppyNetworks/MoppyStats.h"
+#include <Arduino.h>
 
 #ifdef ARDUINO_ARCH_AVR
 #include <TimerOne.h>
-#elif ARDUINO_ARCH_ESP8266 || ARDUINO_ARCH_ESP32
-#include <Arduino.h>
 #endif
 
+#ifdef ARDUINO_ARCH_ESP32
+// The hardware timer is only ever allocated once, and reused by later calls
+static hw_timer_t *timer = NULL;
+static portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
+#define TIMER_LOCK() portENTER_CRITICAL(&timerMux)
+#define TIMER_UNLOCK() portEXIT_CRITICAL(&timerMux)
+#else
+#define TIMER_LOCK() noInterrupts()
+#define TIMER_UNLOCK() interrupts()
+#endif
+
+MoppyTimer::Callback MoppyTimer::callbacks[MOPPY_MAX_TIMER_CALLBACKS];
+uint8_t MoppyTimer::callbackCount = 0;
+unsigned long MoppyTimer::basePeriod = 0;
+bool MoppyTimer::running = false;
+bool MoppyTimer::hardwareReady = false;
+volatile uint32_t MoppyTimer::ticks = 0;
+
 void MoppyTimer::initialize(unsigned long microseconds, void (*isr)()) {
+    setPeriod(microseconds);
+    addCallback(isr, microseconds);
+    start();
+}
+
+int8_t MoppyTimer::addCallback(TimerCallback callback, unsigned long periodMicros) {
+    for (uint8_t c = 0; c < MOPPY_MAX_TIMER_CALLBACKS; c++) {
+        if (c < callbackCount && callbacks[c].function != NULL) {
+            continue;
+        }
+        TIMER_LOCK();
+        callbacks[c].periodMicros = periodMicros;
+        callbacks[c].divider = callbacks[c].countdown = dividerFor(periodMicros);
+        callbacks[c].function = callback;
+        if (c >= callbackCount) {
+            callbackCount = c + 1;
+        }
+        TIMER_UNLOCK();
+        return c;
+    }
+    return -1;
+}
+
+void MoppyTimer::setCallbackPeriod(int8_t id, unsigned long periodMicros) {
+    if (id < 0 || id >= callbackCount) {
+        return;
+    }
+    TIMER_LOCK();
+    callbacks[id].periodMicros = periodMicros;
+    callbacks[id].divider = dividerFor(periodMicros);
+    if (callbacks[id].countdown > callbacks[id].divider) {
+        callbacks[id].countdown = callbacks[id].divider;
+    }
+    TIMER_UNLOCK();
+}
+
+void MoppyTimer::removeCallback(int8_t id) {
+    if (id < 0 || id >= callbackCount) {
+        return;
+    }
+    TIMER_LOCK();
+    callbacks[id].function = NULL;
+    while (callbackCount > 0 && callbacks[callbackCount - 1].function == NULL) {
+        callbackCount--;
+    }
+    TIMER_UNLOCK();
+}
+
+void MoppyTimer::setPeriod(unsigned long microseconds) {
+    TIMER_LOCK();
+    basePeriod = microseconds;
+    for (uint8_t c = 0; c < callbackCount; c++) {
+        callbacks[c].divider = dividerFor(callbacks[c].periodMicros);
+        if (callbacks[c].countdown > callbacks[c].divider) {
+            callbacks[c].countdown = callbacks[c].divider;
+        }
+    }
+    TIMER_UNLOCK();
+    if (hardwareReady) {
+        writePeriod();
+    }
+}
+
+void MoppyTimer::start() {
+    if (running || basePeriod == 0) {
+        return;
+    }
 #ifdef ARDUINO_ARCH_AVR
-    Timer1.initialize(microseconds);
-    Timer1.attachInterrupt(isr);
+    if (!hardwareReady) {
+        Timer1.initialize(basePeriod);
+        Timer1.attachInterrupt(dispatch);
+    } else {
+        Timer1.resume();
+    }
 #elif ARDUINO_ARCH_ESP8266
-    timer1_isr_init();
-    timer1_attachInterrupt(isr);
+    if (!hardwareReady) {
+        timer1_isr_init();
+        timer1_attachInterrupt(dispatch);
+    }
     timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
-    timer1_write(5 * microseconds);
+    timer1_write(5 * basePeriod);
 #elif ARDUINO_ARCH_ESP32
-    hw_timer_t *timer = timerBegin(0, 80, true);
-    timerAttachInterrupt(timer, isr, true);
-    timerAlarmWrite(timer, microseconds, true);
+    if (timer == NULL) {
+        timer = timerBegin(0, 80, true);
+        timerAttachInterrupt(timer, dispatch, true);
+    }
+    timerAlarmWrite(timer, basePeriod, true);
     timerAlarmEnable(timer);
 #endif
-}
\ No newline at end of file
+    hardwareReady = true;
+    running = true;
+}
+
+void MoppyTimer::stop() {
+    if (!running) {
+        return;
+    }
+#ifdef ARDUINO_ARCH_AVR
+    Timer1.stop();
+#elif ARDUINO_ARCH_ESP8266
+    timer1_disable();
+#elif ARDUINO_ARCH_ESP32
+    timerAlarmDisable(timer);
+#endif
+    running = false;
+}
+
+uint32_t MoppyTimer::getTicks() {
+    TIMER_LOCK(); // Four bytes on AVR, don't let the tick change half of it
+    uint32_t count = ticks;
+    TIMER_UNLOCK();
+    return count;
+}
+
+uint16_t MoppyTimer::dividerFor(unsigned long periodMicros) {
+    if (basePeriod == 0) {
+        return 1;
+    }
+    unsigned long divider = (periodMicros + basePeriod / 2) / basePeriod;
+    return divider < 1 ? 1 : (divider > 0xFFFF ? 0xFFFF : divider);
+}
+
+void MoppyTimer::writePeriod() {
+#ifdef ARDUINO_ARCH_AVR
+    Timer1.setPeriod(basePeriod);
+#elif ARDUINO_ARCH_ESP8266
+    timer1_write(5 * basePeriod);
+#elif ARDUINO_ARCH_ESP32
+    timerAlarmWrite(timer, basePeriod, true);
+#endif
+}
+
+/*
+Called by the hardware timer every base period, and calls each callback that's due.  The
+callbacks do the real work, so this has to stay tiny.  With MOPPY_TRACE the time it takes
+(callbacks included) is reported in MoppyStats.
+ */
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyTimer::dispatch()
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyTimer::dispatch()
+#else
+void MoppyTimer::dispatch()
+#endif
+{
+#ifdef MOPPY_TRACE
+    uint32_t started = micros();
+#endif
+    ticks++;
+    for (uint8_t c = 0; c < callbackCount; c++) {
+        Callback &callback = callbacks[c];
+        if (callback.function != NULL && --callback.countdown == 0) {
+            callback.countdown = callback.divider;
+            callback.function();
+        }
+    }
+#ifdef MOPPY_TRACE
+    MoppyStats::timerTime(micros() - started);
+#endif
+}
+#pragma GCC pop_options
@@ -1,14 +1,63 @@
 /*
  * MoppyTimer.h
  * Attempt at making a high-precision timer that's relatively platform-agnostic
+ *
+ * One hardware timer runs at the base period, and any number of callbacks (up to
+ * MOPPY_MAX_TIMER_CALLBACKS) can run on it at multiples of that period, so e.g. a 1kHz
+ * control-rate callback doesn't need its own timer or extra work in the voice tick.
  */
 
 #ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_
 #define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_
 
+#include <stdint.h>
+
+#define MOPPY_MAX_TIMER_CALLBACKS 4
+
 class MoppyTimer {
 public:
+    typedef void (*TimerCallback)();
+
+    // Set the base period, run isr on every tick, and start the timer
     static void initialize(unsigned long microseconds, void (*isr)());
+
+    /*
+     * Run callback about every periodMicros (rounded to a whole number of base ticks, at least
+     * one).  Returns an id for changing or removing it later, or -1 if there's no room.
+     */
+    static int8_t addCallback(TimerCallback callback, unsigned long periodMicros);
+    static void setCallbackPeriod(int8_t id, unsigned long periodMicros);
+    static void removeCallback(int8_t id);
+
+    // Change the base period while running.  Callbacks keep their periods in microseconds.
+    static void setPeriod(unsigned long microseconds);
+    static unsigned long getPeriod() { return basePeriod; }
+
+    static void start();
+    static void stop();
+    static bool isRunning() { return running; }
+
+    // Number of base ticks since the timer was first started
+    static uint32_t getTicks();
+
+private:
+    struct Callback {
+        TimerCallback function; // NULL if the slot is free
+        unsigned long periodMicros;
+        uint16_t divider;   // Base ticks between calls
+        uint16_t countdown; // Base ticks until the next call
+    };
+
+    static Callback callbacks[MOPPY_MAX_TIMER_CALLBACKS];
+    static uint8_t callbackCount; // Slots in use are all below this
+    static unsigned long basePeriod;
+    static bool running;
+    static bool hardwareReady;
+    static volatile uint32_t ticks;
+
+    static void dispatch();
+    static uint16_t dividerFor(unsigned long periodMicros);
+    static void writePeriod();
 };
 
-#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_ */
\ No newline at end of file
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_ */
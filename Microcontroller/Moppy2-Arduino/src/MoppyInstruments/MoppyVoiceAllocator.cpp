@@ -0,0 +1,209 @@
+/*
+ * MoppyVoiceAllocator.cpp
+ *
+ * Voices are indexed from zero internally and converted to sub-addresses on the way out.
+ */
+#include "MoppyVoiceAllocator.h"
+
+MoppyVoiceAllocator::MoppyVoiceAllocator(VoicePolicy policy) : policy(policy) {
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        voices[v].note = 0;
+        voices[v].channel = 0;
+        voices[v].lowestNote = 0;
+        voices[v].highestNote = 127;
+        voices[v].lastUsed = 0;
+        voices[v].started = 0;
+    }
+}
+
+void MoppyVoiceAllocator::setRange(uint8_t subAddress, uint8_t lowestNote, uint8_t highestNote) {
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (subAddress == 0 || subAddress == v + MIN_SUB_ADDRESS) {
+            voices[v].lowestNote = lowestNote;
+            voices[v].highestNote = highestNote;
+        }
+    }
+}
+
+uint8_t MoppyVoiceAllocator::noteOn(uint8_t channel, uint8_t note, uint8_t *stolenNote) {
+    *stolenNote = 0;
+    if (note == 0) {
+        return 0; // Note 0 marks a free voice (and isn't playable anyway)
+    }
+
+    int8_t voice = -1;
+    if (policy == VOICE_ROUND_ROBIN) {
+        // Take the next free voice in turn, or failing that just the next one in turn
+        for (uint8_t pass = 0; pass < 2 && voice < 0; pass++) {
+            for (uint8_t i = 0; i < MOPPY_NUM_VOICES; i++) {
+                uint8_t v = (nextVoice + i) % MOPPY_NUM_VOICES;
+                if (note >= voices[v].lowestNote && note <= voices[v].highestNote && (pass == 1 || voices[v].note == 0)) {
+                    voice = v;
+                    break;
+                }
+            }
+        }
+        if (voice >= 0) {
+            nextVoice = (voice + 1) % MOPPY_NUM_VOICES;
+        }
+    } else {
+        voice = findVoice(note, true, policy == VOICE_LRU);
+        if (voice < 0 && policy == VOICE_LRU) {
+            voice = findVoice(note, false, true); // Steal whichever voice has gone longest without a change
+        } else if (voice < 0) {
+            voice = findOldestNote(note);
+        }
+    }
+
+    if (voice < 0) {
+        return 0; // No voice can play this note
+    }
+
+    // Rather than steal, share a voice if it can take another note
+    if (voices[voice].note != 0 && stackDepth > 1 && stackedCount < MOPPY_MAX_STACKED_NOTES) {
+        int8_t stackVoice = findStackVoice(note);
+        if (stackVoice >= 0) {
+            stacked[stackedCount].note = note;
+            stacked[stackedCount].channel = channel;
+            stacked[stackedCount].voice = stackVoice;
+            stacked[stackedCount].started = ++useCounter;
+            stackedCount++;
+            voices[stackVoice].lastUsed = useCounter;
+            return stackVoice + MIN_SUB_ADDRESS;
+        }
+    }
+
+    *stolenNote = voices[voice].note;
+    voices[voice].note = note;
+    voices[voice].channel = channel;
+    voices[voice].lastUsed = ++useCounter;
+    voices[voice].started = useCounter;
+    return voice + MIN_SUB_ADDRESS;
+}
+
+uint8_t MoppyVoiceAllocator::noteOff(uint8_t channel, uint8_t note) {
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (voices[v].note == note && voices[v].channel == channel) {
+            voices[v].note = 0;
+            voices[v].lastUsed = ++useCounter;
+            // A note sharing the voice takes over, so the voice stays busy
+            for (uint8_t s = 0; s < stackedCount; s++) {
+                if (stacked[s].voice == v) {
+                    voices[v].note = stacked[s].note;
+                    voices[v].channel = stacked[s].channel;
+                    voices[v].started = stacked[s].started;
+                    removeStacked(s);
+                    break;
+                }
+            }
+            return v + MIN_SUB_ADDRESS;
+        }
+    }
+    for (uint8_t s = 0; s < stackedCount; s++) {
+        if (stacked[s].note == note && stacked[s].channel == channel) {
+            uint8_t v = stacked[s].voice;
+            removeStacked(s);
+            voices[v].lastUsed = ++useCounter;
+            return v + MIN_SUB_ADDRESS;
+        }
+    }
+    return 0;
+}
+
+bool MoppyVoiceAllocator::hasRoom(uint8_t note) const {
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (note >= voices[v].lowestNote && note <= voices[v].highestNote && voices[v].note == 0) {
+            return true;
+        }
+    }
+    return stackDepth > 1 && stackedCount < MOPPY_MAX_STACKED_NOTES && findStackVoice(note) >= 0;
+}
+
+bool MoppyVoiceAllocator::isPlaying(uint8_t channel, uint8_t note) const {
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (voices[v].note == note && voices[v].channel == channel) {
+            return true;
+        }
+    }
+    for (uint8_t s = 0; s < stackedCount; s++) {
+        if (stacked[s].note == note && stacked[s].channel == channel) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MoppyVoiceAllocator::reset() {
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        voices[v].note = 0;
+    }
+    stackedCount = 0;
+}
+
+// Find a free (or busy) voice that can play the note; either the first one or the one
+// that has gone longest without being used
+int8_t MoppyVoiceAllocator::findVoice(uint8_t note, bool free, bool longestIdle) {
+    int8_t found = -1;
+    uint16_t foundAge = 0;
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (note < voices[v].lowestNote || note > voices[v].highestNote || (voices[v].note == 0) != free) {
+            continue;
+        }
+        if (!longestIdle) {
+            return v;
+        }
+        uint16_t age = useCounter - voices[v].lastUsed;
+        if (found < 0 || age > foundAge) {
+            found = v;
+            foundAge = age;
+        }
+    }
+    return found;
+}
+
+// Find the busy voice that can play the note whose current note started first.  Unlike the
+// longest idle voice, this ignores notes stacked on or released from the voice since.
+int8_t MoppyVoiceAllocator::findOldestNote(uint8_t note) const {
+    int8_t found = -1;
+    uint16_t foundAge = 0;
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (note < voices[v].lowestNote || note > voices[v].highestNote || voices[v].note == 0) {
+            continue;
+        }
+        uint16_t age = useCounter - voices[v].started;
+        if (found < 0 || age > foundAge) {
+            found = v;
+            foundAge = age;
+        }
+    }
+    return found;
+}
+
+// Find the busy voice that can play the note with the fewest notes, if it has room for one more
+int8_t MoppyVoiceAllocator::findStackVoice(uint8_t note) const {
+    int8_t found = -1;
+    uint8_t foundNotes = stackDepth;
+    for (uint8_t v = 0; v < MOPPY_NUM_VOICES; v++) {
+        if (note < voices[v].lowestNote || note > voices[v].highestNote || voices[v].note == 0) {
+            continue;
+        }
+        uint8_t notes = 1;
+        for (uint8_t s = 0; s < stackedCount; s++) {
+            if (stacked[s].voice == v) {
+                notes++;
+            }
+        }
+        if (notes < foundNotes) {
+            found = v;
+            foundNotes = notes;
+        }
+    }
+    return found;
+}
+
+void MoppyVoiceAllocator::removeStacked(uint8_t index) {
+    stackedCount--;
+    for (uint8_t s = index; s < stackedCount; s++) {
+        stacked[s] = stacked[s + 1];
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * MoppyVoiceAllocator.h
+ * Picks which sub-address (voice) plays each note for NETBYTE_DEV_CHANNEL_NOTEON messages,
+ * so the Controller doesn't have to keep track of which drives are busy.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYVOICEALLOCATOR_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYVOICEALLOCATOR_H_
+
+#include "../MoppyConfig.h"
+#include <stdint.h>
+
+#define MOPPY_NUM_VOICES (MAX_SUB_ADDRESS - MIN_SUB_ADDRESS + 1)
+
+// Most notes that can share busy voices (on top of the one each voice plays) when stacking
+#define MOPPY_MAX_STACKED_NOTES 8
+
+// How to choose a voice for a new note, and which one to take over when all are busy
+enum VoicePolicy : uint8_t {
+    VOICE_ROUND_ROBIN, // Cycle through the voices, steal the next one in turn
+    VOICE_LRU,         // Use the voice that has been resting longest, steal the one used least recently
+    VOICE_OLDEST_NOTE  // Use the first free voice, steal the note that started first
+};
+
+class MoppyVoiceAllocator {
+public:
+    MoppyVoiceAllocator(VoicePolicy policy = VOICE_LRU);
+
+    void setPolicy(VoicePolicy newPolicy) { policy = newPolicy; }
+
+    /*
+     * Most notes one voice can be given at once.  Above 1, a note that arrives while every voice
+     * is busy is added to the voice with the fewest notes (for an arpeggiator to cycle through)
+     * rather than stealing one.
+     */
+    void setStackDepth(uint8_t depth) { stackDepth = depth; }
+
+    // Limit a voice (sub-address, or 0 for all voices) to the given range of notes.  A lowest
+    // note above the highest keeps the voice from being used at all.
+    void setRange(uint8_t subAddress, uint8_t lowestNote, uint8_t highestNote);
+
+    /*
+     * Find a voice for the note.  Returns the sub-address to play it on, or 0 if no voice can
+     * play it.  If a sounding note had to be stolen, stolenNote is set to it (0 otherwise).
+     */
+    uint8_t noteOn(uint8_t channel, uint8_t note, uint8_t *stolenNote);
+
+    // Returns the sub-address that was playing the note, or 0 if it isn't playing
+    uint8_t noteOff(uint8_t channel, uint8_t note);
+
+    // True if noteOn() would find a voice for the note without stealing one
+    bool hasRoom(uint8_t note) const;
+
+    // True if the note is sounding on any voice
+    bool isPlaying(uint8_t channel, uint8_t note) const;
+
+    // True if the voice at subAddress is sounding a note (or more than one, when stacking)
+    bool isPlaying(uint8_t subAddress) const {
+        return subAddress >= MIN_SUB_ADDRESS && subAddress <= MAX_SUB_ADDRESS && voices[subAddress - MIN_SUB_ADDRESS].note != 0;
+    }
+
+    // True if the voice at subAddress is sounding a note from the given channel
+    bool isPlayingChannel(uint8_t subAddress, uint8_t channel) const {
+        return isPlaying(subAddress) && voices[subAddress - MIN_SUB_ADDRESS].channel == channel;
+    }
+
+    // Forget about all sounding notes
+    void reset();
+
+private:
+    struct Voice {
+        uint8_t note;     // 0 when the voice is free
+        uint8_t channel;
+        uint8_t lowestNote;
+        uint8_t highestNote;
+        uint16_t lastUsed; // Value of useCounter when the voice last started or stopped a note
+        uint16_t started;  // Value of useCounter when the current note started
+    };
+
+    // A note sharing a busy voice
+    struct StackedNote {
+        uint8_t note;
+        uint8_t channel;
+        uint8_t voice;
+        uint16_t started;
+    };
+
+    Voice voices[MOPPY_NUM_VOICES];
+    StackedNote stacked[MOPPY_MAX_STACKED_NOTES];
+    VoicePolicy policy;
+    uint16_t useCounter = 0;
+    uint8_t nextVoice = 0; // Next voice in turn for VOICE_ROUND_ROBIN
+    uint8_t stackDepth = 1;
+    uint8_t stackedCount = 0;
+
+    int8_t findVoice(uint8_t note, bool free, bool longestIdle);
+    int8_t findOldestNote(uint8_t note) const;
+    int8_t findStackVoice(uint8_t note) const;
+    void removeStacked(uint8_t index);
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYVOICEALLOCATOR_H_ */
@@ -0,0 +1,111 @@
+#include "MoppyWarmBoot.h"
+
+#ifdef ARDUINO_ARCH_ESP32
+#include <esp_attr.h>
+#include <esp_system.h>
+#endif
+
+MoppyWarmBoot::Tracked MoppyWarmBoot::tracked[MOPPY_WARM_BOOT_MAX_INSTRUMENTS];
+uint8_t MoppyWarmBoot::trackedInstruments = 0;
+uint8_t MoppyWarmBoot::trackedPositions = 0;
+bool MoppyWarmBoot::recordValid = false;
+
+#ifdef ARDUINO_ARCH_ESP32
+#define WARM_BOOT_MAGIC 0x4D505043 // "MPPC"
+
+// Left alone by the bootloader, so it still holds whatever save() wrote before a restart (or
+// garbage after a power cycle, hence the magic number and checksum).  Instruments' positions
+// follow each other in the order they called restore().
+struct WarmBootRecord {
+    uint32_t magic;
+    uint8_t instruments;
+    uint8_t busy; // Bit for each instrument that was busy, so its positions aren't known
+    uint8_t counts[MOPPY_WARM_BOOT_MAX_INSTRUMENTS];
+    uint16_t positions[MOPPY_WARM_BOOT_MAX_POSITIONS];
+    uint8_t checksum;
+};
+RTC_NOINIT_ATTR static WarmBootRecord warmBootRecord;
+static_assert(MOPPY_WARM_BOOT_MAX_INSTRUMENTS <= 8, "WarmBootRecord::busy has a bit per instrument");
+
+static uint8_t recordChecksum() {
+    if (warmBootRecord.instruments > MOPPY_WARM_BOOT_MAX_INSTRUMENTS) {
+        return ~warmBootRecord.checksum; // Garbage, don't read past the end
+    }
+    uint8_t sum = warmBootRecord.instruments ^ warmBootRecord.busy;
+    uint8_t total = 0;
+    for (uint8_t i = 0; i < warmBootRecord.instruments; i++) {
+        sum = (sum << 1 | sum >> 7) ^ warmBootRecord.counts[i];
+        total += warmBootRecord.counts[i];
+    }
+    if (total > MOPPY_WARM_BOOT_MAX_POSITIONS) {
+        return ~warmBootRecord.checksum;
+    }
+    for (uint8_t i = 0; i < total; i++) {
+        sum = (sum << 1 | sum >> 7) ^ (warmBootRecord.positions[i] >> 8) ^ warmBootRecord.positions[i];
+    }
+    return sum;
+}
+#endif
+
+bool MoppyWarmBoot::restore(unsigned int positions[], uint8_t count, bool (*busy)()) {
+#ifdef ARDUINO_ARCH_ESP32
+    if (trackedInstruments >= MOPPY_WARM_BOOT_MAX_INSTRUMENTS || count == 0
+        || count > MOPPY_WARM_BOOT_MAX_POSITIONS - trackedPositions) {
+        return false; // No room to save these, so they'll always home
+    }
+    uint8_t index = trackedInstruments++;
+    uint8_t first = trackedPositions;
+    tracked[index] = {positions, count, busy};
+    trackedPositions += count;
+
+    if (index == 0) {
+        esp_register_shutdown_handler(save);
+
+        // Only a software restart runs the shutdown handler, anything else may have left the heads
+        // somewhere else (or moved them by hand while the power was off)
+        recordValid = esp_reset_reason() == ESP_RST_SW
+                      && warmBootRecord.magic == WARM_BOOT_MAGIC
+                      && warmBootRecord.checksum == recordChecksum();
+        warmBootRecord.magic = 0; // Each save is good for one boot
+    }
+
+    // The record has to agree on where this instrument's positions are, not just how many
+    if (!recordValid || index >= warmBootRecord.instruments || warmBootRecord.counts[index] != count
+        || (warmBootRecord.busy & (1 << index))) {
+        return false;
+    }
+    for (uint8_t i = 0; i < index; i++) {
+        if (warmBootRecord.counts[i] != tracked[i].count) {
+            return false;
+        }
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        positions[i] = warmBootRecord.positions[first + i];
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void MoppyWarmBoot::save() {
+#ifdef ARDUINO_ARCH_ESP32
+    uint8_t first = 0;
+    warmBootRecord.instruments = trackedInstruments;
+    warmBootRecord.busy = 0;
+    for (uint8_t t = 0; t < trackedInstruments; t++) {
+        // Positions aren't known while busy, so leave that instrument to home
+        if (tracked[t].busy != nullptr && tracked[t].busy()) {
+            warmBootRecord.busy |= 1 << t;
+        }
+        warmBootRecord.counts[t] = tracked[t].count;
+        for (uint8_t i = 0; i < tracked[t].count; i++) {
+            warmBootRecord.positions[first + i] = tracked[t].positions[i];
+        }
+        first += tracked[t].count;
+    }
+    warmBootRecord.checksum = recordChecksum();
+    warmBootRecord.magic = WARM_BOOT_MAGIC;
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+ * MoppyWarmBoot.h
+ * Keeps track of head positions across a software restart (e.g. after an OTA update) so that
+ * instruments can skip homing when they come back up.
+ *
+ * On the ESP32 the positions are written to RTC memory (which isn't cleared by a restart) from
+ * a shutdown handler.  Other boards don't get a chance to save anything before they go down,
+ * so they always home.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYWARMBOOT_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYWARMBOOT_H_
+
+#include <stdint.h>
+
+// Largest number of positions that can be kept, across every instrument
+#define MOPPY_WARM_BOOT_MAX_POSITIONS 64
+
+// Largest number of instruments (e.g. in a MoppyComposite) that can keep positions, up to 8
+#define MOPPY_WARM_BOOT_MAX_INSTRUMENTS 4
+
+class MoppyWarmBoot {
+public:
+    /*
+     * Fill in positions[] with the positions saved before the last restart, and make sure the
+     * current positions will be saved on the next one (unless busy() returns true at that point,
+     * e.g. because the heads are still homing).  Returns false if nothing valid was saved, in
+     * which case the instrument should home as usual.
+     *
+     * Each instrument calling this gets its own part of the record, in the order they call it,
+     * so they must be set up in the same order on every boot.
+     */
+    static bool restore(unsigned int positions[], uint8_t count, bool (*busy)());
+
+private:
+    struct Tracked {
+        unsigned int *positions;
+        uint8_t count;
+        bool (*busy)();
+    };
+
+    static Tracked tracked[MOPPY_WARM_BOOT_MAX_INSTRUMENTS];
+    static uint8_t trackedInstruments;
+    static uint8_t trackedPositions; // Total of every tracked count
+    static bool recordValid;         // The record was saved before this (software) restart
+
+    static void save();
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYWARMBOOT_H_ */
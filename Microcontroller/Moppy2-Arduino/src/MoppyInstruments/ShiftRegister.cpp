@@ -9,51 +9,65 @@
 #include "MoppyInstrument.h"
 
 namespace instruments {
-// Define pins for connection to shift registers
-#define DATA_PIN 2
-#define SHIFT_CLOCK_PIN 3
+// Define pins for connection to shift registers (data and clock are the SPI pins)
 #define LATCH_PIN 4
 #define MASTER_CLEAR_PIN 5
 #define OUTPUT_ENABLE_PIN 6
+// Not LED_BUILTIN, which is pin 13 (the SPI clock) on an Uno
+#define DEBUG_LED_PIN 7
 
 // First and last supported notes (any notes outside this range will be ignored, first note will be
 // indexed as zero for shifting
-#define NUM_NOTES 24
-const uint8_t FIRST_NOTE = 79;
+#define NUM_NOTES (SHIFT_REGISTER_COUNT * 8)
+const uint8_t FIRST_NOTE = SHIFT_REGISTER_FIRST_NOTE;
 const uint8_t LAST_NOTE = FIRST_NOTE + (NUM_NOTES-1);
+static_assert(SHIFT_REGISTER_FIRST_NOTE + NUM_NOTES <= 128, "Shift register notes must fit in the MIDI range");
 
-#define SHIFT_TIMER_RESOLUTION 1000 //Microsecond resolution for starting and ending notes
+// The velocity of the incoming notes will adjust the pulse length from MIN_PULSE_MICROS to MIN_PULSE_MICROS + PULSE_MICROS_RANGE
+#define MIN_PULSE_MICROS 10000 // Minimum length of "on" pulse for each bit
+#define PULSE_MICROS_RANGE 60000 // Maximum time to add to MIN_PULSE_MICROS for maximum velocity
 
-// The velocity of the incoming notes will adjust the pulse length from MIN_PULSE_TICKS to MIN_PULSE_TICKS + PULSE_TICKS_RANGE
-#define MIN_PULSE_TICKS 10 // Minimum length of "on" pulse for each bit in ticks (e.g. RESOLUTION * PULSE_TICKS microseconds)
-#define PULSE_TICKS_RANGE 60 // Maximum number of ticks to add to MIN_PULSE_TICKS for maximum velocity
-
-#define SHIFT_DATA_BYTES 3
-uint8_t ShiftRegister::shiftData[SHIFT_DATA_BYTES]; // 8*3 = 24
-uint8_t ShiftRegister::activeTicksLeft[NUM_NOTES];
-
-boolean ShiftRegister::shouldShift = false; // When true, a shift will occur during the next tick
+#define SHIFT_DATA_BYTES SHIFT_REGISTER_COUNT
+volatile uint8_t ShiftRegister::shiftData[SHIFT_DATA_BYTES];
+uint8_t ShiftRegister::shiftedData[SHIFT_DATA_BYTES];
+#ifdef ARDUINO_ARCH_ESP32
+TaskHandle_t ShiftRegister::shiftTask = NULL;
+#endif
 
 void ShiftRegister::setup() {
 
   // Prepare pins
-  pinMode(DATA_PIN, OUTPUT);
-  pinMode(SHIFT_CLOCK_PIN, OUTPUT);
   pinMode(LATCH_PIN, OUTPUT);
+  SPI.begin();
+  SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0)); // Never ended, nothing else uses the bus
 
   // Don't enable these unless you plan to use them!
   //pinMode(MASTER_CLEAR_PIN, OUTPUT);
   //pinMode(OUTPUT_ENABLE_PIN, OUTPUT);
 
-  pinMode(13, OUTPUT); // Built-in LED for blinking
 
+#ifdef ARDUINO_ARCH_ESP32
+  // Above loop() (and everything else of ours) so a released note goes out as soon as the
+  // pulse timer signals it
+  xTaskCreatePinnedToCore(shiftTaskLoop, "moppyShift", 2048, NULL, 6, &shiftTask, 1);
+#endif
 
-  // With all pins setup, let's do a first run reset
+  // With all pins setup, let's do a first run reset (forcing a shift, since we don't know
+  // what the registers are showing yet)
+  memset(shiftedData, 0xFF, SHIFT_DATA_BYTES);
   zeroOutputs();
-  delay(500); // Wait a half second for safety
 
-  // Setup timer to handle interrupts for floppy driving
-  MoppyTimer::initialize(SHIFT_TIMER_RESOLUTION, tick);
+  // Notes are released by the pulse timer, nothing runs between hits
+  MoppyPulses::begin();
+
+  beginStartup(true); // Nothing to home, ready right away
+}
+
+void ShiftRegister::update() {
+  MoppyInstrument::update();
+#ifdef ARDUINO_ARCH_ESP8266
+  shiftAllData(); // Shift out any notes the pulse timer has released
+#endif
 }
 
 
@@ -75,9 +89,12 @@ void ShiftRegister::dev_reset(uint8_t subAddress) {
 
 void ShiftRegister::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
     if (payload[0] >= FIRST_NOTE && payload[0] <= LAST_NOTE) {
-        outputOn(payload[0] - FIRST_NOTE);
-        activeTicksLeft[payload[0] - FIRST_NOTE] = MIN_PULSE_TICKS + ((payload[1] * PULSE_TICKS_RANGE) / 127);
-        shouldShift = true;
+        uint8_t outputNum = payload[0] - FIRST_NOTE;
+        noInterrupts(); // The pulse timer clears bits from its interrupt
+        outputOn(outputNum);
+        interrupts();
+        requestShift();
+        MoppyPulses::schedule(releaseOutput, outputNum, MoppyPulses::velocityLength(payload[1], MIN_PULSE_MICROS, PULSE_MICROS_RANGE));
     }
 }
 
@@ -86,35 +103,59 @@ void ShiftRegister::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
 //
 
 /*
-Called by the timer interrupt at the specified resolution.  Because this is called extremely often,
-it's crucial that any computations here be kept to a minimum!
+Called by the pulse timer interrupt when a note's pulse is over, so the coil is released right
+away rather than on the next pass of loop().  On AVR the bits are shifted out from here with
+polled SPI.  The ESP32 can't use SPI in an interrupt, so the shift task is woken instead.
+The ESP8266 has neither option, so update() shifts the change out there.
  */
-void ShiftRegister::tick()
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR ShiftRegister::releaseOutput(uint8_t outputNum)
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR ShiftRegister::releaseOutput(uint8_t outputNum)
+#else
+void ShiftRegister::releaseOutput(uint8_t outputNum)
+#endif
 {
-  for (byte n = 0; n < NUM_NOTES; n++) {
-    if (activeTicksLeft[n] > 0) {
-      if (--activeTicksLeft[n] == 0) {
-        outputOff(n);
-        shouldShift = true;
-      }
-    }
+  outputOff(outputNum);
+#ifdef ARDUINO_ARCH_AVR
+  shiftAllData(); // Interrupts are already off
+#elif ARDUINO_ARCH_ESP32
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(shiftTask, &woken);
+  if (woken == pdTRUE) {
+    portYIELD_FROM_ISR();
   }
+#endif
+}
 
-  if (shouldShift) {
-    shouldShift = false;
+// Get shiftData out to the registers from the main loop
+void ShiftRegister::requestShift() {
+#ifdef ARDUINO_ARCH_ESP32
+  xTaskNotifyGive(shiftTask); // Runs right away, being above loop()
+#else
+  shiftAllData();
+#endif
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+void ShiftRegister::shiftTaskLoop(void *) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     shiftAllData();
   }
 }
+#endif
 
 ////
 // UTILITY FUNCTIONS
 ////
 
-//Not used now, but good for debugging...
-void blinkLED(){
-  digitalWrite(13, HIGH); // set the LED on
+//Not used now, but good for debugging (with an LED on DEBUG_LED_PIN)...
+void ShiftRegister::blinkLED(){
+  pinMode(DEBUG_LED_PIN, OUTPUT);
+  digitalWrite(DEBUG_LED_PIN, HIGH); // set the LED on
   delay(250);              // wait for a second
-  digitalWrite(13, LOW);
+  digitalWrite(DEBUG_LED_PIN, LOW);
 }
 
 
@@ -122,13 +163,45 @@ void blinkLED(){
 // Shifting and bitsetting functions
 ////
 
+// Shifts the data out through the SPI peripheral, but only if it's different from what the
+// registers are already showing.  On AVR this is also called from the pulse interrupt, so the
+// whole shift runs with interrupts off (a few microseconds) and polls SPDR directly.  Elsewhere
+// only one task (the shift task on ESP32, loop() on ESP8266) ever calls it.
 void ShiftRegister::shiftAllData()
 {
+#ifdef ARDUINO_ARCH_AVR
+  uint8_t oldSREG = SREG;
+  cli();
+#else
+  noInterrupts();
+#endif
+  bool changed = false;
+  for (byte i=0;i<SHIFT_DATA_BYTES;i++){
+    changed |= shiftedData[i] != shiftData[i];
+    shiftedData[i] = shiftData[i];
+  }
+#ifdef ARDUINO_ARCH_AVR
+  if (changed) {
+    digitalWrite(LATCH_PIN, LOW);
+    for (int i=SHIFT_DATA_BYTES-1;i>=0;i--){
+      SPDR = shiftedData[i];
+      while (!(SPSR & _BV(SPIF)));
+    }
+    digitalWrite(LATCH_PIN, HIGH);
+  }
+  SREG = oldSREG;
+#else
+  interrupts();
+  if (!changed) {
+    return;
+  }
+
   digitalWrite(LATCH_PIN, LOW);
   for (int i=SHIFT_DATA_BYTES-1;i>=0;i--){
-    shiftOut(DATA_PIN, SHIFT_CLOCK_PIN, MSBFIRST, shiftData[i]);
+    SPI.transfer(shiftedData[i]);
   }
   digitalWrite(LATCH_PIN, HIGH);
+#endif
 }
 
 void ShiftRegister::outputOn(byte outputNum){
@@ -140,9 +213,10 @@ void ShiftRegister::outputOff(byte outputNum){
 }
 
 void ShiftRegister::zeroOutputs() {
+  MoppyPulses::cancelAll(releaseOutput);
   for (byte i=0;i<SHIFT_DATA_BYTES;i++){
     shiftData[i] = 0;
   }
-  shiftAllData();
+  requestShift();
 }
 } // namespace instruments
@@ -7,15 +7,34 @@
 #define SRC_MOPPYINSTRUMENTS_SHIFTREGISTER_H_
 
 #include <Arduino.h>
-#include "MoppyTimer.h"
+#include "MoppyPulses.h"
 #include "MoppyInstrument.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
+#include <SPI.h>
+#ifdef ARDUINO_ARCH_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+/*
+ * Number of chained registers (8 notes each), and the note played by the first output.  Data
+ * and clock come from the hardware SPI pins (MOSI and SCK, 11 and 13 on an Uno).
+ */
+#ifndef SHIFT_REGISTER_COUNT
+#define SHIFT_REGISTER_COUNT 3
+#endif
+#ifndef SHIFT_REGISTER_FIRST_NOTE
+#define SHIFT_REGISTER_FIRST_NOTE 79
+#endif
 
 namespace instruments {
-  class ShiftRegister : public MoppyInstrument {
+  class ShiftRegister final : public MoppyStaticInstrument<ShiftRegister> {
+    friend class MoppyDispatcher<ShiftRegister>;
+
   public:
     void setup();
+    void update() override;
 
   protected:
     void sys_sequenceStop() override;
@@ -25,13 +44,16 @@ namespace instruments {
     void dev_noteOn(uint8_t subAddress, uint8_t payload[]) override;
 
   private:
-    static uint8_t shiftData[];
-    static uint8_t activeTicksLeft[];
-    static boolean shouldShift;
+    static volatile uint8_t shiftData[];
+    static uint8_t shiftedData[]; // What the registers are currently showing
 
-    static void tick();
+    static void releaseOutput(uint8_t outputNum);
+    static void requestShift();
+#ifdef ARDUINO_ARCH_ESP32
+    static TaskHandle_t shiftTask; // Owns the SPI bus, woken to shift out changes
+    static void shiftTaskLoop(void *);
+#endif
     static void blinkLED();
-    static void startupSound(byte driveNum);
     static void shiftAllData();
     static void outputOn(byte outputNum);
     static void outputOff(byte outputNum);
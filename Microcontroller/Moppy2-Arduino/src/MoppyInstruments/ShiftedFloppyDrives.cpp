@@ -5,72 +5,84 @@
  */
 #include "ShiftedFloppyDrives.h"
 #include "MoppyInstrument.h"
+#include "MoppyWarmBoot.h"
 namespace instruments {
 
-uint8_t ShiftedFloppyDrives::stepBits = 0;      // Bits that represent the current state of the step pins
-uint8_t ShiftedFloppyDrives::directionBits = 0; // Bits that represent the current state of the direction pins
+uint8_t ShiftedFloppyDrives::shiftFrame[] = {0};
+#ifdef SHIFTED_FLOPPIES_SPI_ISR
+volatile uint8_t *ShiftedFloppyDrives::latchPort;
+uint8_t ShiftedFloppyDrives::latchMask;
+volatile uint8_t ShiftedFloppyDrives::shiftPosition = DRIVE_BYTES * 2;
+volatile bool ShiftedFloppyDrives::shiftPending = false;
+#endif
 
 /*An array of maximum track positions for each floppy drive.  3.5" Floppies have
  80 tracks, 5.25" have 50.  These should be doubled, because each tick is now
- half a position (use 158 and 98).
- NOTE: Index zero of this array controls the "resetAll" function, and should be the
- same as the largest value in this array
+ half a position (use 158 and 98).  Filled in by setMovement() when drives are reset.
  */
-unsigned int ShiftedFloppyDrives::MAX_POSITION[] = {158, 158, 158, 158, 158, 158, 158, 158};
-unsigned int ShiftedFloppyDrives::MIN_POSITION[] = {0, 0, 0, 0, 0, 0, 0, 0};
+unsigned int ShiftedFloppyDrives::MAX_POSITION[LAST_DRIVE];
+unsigned int ShiftedFloppyDrives::MIN_POSITION[LAST_DRIVE];
 // ^ Use 81 and 79 for in-place playing
 
 //Array to track the current position of each floppy head.
-unsigned int ShiftedFloppyDrives::currentPosition[] = {0, 0, 0, 0, 0, 0, 0, 0};
+unsigned int ShiftedFloppyDrives::currentPosition[LAST_DRIVE];
 
 // Current period assigned to each drive.  0 = off.  Each period is two-ticks (as defined by
 // TIMER_RESOLUTION in MoppyInstrument.h) long.
-unsigned int ShiftedFloppyDrives::currentPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0};
+unsigned int ShiftedFloppyDrives::currentPeriod[LAST_DRIVE];
 
 // Tracks the current tick-count for each drive (see ShiftedFloppyDrives::tick() below)
-unsigned int ShiftedFloppyDrives::currentTick[] = {0, 0, 0, 0, 0, 0, 0, 0};
+unsigned int ShiftedFloppyDrives::currentTick[LAST_DRIVE];
 
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
-unsigned int ShiftedFloppyDrives::originalPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0};
+unsigned int ShiftedFloppyDrives::originalPeriod[LAST_DRIVE];
+
+// Drives are homed by the tick (see homeStep() below) rather than in a blocking loop
+uint8_t ShiftedFloppyDrives::homingSteps[LAST_DRIVE];
+
+MoppyModulation ShiftedFloppyDrives::modulation;
+MoppyArpeggiator ShiftedFloppyDrives::arpeggiator(ShiftedFloppyDrives::arpNote);
 
 void ShiftedFloppyDrives::setup() {
+    allocator.setRange(0, 0, MAX_FLOPPY_NOTE);
+    voiceAllocator = &allocator;
 
     pinMode(LATCH_PIN, OUTPUT);
+#ifdef SHIFTED_FLOPPIES_SPI_ISR
+    latchPort = portOutputRegister(digitalPinToPort(LATCH_PIN));
+    latchMask = digitalPinToBitMask(LATCH_PIN);
+#endif
     SPI.begin();
     SPI.beginTransaction(SPISettings(16000000, LSBFIRST, SPI_MODE0)); // We're never ending this, hopefully that's okay...
 
-    // With all pins setup, let's do a first run reset
-    resetAll();
-    delay(500); // Wait a half second for safety
-
-    // Setup timer to handle interrupts for floppy driving
+    // Setup timer to handle interrupts for floppy driving (homing happens in the tick too)
     MoppyTimer::initialize(TIMER_RESOLUTION, tick);
-
-    // If MoppyConfig wants a startup sound, play the startupSound on the
-    // first drive.
-    if (PLAY_STARTUP_SOUND) {
-        startupSound(0);
-        delay(500);
+    MoppyTimer::addCallback(controlTick, MOPPY_CONTROL_PERIOD);
+
+    // If the heads' positions survived a restart they don't need to be homed, otherwise
+    // start a first run reset.  Either way the rest of startup happens in the background.
+    bool warmBoot = MoppyWarmBoot::restore(currentPosition, LAST_DRIVE, homing);
+    if (warmBoot) {
+        for (byte d = 0; d < LAST_DRIVE; d++) {
+            setMovement(d, true);
+        }
+    } else {
         resetAll();
     }
+    beginStartup(warmBoot);
 }
 
-// Play startup sound to confirm drive functionality
-void ShiftedFloppyDrives::startupSound(byte driveIndex) {
-    unsigned int chargeNotes[] = {
-        noteDoubleTicks[31],
-        noteDoubleTicks[36],
-        noteDoubleTicks[38],
-        noteDoubleTicks[43],
-        0};
-    byte i = 0;
-    unsigned long lastRun = 0;
-    while (i < 5) {
-        if (millis() - 200 > lastRun) {
-            lastRun = millis();
-            currentPeriod[driveIndex] = chargeNotes[i++];
-        }
-    }
+bool ShiftedFloppyDrives::startupHoming() {
+    return homing();
+}
+
+// Play startup sound on the first drive to confirm drive functionality
+void ShiftedFloppyDrives::startupNote(uint8_t note) {
+    currentPeriod[0] = noteDoubleTicks[note];
+}
+
+void ShiftedFloppyDrives::startupReset() {
+    resetAll();
 }
 
 //
@@ -89,26 +101,28 @@ void ShiftedFloppyDrives::dev_reset(uint8_t subAddress) {
     if (subAddress == 0x00) {
         resetAll();
     } else {
-        reset(subAddress);
+        reset(subAddress - 1);
     }
 }
 
 void ShiftedFloppyDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
-    if (payload[0] <= MAX_FLOPPY_NOTE) {
-        currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] = noteDoubleTicks[payload[0]];
+    if (payload[0] <= MAX_FLOPPY_NOTE && arpeggiator.noteOn(subAddress, payload[0])) {
+        originalPeriod[subAddress - 1] = noteDoubleTicks[payload[0]];
+        modulation.noteOn(subAddress, payload[0]);
+        currentPeriod[subAddress - 1] = modulation.period(subAddress, originalPeriod[subAddress - 1]);
     }
 };
 void ShiftedFloppyDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] = 0;
+    if (arpeggiator.noteOff(subAddress, payload[0])) {
+        currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] = 0;
+    }
 };
 void ShiftedFloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     // A value from -8192 to 8191 representing the pitch deflection
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
-    // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
-    //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    modulation.setBend(subAddress, bendDeflection);
+    currentPeriod[subAddress - 1] = modulation.period(subAddress, originalPeriod[subAddress - 1]);
 };
 
 void ShiftedFloppyDrives::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
@@ -116,6 +130,16 @@ void ShiftedFloppyDrives::deviceMessage(uint8_t subAddress, uint8_t command, uin
     case NETBYTE_DEV_SETMOVEMENT:
         setMovement(subAddress - 1, payload[0] == 0); // MIDI bytes only go to 127, so * 2
         break;
+    case NETBYTE_DEV_SETMODULATION:
+        modulation.setModulation(subAddress, payload);
+        break;
+    case NETBYTE_DEV_SETGLIDE:
+        modulation.setGlide(payload);
+        break;
+    case NETBYTE_DEV_SETARPEGGIO:
+        arpeggiator.setArpeggio(payload);
+        allocator.setStackDepth(arpeggiator.isEnabled() ? MOPPY_ARP_NOTES : 1);
+        break;
     }
 }
 
@@ -155,7 +179,13 @@ void ShiftedFloppyDrives::tick() {
    */
 
     for (int d = 0; d < LAST_DRIVE; d++) {
-        if (currentPeriod[d] > 0) {
+        if (homingSteps[d] > 0) {
+            if (++currentTick[d] >= HOMING_TICKS) {
+                homeStep(d);
+                shiftNeeded = true;
+                currentTick[d] = 0;
+            }
+        } else if (currentPeriod[d] > 0) {
             if (++currentTick[d] >= currentPeriod[d]) {
                 togglePin(d);
                 shiftNeeded = true;
@@ -178,24 +208,80 @@ void ShiftedFloppyDrives::togglePin(byte driveIndex) {
 #endif
 
     unsigned int *cPos = &currentPosition[driveIndex];
+    uint8_t &directionBits = directionByte(driveIndex);
+    uint8_t driveMask = 1 << (driveIndex % 8);
 
     //Switch directions if end has been reached
     if (*cPos >= MAX_POSITION[driveIndex]) {
-        bitSet(directionBits, driveIndex);
+        directionBits |= driveMask;
     } else if (*cPos <= MIN_POSITION[driveIndex]) {
-        bitClear(directionBits, driveIndex);
+        directionBits &= ~driveMask;
     }
 
     //Update currentPosition
-    if (bitRead(directionBits, driveIndex)) {
+    if (directionBits & driveMask) {
         (*cPos)--;
     } else {
         (*cPos)++;
     }
 
-    stepBits ^= (1 << driveIndex);
+    stepByte(driveIndex) ^= driveMask;
+    MOPPY_TRACE_EDGE(voiceOf(driveIndex + 1));
+}
+
+// Moves a homing drive one half-step further back, and leaves it ready to go forward from
+// position 0 once it's done
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR ShiftedFloppyDrives::homeStep(byte driveIndex) {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR ShiftedFloppyDrives::homeStep(byte driveIndex) {
+#else
+void ShiftedFloppyDrives::homeStep(byte driveIndex) {
+#endif
+    uint8_t driveMask = 1 << (driveIndex % 8);
+    stepByte(driveIndex) ^= driveMask;
+
+    if (--homingSteps[driveIndex] == 0) {
+        currentPosition[driveIndex] = 0;         // We're reset.
+        directionByte(driveIndex) &= ~driveMask; // Ready to go forward.
+    }
+}
+
+// Called by the timer every MOPPY_CONTROL_PERIOD to move the arpeggios and LFOs along
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR ShiftedFloppyDrives::controlTick() {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR ShiftedFloppyDrives::controlTick() {
+#else
+void ShiftedFloppyDrives::controlTick() {
+#endif
+    arpeggiator.update();
+    modulation.update();
+    for (byte d = 0; d < LAST_DRIVE; d++) {
+        if (originalPeriod[d] > 0 && modulation.isModulated(d + 1)) {
+            currentPeriod[d] = modulation.period(d + 1, originalPeriod[d]);
+        }
+    }
+}
+
+// Switches a drive to the next note of its arpeggio
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR ShiftedFloppyDrives::arpNote(uint8_t subAddress, uint8_t note) {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR ShiftedFloppyDrives::arpNote(uint8_t subAddress, uint8_t note) {
+#else
+void ShiftedFloppyDrives::arpNote(uint8_t subAddress, uint8_t note) {
+#endif
+    originalPeriod[subAddress - 1] = noteDoubleTicks[note];
+    currentPeriod[subAddress - 1] = modulation.period(subAddress, originalPeriod[subAddress - 1]);
 }
 
+/*
+Writes shiftFrame out to the whole chain of registers and latches it.  On AVR the bytes are fed
+to SPDR from the SPI transfer-complete interrupt, so the tick only pays for starting the
+transfer no matter how many registers there are (unless SHIFTED_FLOPPIES_POLLED_SPI is defined).
+Elsewhere the frame goes out as one bulk write through the SPI FIFO.
+ */
 #ifdef ARDUINO_ARCH_ESP8266
 void ICACHE_RAM_ATTR ShiftedFloppyDrives::shiftBits() {
 #elif ARDUINO_ARCH_ESP32
@@ -203,21 +289,49 @@ void IRAM_ATTR ShiftedFloppyDrives::shiftBits() {
 #else
 void ShiftedFloppyDrives::shiftBits() {
 #endif
-#ifdef ARDUINO_AVR_UNO
-    PORTD &= B11101111;
+#ifdef SHIFTED_FLOPPIES_SPI_ISR
+    if (shiftPosition < DRIVE_BYTES * 2) {
+        shiftPending = true; // Still sending the last frame, send again once it's done
+        return;
+    }
+    *latchPort &= ~latchMask;
+    shiftPosition = 1;
+    SPCR |= _BV(SPIE);
+    SPDR = shiftFrame[0];
+#elif ARDUINO_ARCH_AVR
+    digitalWrite(LATCH_PIN, LOW);
+    for (uint8_t i = 0; i < DRIVE_BYTES * 2; i++) {
+        SPI.transfer(shiftFrame[i]);
+    }
+    digitalWrite(LATCH_PIN, HIGH);
 #else
     digitalWrite(LATCH_PIN, LOW);
+    SPI.writeBytes(shiftFrame, DRIVE_BYTES * 2);
+    digitalWrite(LATCH_PIN, HIGH);
 #endif
+}
 
-    SPI.transfer(directionBits);
-    SPI.transfer(stepBits);
+#ifdef SHIFTED_FLOPPIES_SPI_ISR
+void ShiftedFloppyDrives::shiftNextByte() {
+    if (shiftPosition < DRIVE_BYTES * 2) {
+        SPDR = shiftFrame[shiftPosition++];
+        return;
+    }
 
-#ifdef ARDUINO_AVR_UNO
-    PORTD |= B00010000;
-#else
-    digitalWrite(LATCH_PIN, HIGH);
-#endif
+    // Last byte is out, latch it
+    *latchPort |= latchMask;
+    SPCR &= ~_BV(SPIE);
+    shiftPosition = DRIVE_BYTES * 2;
+    if (shiftPending) {
+        shiftPending = false;
+        shiftBits();
+    }
+}
+
+ISR(SPI_STC_vect) {
+    ShiftedFloppyDrives::shiftNextByte();
 }
+#endif
 #pragma GCC pop_options
 
 //
@@ -226,52 +340,45 @@ void ShiftedFloppyDrives::shiftBits() {
 
 // Immediately stops all drives
 void ShiftedFloppyDrives::haltAllDrives() {
+    arpeggiator.reset(0);
+    modulation.reset(0);
     for (byte d = 0; d < LAST_DRIVE; d++) {
-        currentPeriod[d] = 0;
+        currentPeriod[d] = originalPeriod[d] = 0;
     }
 }
 
-//TODO For a given floppy number, runs the read-head all the way back to 0
-void ShiftedFloppyDrives::reset(byte driveNum) {
-    // currentPeriod[driveNum] = 0; // Stop note
-
-    // byte stepPin = driveNum * 2;
-    // digitalWrite(stepPin + 1, HIGH);                               // Go in reverse
-    // for (unsigned int s = 0; s < MAX_POSITION[driveNum]; s += 2) { //Half max because we're stepping directly (no toggle)
-    //     digitalWrite(stepPin, HIGH);
-    //     digitalWrite(stepPin, LOW);
-    //     delay(5);
-    // }
-    // currentPosition[driveNum] = 0; // We're reset.
-    // currentState[stepPin] = LOW;
-    // digitalWrite(stepPin + 1, LOW);
-    // currentState[stepPin + 1] = LOW; // Ready to go forward.
+// For a given floppy, starts running the read-head all the way back to 0.  The tick does the
+// stepping, so this returns immediately.
+void ShiftedFloppyDrives::reset(byte driveIndex) {
+    uint8_t driveMask = 1 << (driveIndex % 8);
+
+    arpeggiator.reset(driveIndex + 1);
+    currentPeriod[driveIndex] = originalPeriod[driveIndex] = 0; // Stop note
+    modulation.reset(driveIndex + 1);
+    setMovement(driveIndex, true); // Turn movement back on by default
+
+    noInterrupts(); // The tick changes other bits in the same bytes
+    stepByte(driveIndex) &= ~driveMask;     // Even number of toggles, so this ends low
+    directionByte(driveIndex) |= driveMask; // Go in reverse
+    currentTick[driveIndex] = 0;
+    homingSteps[driveIndex] = HOMING_STEPS;
+    interrupts();
 }
 
 // Resets all the drives simultaneously
 void ShiftedFloppyDrives::resetAll() {
-
-    // Stop all drives and set to reverse
     for (byte d = 0; d < LAST_DRIVE; d++) {
-        currentPeriod[d] = 0;
-    }
-    directionBits = B11111111;
-    shiftBits();
-
-    // Reset all drives together
-    for (unsigned int s = 0; s < MAX_POSITION[0]; s += 2) { //Half max because we're stepping directly (no toggle); grab max from index 0
-        stepBits = B11111111;
-        shiftBits();
-        stepBits = B00000000;
-        shiftBits();
-        delay(5);
+        reset(d);
     }
+}
 
-    // Return tracking to ready state
-    directionBits = 0x0;
+// True while any drive is still homing
+bool ShiftedFloppyDrives::homing() {
     for (byte d = 0; d < LAST_DRIVE; d++) {
-        setMovement(d, true);   // Turn movement back on by default
-        currentPosition[d] = 0; // We're reset.
+        if (homingSteps[d] > 0) {
+            return true;
+        }
     }
+    return false;
 }
 } // namespace instruments
\ No newline at end of file
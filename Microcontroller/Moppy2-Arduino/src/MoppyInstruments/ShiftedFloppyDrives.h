@@ -3,17 +3,43 @@
  * Floppy drives connected to shift register(s)
  */
 
-#ifndef SRC_MOPPYINSTRUMENTS_FLOPPYDRIVES_H_
-#define SRC_MOPPYINSTRUMENTS_FLOPPYDRIVES_H_
+#ifndef SRC_MOPPYINSTRUMENTS_SHIFTEDFLOPPYDRIVES_H_
+#define SRC_MOPPYINSTRUMENTS_SHIFTEDFLOPPYDRIVES_H_
 
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 #include "MoppyInstrument.h"
 #include "MoppyTimer.h"
+#include "MoppyModulation.h"
+#include "MoppyArpeggiator.h"
 #include <Arduino.h>
 #include <SPI.h>
+
+/*
+ * Number of drives connected (a multiple of 8).  Each group of 8 drives needs one register for
+ * the step pins and one for the direction pins.  The registers are chained with the step
+ * registers first (drives 1-8 closest to the microcontroller) followed by the direction
+ * registers in the same order, so 8 drives are wired exactly as before.
+ */
+#ifndef SHIFTED_FLOPPY_DRIVES
+#define SHIFTED_FLOPPY_DRIVES 8
+#endif
+
+/*
+ * On AVR the frame is fed to the registers from the SPI transfer-complete interrupt, whose vector
+ * is defined whenever this file is built (composite builds use the drives without
+ * INSTRUMENT_SHIFTED_FLOPPIES, and enabling SPIE without a vector resets the board).  Define
+ * SHIFTED_FLOPPIES_POLLED_SPI to shift with polled SPI instead and leave SPI_STC_vect free for
+ * something else.  INSTRUMENT_SHIFT_REGISTER builds do this since they never use the drives.
+ */
+#if defined ARDUINO_ARCH_AVR && !defined SHIFTED_FLOPPIES_POLLED_SPI && !defined INSTRUMENT_SHIFT_REGISTER
+#define SHIFTED_FLOPPIES_SPI_ISR
+#endif
+
 namespace instruments {
-class ShiftedFloppyDrives : public MoppyInstrument {
+class ShiftedFloppyDrives final : public MoppyStaticInstrument<ShiftedFloppyDrives> {
+    friend class MoppyDispatcher<ShiftedFloppyDrives>;
+
 public:
     void setup();
     static const int LATCH_PIN = 2; //RCLK
@@ -28,32 +54,63 @@ protected:
     void dev_bendPitch(uint8_t subAddress, uint8_t payload[]) override;
     void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
 
+    bool startupHoming() override;
+    void startupNote(uint8_t note) override;
+    void startupReset() override;
+
 private:
-    static const byte LAST_DRIVE = 8; // Number of drives being used.  This determines the size of some arrays.
+    MoppyVoiceAllocator allocator; // Picks drives for NETBYTE_DEV_CHANNEL_NOTEON
+    static MoppyModulation modulation; // Pitch bend and LFOs, by sub-address (drive index + 1)
+    static MoppyArpeggiator arpeggiator; // Cycles through chords given to one drive, also by sub-address
+
+    static const byte LAST_DRIVE = SHIFTED_FLOPPY_DRIVES; // Number of drives being used.  This determines the size of some arrays.
+    static const byte DRIVE_BYTES = LAST_DRIVE / 8;       // Number of registers for each of step and direction
+    static_assert(LAST_DRIVE % 8 == 0, "SHIFTED_FLOPPY_DRIVES must be a multiple of 8");
 
     // Maximum note number to attempt to play on floppy drives.  It's possible higher notes may work,
     // but they may also cause instability.
     static const byte MAX_FLOPPY_NOTE = 71;
 
+    // Step-pin toggles needed to run a head across its full travel when homing
+    static const byte HOMING_STEPS = 158;
+
     static unsigned int MAX_POSITION[LAST_DRIVE];
     static unsigned int MIN_POSITION[LAST_DRIVE];
     static unsigned int currentPosition[LAST_DRIVE];
-    static uint8_t stepBits;      // Bits that represent the current state of the step pins
-    static uint8_t directionBits; // Bits that represent the current state of the direction pins
+    // Bits for every register in the order they're shifted out: direction registers (farthest
+    // first), then step registers.  Drive d's bits are in the byte returned by stepByte/directionByte.
+    static uint8_t shiftFrame[DRIVE_BYTES * 2];
+#ifdef SHIFTED_FLOPPIES_SPI_ISR
+    static volatile uint8_t *latchPort; // Output register and bit for LATCH_PIN, for quick toggling
+    static uint8_t latchMask;
+    static volatile uint8_t shiftPosition; // Next byte of shiftFrame to send (DRIVE_BYTES * 2 when idle)
+    static volatile bool shiftPending;     // Bits changed while a shift was in progress
+#endif
     static unsigned int currentPeriod[LAST_DRIVE];
     static unsigned int currentTick[LAST_DRIVE];
     static unsigned int originalPeriod[LAST_DRIVE];
+    static uint8_t homingSteps[LAST_DRIVE]; // Step-pin toggles left before each drive is homed (0 when not homing)
 
     static void tick();
+    static void controlTick();
+    static void arpNote(uint8_t subAddress, uint8_t note);
     static void resetAll();
     static void togglePin(byte driveIndex);
+    static void homeStep(byte driveIndex);
     static void shiftBits();
+    static uint8_t &stepByte(byte driveIndex) { return shiftFrame[DRIVE_BYTES * 2 - 1 - driveIndex / 8]; }
+    static uint8_t &directionByte(byte driveIndex) { return shiftFrame[DRIVE_BYTES - 1 - driveIndex / 8]; }
     static void haltAllDrives();
-    static void reset(byte driveNum);
+    static void reset(byte driveIndex);
+    static bool homing();
     static void blinkLED();
-    static void startupSound(byte driveIndex);
     static void setMovement(byte driveIndex, bool movementEnabled);
+
+#ifdef SHIFTED_FLOPPIES_SPI_ISR
+public:
+    static void shiftNextByte(); // Called by the SPI transfer-complete interrupt
+#endif
 };
 } // namespace instruments
 
-#endif /* SRC_MOPPYINSTRUMENTS_FLOPPYDRIVES_H_ */
\ No newline at end of file
+#endif /* SRC_MOPPYINSTRUMENTS_SHIFTEDFLOPPYDRIVES_H_ */
\ No newline at end of file
@@ -1,59 +1,161 @@
 /*
  * MoppyMessageConsumer.h
  * Base class for any objects that consume MoppyMessages (with some helpful functions for common messages).
+ *
+ * The switch that turns a message into a call to one of the handlers below is in MoppyDispatcher,
+ * a template on the consumer's type.  MoppyMessageConsumer uses it with itself, so every handler
+ * is a virtual call.  A final class can use it with its own type instead (see
+ * MoppyStaticInstrument), which makes every handler a direct call the compiler can inline.
  */
 
 #ifndef MOPPY_SRC_MOPPYMESSAGECONSUMER_H_
 #define MOPPY_SRC_MOPPYMESSAGECONSUMER_H_
 
 #include "MoppyNetworks/MoppyNetwork.h"
+#include "MoppyNetworks/MoppyStats.h"
+#include "MoppyNetworks/MoppyTrace.h"
+#include "MoppyInstruments/MoppyVoiceAllocator.h"
 #include <Arduino.h>
 
-class MoppyMessageConsumer {
+/*
+ * Calls the handlers of a Consumer for each message.  Consumers declare it a friend so it can
+ * reach their protected handlers.
+ */
+template <class Consumer>
+class MoppyDispatcher {
 public:
-    virtual void handleSystemMessage(uint8_t command, uint8_t payload[]) {
+    static void systemMessage(Consumer &consumer, uint8_t command, uint8_t payload[]) {
         switch (command) {
         // NETBYTE_SYS_PING is handled by the network adapter directly
         case NETBYTE_SYS_START: // Sequence start
-            sys_sequenceStart();
+            consumer.sys_sequenceStart();
             break;
         case NETBYTE_SYS_STOP: // Sequence stop
-            sys_sequenceStop();
+            resetVoices(consumer);
+            consumer.sys_sequenceStop();
             break;
         case NETBYTE_SYS_RESET: // System reset
-            sys_reset();
+            resetVoices(consumer);
+            consumer.sys_reset();
             break;
         default:
-            systemMessage(command, payload); // Fallback on a generic handler in case there's an implementation-specific message
+            consumer.systemMessage(command, payload); // Fallback on a generic handler in case there's an implementation-specific message
             break;
         }
-    };
+    }
 
-    virtual void handleDeviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    static void deviceMessage(Consumer &consumer, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
         switch (command) {
         case NETBYTE_DEV_RESET: // Reset
             if (subAddress == 0x00) {
-                sys_reset();
+                resetVoices(consumer);
+                consumer.sys_reset();
             } else {
-                dev_reset(subAddress);
+                MoppyStats::voiceOff(Consumer::voiceOf(subAddress));
+                consumer.dev_reset(subAddress);
             }
             break;
         case NETBYTE_DEV_NOTEON: // Note On
-            dev_noteOn(subAddress, payload);
+            MoppyStats::voiceOn(Consumer::voiceOf(subAddress));
+            MOPPY_TRACE_NOTE(Consumer::voiceOf(subAddress));
+            consumer.dev_noteOn(subAddress, payload);
             break;
         case NETBYTE_DEV_NOTEOFF: // Note Off
-            dev_noteOff(subAddress, payload);
+            MoppyStats::voiceOff(Consumer::voiceOf(subAddress));
+            consumer.dev_noteOff(subAddress, payload);
             break;
         case NETBYTE_DEV_BENDPITCH: //Pitch bend
-            dev_bendPitch(subAddress, payload);
+            if (subAddress == 0x00 && consumer.voiceAllocator != nullptr) {
+                // Bend every sounding voice
+                for (uint8_t sub = MIN_SUB_ADDRESS; sub <= MAX_SUB_ADDRESS; sub++) {
+                    if (consumer.voiceAllocator->isPlaying(sub)) {
+                        consumer.dev_bendPitch(sub, payload);
+                    }
+                }
+            } else {
+                consumer.dev_bendPitch(subAddress, payload);
+            }
+            break;
+        case NETBYTE_DEV_CHANNEL_NOTEON: // Note On, device picks the voice
+            channelNoteOn(consumer, payload);
+            break;
+        case NETBYTE_DEV_CHANNEL_NOTEOFF: // Note Off, device picks the voice
+            channelNoteOff(consumer, payload);
             break;
         default:
-            deviceMessage(subAddress, command, payload);
+            consumer.deviceMessage(subAddress, command, payload);
             break;
         };
+    }
+
+private:
+    static void resetVoices(Consumer &consumer) {
+        MoppyStats::voicesOff(Consumer::voiceOf(MIN_SUB_ADDRESS), Consumer::voiceCount());
+        if (consumer.voiceAllocator != nullptr) {
+            consumer.voiceAllocator->reset();
+        }
+    }
+
+    // Payload is [note, velocity, channel].  Voices are assigned by voiceAllocator and the notes
+    // are passed on to dev_noteOn/dev_noteOff, stopping any note that had to be stolen first.
+    static void channelNoteOn(Consumer &consumer, uint8_t payload[]) {
+        if (consumer.voiceAllocator == nullptr) {
+            return;
+        }
+        uint8_t stolenNote;
+        uint8_t subAddress = consumer.voiceAllocator->noteOn(payload[2], payload[0], &stolenNote);
+        if (subAddress == 0) {
+            return;
+        }
+        if (stolenNote != 0) {
+            uint8_t offPayload[2] = {stolenNote, 0};
+            consumer.dev_noteOff(subAddress, offPayload);
+        }
+        MoppyStats::voiceOn(Consumer::voiceOf(subAddress));
+        MOPPY_TRACE_NOTE(Consumer::voiceOf(subAddress));
+        consumer.dev_noteOn(subAddress, payload);
+    }
+
+    static void channelNoteOff(Consumer &consumer, uint8_t payload[]) {
+        if (consumer.voiceAllocator == nullptr) {
+            return;
+        }
+        uint8_t subAddress = consumer.voiceAllocator->noteOff(payload[2], payload[0]);
+        if (subAddress != 0) {
+            if (!consumer.voiceAllocator->isPlaying(subAddress)) {
+                MoppyStats::voiceOff(Consumer::voiceOf(subAddress)); // Other notes may still share the voice
+            }
+            consumer.dev_noteOff(subAddress, payload);
+        }
+    }
+};
+
+class MoppyMessageConsumer {
+    template <class Consumer> friend class MoppyDispatcher;
+
+public:
+    virtual void handleSystemMessage(uint8_t command, uint8_t payload[]) {
+        MoppyDispatcher<MoppyMessageConsumer>::systemMessage(*this, command, payload);
+    };
+
+    // Messages are only passed on if they're for this board (see MoppyAddresses.h), so most
+    // consumers can ignore the device address
+    virtual void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+        MoppyDispatcher<MoppyMessageConsumer>::deviceMessage(*this, subAddress, command, payload);
     };
 
+    // The allocator behind NETBYTE_DEV_CHANNEL_NOTEON/OFF, or nullptr if they aren't supported
+    MoppyVoiceAllocator *getVoiceAllocator() const { return voiceAllocator; }
+
 protected:
+    // Instruments that support NETBYTE_DEV_CHANNEL_NOTEON/OFF point this at their allocator
+    MoppyVoiceAllocator *voiceAllocator = nullptr;
+
+    // The voice (for MoppyStats and MoppyTrace) playing a sub-address, and how many there are.
+    // Instruments sharing a board have their own voices, see MoppyStaticInstrument.
+    static uint8_t voiceOf(uint8_t subAddress) { return subAddress - MIN_SUB_ADDRESS; }
+    static uint8_t voiceCount() { return MOPPY_NUM_VOICES; }
+
     virtual void sys_sequenceStart(){};
     virtual void sys_sequenceStop(){};
     virtual void sys_reset(){};
@@ -0,0 +1,91 @@
+/*
+ * MoppyAddresses.h
+ * The device addresses and sub-address ranges this board answers, as a table fixed at compile
+ * time.  Normally that's just DEVICE_ADDRESS with MIN_SUB_ADDRESS to MAX_SUB_ADDRESS, but with
+ * INSTRUMENT_COMPOSITE there's one range per instrument (see MoppyComposite.h).
+ *
+ * The networks filter incoming messages against the whole table, and answer a ping with one
+ * pong per range so the Controller sees each instrument as its own device.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYADDRESSES_H_
+#define SRC_MOPPYNETWORKS_MOPPYADDRESSES_H_
+
+#include "../MoppyConfig.h"
+#include "MoppyNetwork.h"
+#include <stdint.h>
+
+#define MOPPY_PONG_LENGTH 8
+
+struct MoppyAddressRange {
+    uint8_t deviceAddress;
+    uint8_t minSubAddress;
+    uint8_t maxSubAddress;
+};
+
+constexpr MoppyAddressRange MOPPY_ADDRESSES[] = {
+#ifdef INSTRUMENT_COMPOSITE
+    COMPOSITE_ADDRESSES
+#else
+    {DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS}
+#endif
+};
+
+constexpr uint8_t MOPPY_ADDRESS_COUNT = sizeof(MOPPY_ADDRESSES) / sizeof(MOPPY_ADDRESSES[0]);
+
+// Stats and traces number the voices of the whole board from 0, through each range in turn.
+// This is the number of the first voice of range r (or of all voices, for MOPPY_ADDRESS_COUNT).
+constexpr uint8_t moppyVoiceBase(uint8_t r) {
+    return r == 0 ? 0 : moppyVoiceBase(r - 1) + MOPPY_ADDRESSES[r - 1].maxSubAddress - MOPPY_ADDRESSES[r - 1].minSubAddress + 1;
+}
+
+constexpr uint8_t MOPPY_VOICE_COUNT = moppyVoiceBase(MOPPY_ADDRESS_COUNT);
+
+class MoppyAddresses {
+public:
+    // True if any range is for deviceAddress (system messages are for everyone)
+    static bool acceptsDevice(uint8_t deviceAddress) {
+        if (deviceAddress == SYSTEM_ADDRESS) {
+            return true;
+        }
+        for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+            if (MOPPY_ADDRESSES[r].deviceAddress == deviceAddress) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // True if a message for the device and sub-address should be handled.  Sub-address 0 is
+    // for every voice of the device.
+    static bool accepts(uint8_t deviceAddress, uint8_t subAddress) {
+        if (deviceAddress == SYSTEM_ADDRESS) {
+            return true;
+        }
+        for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+            if (inRange(MOPPY_ADDRESSES[r], deviceAddress, subAddress)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool inRange(const MoppyAddressRange &range, uint8_t deviceAddress, uint8_t subAddress) {
+        return range.deviceAddress == deviceAddress &&
+               (subAddress == 0x00 || (subAddress >= range.minSubAddress && subAddress <= range.maxSubAddress));
+    }
+
+    // Fill in the pong for one range
+    static void pong(uint8_t index, uint8_t pongBytes[MOPPY_PONG_LENGTH]) {
+        pongBytes[0] = START_BYTE;
+        pongBytes[1] = SYSTEM_ADDRESS;
+        pongBytes[2] = 0x00;
+        pongBytes[3] = 0x04;
+        pongBytes[4] = NETBYTE_SYS_PONG;
+        pongBytes[5] = MOPPY_ADDRESSES[index].deviceAddress;
+        pongBytes[6] = MOPPY_ADDRESSES[index].minSubAddress;
+        pongBytes[7] = MOPPY_ADDRESSES[index].maxSubAddress;
+    }
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYADDRESSES_H_ */
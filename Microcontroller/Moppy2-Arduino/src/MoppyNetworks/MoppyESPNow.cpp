@@ -6,10 +6,29 @@
  * ESP-Now communication implementation for ESP8266/ESP32 devices.  
  * Instrument has its handler functions called for device and system messages
  */
-std::queue<uint8_t> MoppyESPNow::messageQueue; // Queue for the incoming messages
+uint8_t MoppyESPNow::rxBuffer[MOPPY_ESPNOW_RX_BUFFER]; // Incoming bytes
+uint16_t MoppyESPNow::rxHead = 0;
+uint16_t MoppyESPNow::rxTail = 0;
+volatile uint16_t MoppyESPNow::rxCount = 0;
+volatile uint16_t MoppyESPNow::rxDropped = 0;
 uint8_t MoppyESPNow::messageBuffer[MOPPY_MAX_PACKET_LENGTH]; // Buffer for the current message
 volatile bool MoppyESPNow::sendingCompleted = true; // Signalizes that new data can be sent
 uint8_t MoppyESPNow::gwMacAddress[6]; // MAC Address of the ESP-Now gateway to which to respond to
+#ifdef MOPPY_TRACE
+MoppyESPNow::Arrival MoppyESPNow::arrivals[MOPPY_ESPNOW_RX_PACKETS]; // When each packet in rxBuffer arrived
+uint8_t MoppyESPNow::arrivalHead = 0;
+volatile uint8_t MoppyESPNow::arrivalCount = 0;
+#endif
+
+#ifdef ARDUINO_ARCH_ESP32
+// The receive callback runs in the WiFi task, alongside loop()
+static portMUX_TYPE espNowMux = portMUX_INITIALIZER_UNLOCKED;
+#define ESPNOW_LOCK() portENTER_CRITICAL(&espNowMux)
+#define ESPNOW_UNLOCK() portEXIT_CRITICAL(&espNowMux)
+#else
+#define ESPNOW_LOCK() noInterrupts()
+#define ESPNOW_UNLOCK() interrupts()
+#endif
 
 MoppyESPNow::MoppyESPNow(MoppyMessageConsumer *messageConsumer) {
     targetConsumer = messageConsumer;
@@ -24,8 +43,9 @@ void MoppyESPNow::begin() {
     WiFi.setSleep(false);
     Serial.print("Detected MAC address of instrument: ");
     Serial.println(WiFi.macAddress());
-    // Change WiFi channel
-    if (esp_wifi_set_channel(MOPPY_WIFI_CHANNEL, WIFI_SECOND_CHAN_NONE) != ESP_OK) {
+    // Change WiFi channel, unless MoppyUDP has already joined an access point.  Then ESP-Now has
+    // to use the access point's channel, and MOPPY_WIFI_CHANNEL on the gateway must match it.
+    if (WiFi.status() != WL_CONNECTED && esp_wifi_set_channel(MOPPY_WIFI_CHANNEL, WIFI_SECOND_CHAN_NONE) != ESP_OK) {
         Serial.println("ERROR - Changing WiFi channel failed");
         return;
     }
@@ -48,17 +68,45 @@ void MoppyESPNow::begin() {
 
 // Callback function executed when data is received
 void MoppyESPNow::onDataReceived(const uint8_t * macAddr, const uint8_t * incomingData, int dataLength) {
+    if (dataLength <= 0) {
+        return;
+    }
     memcpy(gwMacAddress, macAddr, 6); // The message comes from the gateway
-    for (uint8_t i = 0; i < dataLength; i++)
-    {
-        messageQueue.push(incomingData[i]);
+
+    // Only this callback moves rxTail, so the copy can happen outside the lock as long as the
+    // bytes are only counted once they're in place
+    ESPNOW_LOCK();
+    bool fits = MOPPY_ESPNOW_RX_BUFFER - rxCount >= dataLength;
+#ifdef MOPPY_TRACE
+    fits = fits && arrivalCount < MOPPY_ESPNOW_RX_PACKETS;
+#endif
+    if (!fits) {
+        rxDropped += dataLength;
+    }
+    ESPNOW_UNLOCK();
+    if (!fits) {
+        return;
+    }
+
+#ifdef MOPPY_TRACE
+    arrivals[(arrivalHead + arrivalCount) % MOPPY_ESPNOW_RX_PACKETS] = {MoppyTrace::now(), (uint8_t)dataLength};
+#endif
+    for (int i = 0; i < dataLength; i++) {
+        rxBuffer[rxTail] = incomingData[i];
+        rxTail = (rxTail + 1) % MOPPY_ESPNOW_RX_BUFFER;
     }
+    ESPNOW_LOCK();
+    rxCount += dataLength;
+#ifdef MOPPY_TRACE
+    arrivalCount++;
+#endif
+    ESPNOW_UNLOCK();
 }
 
 // Callback function executed when data is sent
 void MoppyESPNow::onDataSent(const uint8_t * macAddr, esp_now_send_status_t status) {
     if (status != ESP_NOW_SEND_SUCCESS) {
-        Serial.println("ERROR - Pong response could not be sent");
+        Serial.println("ERROR - Response could not be sent");
     }
     sendingCompleted = true;
 }
@@ -72,66 +120,169 @@ void MoppyESPNow::onDataSent(const uint8_t * macAddr, esp_now_send_status_t stat
  *  5... - Optional payload
  */
 void MoppyESPNow::readMessages() {
+    ESPNOW_LOCK();
+    rxUnread = rxCount;
+    uint16_t dropped = rxDropped;
+    rxDropped = 0;
+    ESPNOW_UNLOCK();
+    MoppyStats::bytesDiscarded += dropped;
+    MoppyStats::rxWaiting(rxUnread);
+
     // If we're waiting for position 4, then we know how many bytes we're waiting for, no need
     // to start reading until they're all there.
-    while ((messagePos != 4 && !messageQueue.empty()) || (messagePos == 4 && messageQueue.size() >= messageBuffer[3])) {
+    while ((messagePos != 4 && rxUnread > 0) || (messagePos == 4 && rxUnread >= messageBuffer[3])) {
         switch (messagePos) {
         case 0:
-            if (messageQueue.front() == START_BYTE) {
-                messageBuffer[messagePos] = messageQueue.front();
+            if (frontByte() == START_BYTE) {
+                MOPPY_TRACE_RECEIVED_AT(arrivals[arrivalHead].time);
+                messageBuffer[messagePos] = frontByte();
                 messagePos++;
             }
-            messageQueue.pop();
+            else {
+                MoppyStats::bytesDiscarded++;
+            }
+            popByte();
             break;
         case 1:
-            if (messageQueue.front() == SYSTEM_ADDRESS || messageQueue.front() == DEVICE_ADDRESS) {
-                messageBuffer[messagePos] = messageQueue.front();
+            if (MoppyAddresses::acceptsDevice(frontByte())) {
+                messageBuffer[messagePos] = frontByte();
                 messagePos++; 
             }
             else {
+                MoppyStats::framesFiltered++;
                 messagePos = 0; // This message isn't for us
             }
-            messageQueue.pop();
+            popByte();
             break;
         case 2:
-            if (messageQueue.front() == 0x00 || (messageQueue.front() >= MIN_SUB_ADDRESS && messageQueue.front() <= MAX_SUB_ADDRESS)) {
-                messageBuffer[messagePos] = messageQueue.front();
+            if (MoppyAddresses::accepts(messageBuffer[1], frontByte())) {
+                messageBuffer[messagePos] = frontByte();
                 messagePos++; // Valid subAddress, continue
             }
             else {
+                MoppyStats::framesFiltered++;
                 messagePos = 0; // Not listening to this subAddress, skip this message
             }
-            messageQueue.pop();
+            popByte();
             break;
         case 3:
-            messageBuffer[messagePos] = messageQueue.front();
+            messageBuffer[messagePos] = frontByte();
+            popByte();
+            if (messageBuffer[3] == 0 || 4 + messageBuffer[3] > MOPPY_MAX_PACKET_LENGTH) {
+                MoppyStats::framesBad++; // No command byte, or longer than a packet can be
+                messagePos = 0;
+                break;
+            }
             messagePos++;
-            messageQueue.pop();
             break;
         case 4:
             // Read command and payload
             for (uint8_t i = 0; i < messageBuffer[3]; i++) {
-                messageBuffer[messagePos + i] = messageQueue.front();
-                messageQueue.pop();
+                messageBuffer[messagePos + i] = frontByte();
+                popByte();
             }
+            MoppyStats::framesOk++;
+            MOPPY_TRACE_FRAMED();
             // Call appropriate handler
             if (messageBuffer[1] == SYSTEM_ADDRESS) {
                 if (messageBuffer[4] == NETBYTE_SYS_PING) {
                     sendPong(); // Respond with pong if requested
-                } 
+                }
+                else if (messageBuffer[4] == NETBYTE_SYS_STATS) {
+                    sendStats(messageBuffer[3] > 1 && messageBuffer[5] != 0);
+                }
+#ifdef MOPPY_TRACE
+                else if (messageBuffer[4] == NETBYTE_SYS_TRACE) {
+                    sendTrace();
+                }
+#endif
+#ifdef MOPPY_JITTER_BUFFER
+                else if (messageBuffer[4] == NETBYTE_SYS_TIMESTAMP) {
+                    if (messageBuffer[3] >= 3) {
+                        jitterBuffer.setSenderTime(messageBuffer[5] << 8 | messageBuffer[6]);
+                    }
+                }
+                else if (!jitterBuffer.push(SYSTEM_ADDRESS, 0, messageBuffer[4], &messageBuffer[5], messageBuffer[3] - 1, millis())) {
+                    targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
+                }
+#else
                 else {
                     targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
                 }
+#endif
             } 
             else {
-                targetConsumer->handleDeviceMessage(messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
+#ifdef MOPPY_JITTER_BUFFER
+                if (!jitterBuffer.push(messageBuffer[1], messageBuffer[2], messageBuffer[4], &messageBuffer[5], messageBuffer[3] - 1, millis()))
+#endif
+                targetConsumer->handleDeviceMessage(messageBuffer[1], messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
             }
             messagePos = 0; // Start looking for a new message in the queue
         }
     }
+#ifdef MOPPY_JITTER_BUFFER
+    // Play out whatever is due
+    jitterBuffer.release(targetConsumer);
+#endif
+}
+
+// Drop the byte at the front of rxBuffer, making room for the callback
+void MoppyESPNow::popByte() {
+    rxHead = (rxHead + 1) % MOPPY_ESPNOW_RX_BUFFER;
+    rxUnread--;
+#ifdef MOPPY_TRACE
+    bool packetDone = --arrivals[arrivalHead].bytesLeft == 0;
+    if (packetDone) {
+        arrivalHead = (arrivalHead + 1) % MOPPY_ESPNOW_RX_PACKETS; // That was the last byte of its packet
+    }
+#endif
+    ESPNOW_LOCK();
+    rxCount--;
+#ifdef MOPPY_TRACE
+    if (packetDone) {
+        arrivalCount--;
+    }
+#endif
+    ESPNOW_UNLOCK();
 }
 
 void MoppyESPNow::sendPong() {
+    uint8_t pongBytes[MOPPY_PONG_LENGTH];
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        MoppyAddresses::pong(r, pongBytes);
+        sendUpstream(pongBytes, sizeof(pongBytes));
+    }
+}
+
+void MoppyESPNow::sendStats(bool clear) {
+    uint8_t statsBytes[MOPPY_STATS_REPORT_LENGTH];
+#ifdef MOPPY_JITTER_BUFFER
+    MoppyStats::jitterState(jitterBuffer.getDelay(), jitterBuffer.getUnderruns(), jitterBuffer.getDepth());
+#endif
+    MoppyStats::report(DEVICE_ADDRESS, statsBytes);
+    sendUpstream(statsBytes, sizeof(statsBytes));
+    if (clear) {
+        MoppyStats::reset();
+#ifdef MOPPY_JITTER_BUFFER
+        jitterBuffer.clearUnderruns();
+#endif
+    }
+}
+
+#ifdef MOPPY_TRACE
+void MoppyESPNow::sendTrace() {
+    uint8_t traceBytes[MOPPY_TRACE_REPORT_LENGTH];
+    uint8_t length;
+    bool more;
+    do {
+        more = MoppyTrace::report(DEVICE_ADDRESS, traceBytes, &length);
+        sendUpstream(traceBytes, length);
+    } while (more);
+}
+#endif
+
+// Sends a message back to the gateway, which writes it to serial for the Controller
+void MoppyESPNow::sendUpstream(const uint8_t data[], uint8_t length) {
     if (!esp_now_is_peer_exist(gwMacAddress)) {
         esp_now_peer_info_t gwPeerInfo;
         memcpy(&gwPeerInfo.peer_addr, gwMacAddress, 6);
@@ -142,8 +293,18 @@ void MoppyESPNow::sendPong() {
             return;
         }
     }
+    // ESP-Now only takes one packet at a time, so multi-packet replies (pongs for every address
+    // range, trace dumps) wait for the last one to go out rather than failing with
+    // ESP_ERR_ESPNOW_NO_MEM
+    unsigned long waitStarted = millis();
+    if (!sendingCompleted) {
+        MoppyStats::sendStalls++;
+    }
+    while (!sendingCompleted && millis() - waitStarted < MOPPY_ESPNOW_SEND_TIMEOUT) {
+        delay(1);
+    }
     sendingCompleted = false;
-    esp_now_send(gwMacAddress, pongBytes, 8);
+    esp_now_send(gwMacAddress, data, length);
     //if (result == ESP_OK)
     //{
     //  Serial.println("Broadcast message success");
@@ -11,7 +11,13 @@
 #include "../MoppyConfig.h"
 #include "../MoppyMessageConsumer.h"
 #include "Arduino.h"
+#include "MoppyAddresses.h"
 #include "MoppyNetwork.h"
+#include "MoppyStats.h"
+#include "MoppyTrace.h"
+#ifdef MOPPY_JITTER_BUFFER
+#include "MoppyJitterBuffer.h"
+#endif
 #ifdef ARDUINO_ARCH_ESP8266
 #include <ESP8266WiFi.h>
 #elif ARDUINO_ARCH_ESP32
@@ -20,11 +26,18 @@
 #include <esp_now.h>
 #include <esp_wifi.h>
 #include <stdint.h>
-#include <queue>
 
 #define MOPPY_MAX_PACKET_LENGTH ESP_NOW_MAX_DATA_LEN
 #define MOPPY_WIFI_CHANNEL 1
 
+// Received bytes (and packets, for MOPPY_TRACE) that can wait for readMessages().  Packets that
+// don't fit are dropped whole.
+#define MOPPY_ESPNOW_RX_BUFFER 1024
+#define MOPPY_ESPNOW_RX_PACKETS 16
+
+// Milliseconds to wait for the previous reply to go out before sending the next one
+#define MOPPY_ESPNOW_SEND_TIMEOUT 20
+
 class MoppyESPNow {
 public:
     MoppyESPNow(MoppyMessageConsumer *messageConsumer);
@@ -33,13 +46,38 @@ public:
 
 private:
     MoppyMessageConsumer * targetConsumer;
-    static std::queue<uint8_t> messageQueue;                // Queue for the incoming messages
+    // Incoming bytes, written by the WiFi task and read by readMessages().  Each side owns its
+    // end of the ring, and only rxCount (and rxDropped) are shared, under a lock.
+    static uint8_t rxBuffer[MOPPY_ESPNOW_RX_BUFFER];
+    static uint16_t rxHead;                                 // Next byte to read
+    static uint16_t rxTail;                                 // Next byte to write
+    static volatile uint16_t rxCount;
+    static volatile uint16_t rxDropped;                     // Bytes of packets that didn't fit, for MoppyStats
+    uint16_t rxUnread = 0;                                  // Bytes readMessages() knows are waiting
     static uint8_t messageBuffer[MOPPY_MAX_PACKET_LENGTH];  // Buffer for the current message
     uint8_t messagePos = 0;                                 // Tracks current message read position 
     volatile static bool sendingCompleted;                  // Signalizes that new data can be sent
     static uint8_t gwMacAddress[6];                // MAC Address of the ESP-Now gateway to which to respond to
-    const uint8_t pongBytes[8] = {START_BYTE, 0x00, 0x00, 0x04, 0x81, DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
+#ifdef MOPPY_TRACE
+    struct Arrival {
+        uint32_t time;
+        uint8_t bytesLeft; // Bytes of the packet still in rxBuffer
+    };
+    static Arrival arrivals[MOPPY_ESPNOW_RX_PACKETS];       // When each packet in rxBuffer arrived
+    static uint8_t arrivalHead;
+    static volatile uint8_t arrivalCount;
+#endif
+#ifdef MOPPY_JITTER_BUFFER
+    MoppyJitterBuffer jitterBuffer;
+#endif
+    uint8_t frontByte() const { return rxBuffer[rxHead]; }
+    void popByte();
     void sendPong();
+    void sendStats(bool clear);
+#ifdef MOPPY_TRACE
+    void sendTrace();
+#endif
+    void sendUpstream(const uint8_t data[], uint8_t length);
     static void onDataReceived(const uint8_t * macAddr, const uint8_t * incomingData, int dataLength);
     static void onDataSent(const uint8_t * macAddr, esp_now_send_status_t status);
 };
@@ -4,16 +4,47 @@
 #else
 
 /*
- * ESP-Now gateway implementation for ESP8266/ESP32 devices. 
+ * ESP-Now gateway implementation for ESP8266/ESP32 devices.
  * Data incomming on serial is relayed as ESP-Now broadcasts.
+ *
+ * On the ESP32 the relaying is done by FreeRTOS tasks instead of loop():
+ *  - The UART driver fills a large receive ring from its interrupt
+ *  - The framing task cuts the byte stream into Moppy frames and queues them
+ *  - The radio task packs queued frames into broadcasts and waits for onDataSent
+ *    before sending the next one
+ *  - The upstream task writes packets received from the instruments to serial
  */
+const uint8_t MoppyESPNowGateway::broadcastMacAddress[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+#ifdef ARDUINO_ARCH_ESP32
+QueueHandle_t MoppyESPNowGateway::frameQueue = NULL;
+QueueHandle_t MoppyESPNowGateway::upstreamQueue = NULL;
+TaskHandle_t MoppyESPNowGateway::radioTask = NULL;
+#else
 volatile bool MoppyESPNowGateway::sendingCompleted = true; // Signalizes that new data can be sent
+#endif
 
 MoppyESPNowGateway::MoppyESPNowGateway() {
 }
 
 void MoppyESPNowGateway::begin() {
-    Serial.begin(115200);
+#ifdef ARDUINO_ARCH_ESP32
+    // Serial is driven through the UART driver directly so that its interrupt-fed ring
+    // buffer can be sized for bursts, and so the tasks below can block on it
+    uart_config_t uartConfig = {};
+    uartConfig.baud_rate = MOPPY_GATEWAY_BAUD_RATE;
+    uartConfig.data_bits = UART_DATA_8_BITS;
+    uartConfig.parity = UART_PARITY_DISABLE;
+    uartConfig.stop_bits = UART_STOP_BITS_1;
+    uartConfig.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    uart_param_config(MOPPY_GATEWAY_UART, &uartConfig);
+    uart_driver_install(MOPPY_GATEWAY_UART, MOPPY_GATEWAY_RX_BUFFER_SIZE, MOPPY_GATEWAY_TX_BUFFER_SIZE, 0, NULL, 0);
+
+    frameQueue = xQueueCreate(MOPPY_GATEWAY_FRAME_QUEUE_LENGTH, sizeof(Packet));
+    upstreamQueue = xQueueCreate(MOPPY_GATEWAY_UPSTREAM_QUEUE_LENGTH, sizeof(Packet));
+#else
+    Serial.begin(MOPPY_GATEWAY_BAUD_RATE);
+#endif
     // Initialize WiFi stack
     WiFi.mode(WIFI_STA);
     // Disable sleep mode
@@ -31,9 +62,9 @@ void MoppyESPNowGateway::begin() {
         return;
     }
     // Add broadcast peer
-    esp_now_peer_info_t broadcastPeerInfo;
+    esp_now_peer_info_t broadcastPeerInfo = {};
     memcpy(broadcastPeerInfo.peer_addr, broadcastMacAddress, 6);
-    broadcastPeerInfo.channel = MOPPY_WIFI_CHANNEL;  
+    broadcastPeerInfo.channel = MOPPY_WIFI_CHANNEL;
     broadcastPeerInfo.encrypt = false;
     if (esp_now_add_peer(&broadcastPeerInfo) != ESP_OK){
         //Serial.println("ERROR - Adding broadcast peer failed");
@@ -48,9 +79,151 @@ void MoppyESPNowGateway::begin() {
         //Serial.println("ERROR - Registering ESP-NOW OnReceived Callback failed");
         return;
     }
+#ifdef ARDUINO_ARCH_ESP32
+    // The radio task runs above the framing task so that queued frames are always
+    // drained first; the WiFi stack itself runs above both.
+    xTaskCreatePinnedToCore(radioTaskLoop, "moppyRadio", 4096, NULL, 5, &radioTask, 1);
+    xTaskCreatePinnedToCore(framingTaskLoop, "moppyFraming", 4096, NULL, 4, NULL, 1);
+    xTaskCreatePinnedToCore(upstreamTaskLoop, "moppyUpstream", 4096, NULL, 3, NULL, 1);
+#endif
     //Serial.println("SUCCES - Gateway is up and running");
 }
 
+#ifdef ARDUINO_ARCH_ESP32
+
+// Callback function executed (in the WiFi task) when data is received
+void MoppyESPNowGateway::onDataReceived(const uint8_t * macAddr, const uint8_t * incomingData, int dataLength) {
+    // Hand the message over to the upstream task, never block the WiFi task on serial
+    Packet packet;
+    packet.length = dataLength < MOPPY_MAX_PACKET_LENGTH ? dataLength : MOPPY_MAX_PACKET_LENGTH;
+    memcpy(packet.data, incomingData, packet.length);
+    xQueueSend(upstreamQueue, &packet, 0);
+}
+
+// Callback function executed (in the WiFi task) when data is sent
+void MoppyESPNowGateway::onDataSent(const uint8_t * macAddr, esp_now_send_status_t status) {
+    //if (status != ESP_NOW_SEND_SUCCESS) {
+    //    Serial.println("ERROR - Broadcast message could not be sent");
+    //}
+    xTaskNotifyGive(radioTask);
+}
+
+/* MoppyMessages contain the following bytes:
+ *  0    - START_BYTE (always 0x4d)
+ *  1    - Device address (0x00 for system-wide messages)
+ *  2    - Sub address (Ignored for system-wide messages)
+ *  3    - Size of message body (number of bytes following this one)
+ *  4    - Command byte
+ *  5... - Optional payload
+ */
+void MoppyESPNowGateway::framingTaskLoop(void *parameters) {
+    Packet frame;
+    for (;;) {
+        // Block until a start byte shows up in the receive ring
+        if (uart_read_bytes(MOPPY_GATEWAY_UART, frame.data, 1, portMAX_DELAY) != 1) {
+            continue;
+        }
+        if (frame.data[0] != START_BYTE) {
+            MoppyStats::bytesDiscarded++;
+            continue;
+        }
+        size_t waiting;
+        if (uart_get_buffered_data_len(MOPPY_GATEWAY_UART, &waiting) == ESP_OK) {
+            MoppyStats::rxWaiting(waiting);
+        }
+        // Read device address, sub address and body size; a partial header means we lost
+        // sync, so go back to looking for a start byte
+        if (uart_read_bytes(MOPPY_GATEWAY_UART, frame.data + 1, 3, pdMS_TO_TICKS(20)) != 3) {
+            MoppyStats::framesBad++;
+            continue;
+        }
+        if (frame.data[3] == 0) {
+            MoppyStats::framesBad++;
+            continue; // No command byte
+        }
+        if (4 + frame.data[3] + MOPPY_GATEWAY_STAMP_LENGTH > MOPPY_MAX_PACKET_LENGTH) {
+            MoppyStats::framesBad++;
+            continue; // Can't be relayed in a single broadcast
+        }
+        frame.time = millis();
+        // Read command and payload
+        if (uart_read_bytes(MOPPY_GATEWAY_UART, frame.data + 4, frame.data[3], pdMS_TO_TICKS(20)) != frame.data[3]) {
+            MoppyStats::framesBad++;
+            continue;
+        }
+        frame.length = 4 + frame.data[3];
+        xQueueSend(frameQueue, &frame, portMAX_DELAY);
+        MoppyStats::framesOk++;
+
+        // The request still goes out to the instruments, but the gateway reports too
+        if (isStatsRequest(frame.data)) {
+            Packet report;
+            report.length = MOPPY_STATS_REPORT_LENGTH;
+            MoppyStats::report(SYSTEM_ADDRESS, report.data);
+            xQueueSend(upstreamQueue, &report, 0);
+            if (frame.data[3] > 1 && frame.data[5] != 0) {
+                MoppyStats::reset();
+            }
+        }
+    }
+}
+
+void MoppyESPNowGateway::radioTaskLoop(void *parameters) {
+    Packet frame;
+    uint8_t packet[MOPPY_MAX_PACKET_LENGTH];
+    for (;;) {
+        // Wait for the first frame, then pack whatever else is already waiting into the
+        // same broadcast (instruments parse a packet as a stream of frames)
+        xQueueReceive(frameQueue, &frame, portMAX_DELAY);
+        uint8_t packetLength = 0;
+#ifdef MOPPY_JITTER_BUFFER
+        uint16_t stampTime = frame.time + 1; // Always stamp the first frame
+#endif
+        for (;;) {
+#ifdef MOPPY_JITTER_BUFFER
+            if (frame.time != stampTime) {
+                stampTime = frame.time;
+                uint8_t stamp[MOPPY_GATEWAY_STAMP_LENGTH] = {START_BYTE, SYSTEM_ADDRESS, 0x00, 0x03, NETBYTE_SYS_TIMESTAMP, (uint8_t)(stampTime >> 8), (uint8_t)stampTime};
+                memcpy(packet + packetLength, stamp, MOPPY_GATEWAY_STAMP_LENGTH);
+                packetLength += MOPPY_GATEWAY_STAMP_LENGTH;
+            }
+#endif
+            memcpy(packet + packetLength, frame.data, frame.length);
+            packetLength += frame.length;
+
+            if (xQueuePeek(frameQueue, &frame, 0) != pdTRUE || packetLength + frame.length + MOPPY_GATEWAY_STAMP_LENGTH > MOPPY_MAX_PACKET_LENGTH) {
+                break;
+            }
+            xQueueReceive(frameQueue, &frame, 0);
+        }
+
+        // Broadcast message over ESP-Now and wait for onDataSent before the next one
+        ulTaskNotifyTake(pdTRUE, 0); // Discard any stale notification
+        if (esp_now_send(broadcastMacAddress, packet, packetLength) == ESP_OK) {
+            if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MOPPY_GATEWAY_SEND_TIMEOUT_MS)) == 0) {
+                MoppyStats::sendStalls++; // Gave up waiting for onDataSent
+            }
+        } else {
+            MoppyStats::sendStalls++;
+        }
+    }
+}
+
+void MoppyESPNowGateway::upstreamTaskLoop(void *parameters) {
+    Packet packet;
+    for (;;) {
+        xQueueReceive(upstreamQueue, &packet, portMAX_DELAY);
+        uart_write_bytes(MOPPY_GATEWAY_UART, (const char *)packet.data, packet.length);
+    }
+}
+
+void MoppyESPNowGateway::readMessages() {
+    // All relaying happens in the gateway tasks, just give the CPU away
+    vTaskDelay(1);
+}
+
+#else
+
 // Callback function executed when data is received
 void MoppyESPNowGateway::onDataReceived(const uint8_t * macAddr, const uint8_t * incomingData, int dataLength) {
    // Directly relay message to serial
@@ -78,6 +251,7 @@ void MoppyESPNowGateway::readMessages() {
     // to start reading until they're all there.
     // TODO: This will break for large messages because the Arduino buffer size is only 64 bytes.
     // This should be optimized a bit.
+    MoppyStats::rxWaiting(Serial.available());
     while ((messagePos != 4 && Serial.available()) || (messagePos == 4 && Serial.available() >= messageBuffer[3])) {
         switch (messagePos) {
         case 0:
@@ -86,28 +260,57 @@ void MoppyESPNowGateway::readMessages() {
                 messagePos++;
             }
             else {
+                MoppyStats::bytesDiscarded++;
                 messagePos = 0;
             }
             break;
         case 1:
         case 2:
+            messageBuffer[messagePos] = Serial.read();
+            messagePos++;
+            break;
         case 3:
             messageBuffer[messagePos] = Serial.read();
+            if (messageBuffer[3] == 0) {
+                MoppyStats::framesBad++; // No command byte
+                messagePos = 0;
+                break;
+            }
             messagePos++;
             break;
         case 4:
             // Read command and payload
             Serial.readBytes(messageBuffer + 4, messageBuffer[3]);
             // Broadcast message over ESP-Now
+            if (!sendingCompleted) {
+                MoppyStats::sendStalls++;
+            }
             while (!sendingCompleted) {
                 // Wait if the latest send action is still ongoing
                 delay(1);
             }
             sendingCompleted = false;
             esp_now_send(broadcastMacAddress, messageBuffer, 4 + messageBuffer[3]);
+            MoppyStats::framesOk++;
+
+            // The request still goes out to the instruments, but the gateway reports too
+            if (isStatsRequest(messageBuffer)) {
+                uint8_t statsBytes[MOPPY_STATS_REPORT_LENGTH];
+                MoppyStats::report(SYSTEM_ADDRESS, statsBytes);
+                Serial.write(statsBytes, sizeof(statsBytes));
+                if (messageBuffer[3] > 1 && messageBuffer[5] != 0) {
+                    MoppyStats::reset();
+                }
+            }
             messagePos = 0; // Start looking for a new message on serial
         }
     }
 }
 
+#endif /* ARDUINO_ARCH_ESP32 */
+
+bool MoppyESPNowGateway::isStatsRequest(const uint8_t frame[]) {
+    return frame[1] == SYSTEM_ADDRESS && frame[4] == NETBYTE_SYS_STATS;
+}
+
 #endif /* ARDUINO_ARCH_ESP8266 or ARDUINO_ARCH_ESP32 */
@@ -11,10 +11,15 @@
 #include "../MoppyConfig.h"
 #include "Arduino.h"
 #include "MoppyNetwork.h"
+#include "MoppyStats.h"
 #ifdef ARDUINO_ARCH_ESP8266
 #include <ESP8266WiFi.h>
 #elif ARDUINO_ARCH_ESP32
 #include <WiFi.h>
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
 #endif
 #include <esp_now.h>
 #include <esp_wifi.h>
@@ -22,6 +27,32 @@
 
 #define MOPPY_MAX_PACKET_LENGTH ESP_NOW_MAX_DATA_LEN
 #define MOPPY_WIFI_CHANNEL 1
+#define MOPPY_GATEWAY_BAUD_RATE 115200
+
+#ifdef ARDUINO_ARCH_ESP32
+// UART used for the connection to the Controller, and the size of the driver-level receive
+// ring that is filled by the UART interrupt (large enough to absorb a few hundred messages
+// while the radio is busy)
+#define MOPPY_GATEWAY_UART UART_NUM_0
+#define MOPPY_GATEWAY_RX_BUFFER_SIZE 4096
+#define MOPPY_GATEWAY_TX_BUFFER_SIZE 1024
+
+// Number of complete frames that can be waiting for the radio, and number of upstream
+// packets (e.g. pongs) that can be waiting to be written to serial
+#define MOPPY_GATEWAY_FRAME_QUEUE_LENGTH 64
+#define MOPPY_GATEWAY_UPSTREAM_QUEUE_LENGTH 8
+
+// Maximum time to wait for the send-complete notification before giving up on a broadcast
+#define MOPPY_GATEWAY_SEND_TIMEOUT_MS 50
+
+// With MOPPY_JITTER_BUFFER the gateway puts a NETBYTE_SYS_TIMESTAMP message (this many bytes)
+// in front of every group of frames, telling instruments when the frames arrived on serial
+#ifdef MOPPY_JITTER_BUFFER
+#define MOPPY_GATEWAY_STAMP_LENGTH 7
+#else
+#define MOPPY_GATEWAY_STAMP_LENGTH 0
+#endif
+#endif
 
 class MoppyESPNowGateway {
 public:
@@ -30,12 +61,31 @@ public:
     void readMessages();
 
 private:
+    static const uint8_t broadcastMacAddress[6];
+    static void onDataReceived(const uint8_t * macAddr, const uint8_t * incomingData, int dataLength);
+    static void onDataSent(const uint8_t * macAddr, esp_now_send_status_t status);
+    static bool isStatsRequest(const uint8_t frame[]);
+
+#ifdef ARDUINO_ARCH_ESP32
+    // A single Moppy frame (or a packet travelling upstream) waiting in one of the queues
+    struct Packet {
+        uint16_t time; // millis() when the frame was read from serial
+        uint8_t length;
+        uint8_t data[MOPPY_MAX_PACKET_LENGTH];
+    };
+
+    static QueueHandle_t frameQueue;    // Complete frames from serial, waiting to be broadcast
+    static QueueHandle_t upstreamQueue; // Packets from the instruments, waiting to be written to serial
+    static TaskHandle_t radioTask;      // Notified by onDataSent when the radio is free again
+
+    static void framingTaskLoop(void *parameters);
+    static void radioTaskLoop(void *parameters);
+    static void upstreamTaskLoop(void *parameters);
+#else
     uint8_t messageBuffer[MOPPY_MAX_PACKET_LENGTH]; // Buffer for the current message
     uint8_t messagePos = 0;                         // Tracks current message read position
     volatile static bool sendingCompleted;          // Signalizes that new data can be sent
-    const uint8_t broadcastMacAddress[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-    static void onDataReceived(const uint8_t * macAddr, const uint8_t * incomingData, int dataLength);
-    static void onDataSent(const uint8_t * macAddr, esp_now_send_status_t status);
+#endif
 };
 
 #endif /* SRC_MOPPYNETWORKS_MOPPYESPNOWGATEWAY_H_ */
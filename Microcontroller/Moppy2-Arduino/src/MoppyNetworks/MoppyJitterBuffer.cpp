@@ -0,0 +1,193 @@
+#include "MoppyJitterBuffer.h"
+
+/*
+ * Adaptive playout buffer.  Each message is held until (arrival + playoutDelay - lateness),
+ * where lateness is how much longer than usual the message took to arrive.  Messages that
+ * were delayed by the network are therefore held for a shorter time than messages that
+ * weren't, which puts them back on the timeline they were sent on.
+ *
+ * When the sender stamps its messages (see NETBYTE_SYS_TIMESTAMP, which the ESP-Now gateway
+ * adds on its own) lateness is measured against the fastest delivery seen.  Unstamped streams,
+ * like the Controller's UDP stream, are measured against a timeline rebuilt from the arrivals
+ * themselves: music mostly moves in whole beats, so each group of messages is expected a whole
+ * number of (smoothed) beats after the previous one, and anything after that is lateness.
+ * Groups that come early re-anchor the timeline, so it follows the fastest deliveries.
+ */
+
+#ifdef ARDUINO_ARCH_ESP32
+// Messages may be pushed from network callbacks running in another task
+static portMUX_TYPE jitterMux = portMUX_INITIALIZER_UNLOCKED;
+#define JITTER_LOCK() portENTER_CRITICAL(&jitterMux)
+#define JITTER_UNLOCK() portEXIT_CRITICAL(&jitterMux)
+#else
+#define JITTER_LOCK() noInterrupts()
+#define JITTER_UNLOCK() interrupts()
+#endif
+
+// The smallest transit is allowed to creep up by 1ms every this many late messages so
+// that drift between the sender's and our clock doesn't inflate the delay forever
+#define BASE_TRANSIT_CREEP 128
+
+void MoppyJitterBuffer::setSenderTime(uint16_t senderTime) {
+    JITTER_LOCK();
+    uint16_t transit = (uint16_t)millis() - senderTime; // Includes the (unknown) clock offset
+
+    if (!stamped || (int16_t)(transit - baseTransit) < 0) {
+        baseTransit = transit; // Fastest delivery seen so far
+    }
+    uint16_t excess = transit - baseTransit;
+    if (excess > 0 && ++baseCreep >= BASE_TRANSIT_CREEP) {
+        baseTransit++;
+        baseCreep = 0;
+    }
+    if (excess > 255) {
+        excess = 255;
+    }
+    sampleDeviation(excess); // Deviation above the fastest delivery
+
+    senderMillis = senderTime;
+    stampReceived = millis();
+    stamped = true;
+    currentLateness = excess;
+    JITTER_UNLOCK();
+}
+
+// Called for each new group of unstamped messages (a chord arrives within the same millisecond)
+void MoppyJitterBuffer::sampleArrival(uint32_t now) {
+    uint32_t sinceLast = now - lastArrival;
+    uint32_t elapsed = now - timeline; // At least sinceLast, since the timeline never runs ahead
+    lastArrival = now;
+    arrivalLateness = 0;
+    if (sinceLast > MOPPY_JITTER_TIMELINE_RESET) {
+        timeline = now; // Nothing for a while, start over
+        pulse = 0;
+        return;
+    }
+    if (pulse == 0 || elapsed * 16 * 4 < (uint32_t)pulse * 3) {
+        // First gap, or well short of a beat since the last group so the rhythm has
+        // subdivided.  Either way this is the new beat.
+        timeline = now;
+        pulse = elapsed * 16;
+        sampleDeviation(0);
+        return;
+    }
+
+    // Expect this group a whole number of beats after the last one
+    uint32_t beats = (elapsed * 16 + pulse / 2) / pulse;
+    uint32_t expected = timeline + beats * pulse / 16;
+    if ((int32_t)(now - expected) <= 0) {
+        timeline = now; // Early, so the last group was late or the tempo picked up
+    } else {
+        uint32_t lateness = now - expected;
+        arrivalLateness = lateness > 255 ? 255 : lateness;
+        timeline = expected;
+    }
+
+    // Follow the tempo using the gaps between arrivals, which (unlike the gap from the
+    // timeline) are as often too short as too long
+    uint32_t gapBeats = (sinceLast * 16 + pulse / 2) / pulse;
+    if (gapBeats > 0) {
+        pulse += ((int32_t)(sinceLast * 16 / gapBeats) - (int32_t)pulse) / 16;
+    }
+    sampleDeviation(arrivalLateness);
+}
+
+void MoppyJitterBuffer::sampleDeviation(uint16_t excess) {
+    // Track the mean deviation (in 1/16ths of a millisecond)
+    transitDeviation += ((int16_t)(excess * 16) - (int16_t)transitDeviation) / 16;
+
+    // Grow the delay right away, but only shrink it when nothing is being held so that
+    // held messages keep their spacing
+    uint16_t target = (MOPPY_JITTER_MULTIPLIER * transitDeviation) / 16;
+    if (target < MOPPY_JITTER_MIN_DELAY) {
+        target = MOPPY_JITTER_MIN_DELAY;
+    } else if (target > MOPPY_JITTER_MAX_DELAY) {
+        target = MOPPY_JITTER_MAX_DELAY;
+    }
+    if (target > playoutDelay || count == 0) {
+        playoutDelay = target;
+    }
+}
+
+bool MoppyJitterBuffer::push(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, const uint8_t payload[], uint8_t payloadLength, uint32_t arrivedMillis) {
+    if (deviceAddress == SYSTEM_ADDRESS && (command == NETBYTE_SYS_STOP || command == NETBYTE_SYS_RESET)) {
+        clear(); // Notes from before a stop shouldn't play after it
+        return false;
+    }
+    if (payloadLength > MOPPY_JITTER_MAX_PAYLOAD) {
+        return false;
+    }
+
+    JITTER_LOCK();
+    // How long to hold this message, less however late it already is (including any time
+    // it spent waiting to be pushed since it arrived)
+    uint32_t lateness;
+    if (stamped && (int32_t)(arrivedMillis - stampReceived) < MOPPY_JITTER_STAMP_TIMEOUT) {
+        lateness = currentLateness;
+    } else {
+        if (arrivedMillis != lastArrival) {
+            sampleArrival(arrivedMillis);
+        }
+        lateness = arrivalLateness;
+    }
+    lateness += millis() - arrivedMillis;
+    uint32_t holdMicros = 0;
+    if (lateness > playoutDelay) {
+        underruns++; // Delivered later than the delay can make up for
+    } else {
+        holdMicros = (playoutDelay - lateness) * 1000;
+    }
+
+    if (count >= MOPPY_JITTER_CAPACITY) {
+        JITTER_UNLOCK();
+        return false;
+    }
+    uint32_t releaseMicros = micros() + holdMicros;
+    if (count > 0 && (int32_t)(releaseMicros - lastReleaseMicros) < 0) {
+        releaseMicros = lastReleaseMicros; // Never reorder messages
+    }
+    lastReleaseMicros = releaseMicros;
+
+    Entry &entry = entries[(head + count) % MOPPY_JITTER_CAPACITY];
+    entry.releaseMicros = releaseMicros;
+    entry.deviceAddress = deviceAddress;
+    entry.subAddress = subAddress;
+    entry.command = command;
+    memcpy(entry.payload, payload, payloadLength);
+#ifdef MOPPY_TRACE
+    entry.stamp = MoppyTrace::stamp();
+#endif
+    count++;
+    JITTER_UNLOCK();
+    return true;
+}
+
+void MoppyJitterBuffer::release(MoppyMessageConsumer *consumer) {
+    while (count > 0) {
+        JITTER_LOCK();
+        if ((int32_t)(micros() - entries[head].releaseMicros) < 0) {
+            JITTER_UNLOCK();
+            return; // Nothing else is due yet
+        }
+        Entry entry = entries[head];
+        head = (head + 1) % MOPPY_JITTER_CAPACITY;
+        count--;
+        JITTER_UNLOCK();
+
+#ifdef MOPPY_TRACE
+        MoppyTrace::restore(entry.stamp);
+#endif
+        if (entry.deviceAddress == SYSTEM_ADDRESS) {
+            consumer->handleSystemMessage(entry.command, entry.payload);
+        } else {
+            consumer->handleDeviceMessage(entry.deviceAddress, entry.subAddress, entry.command, entry.payload);
+        }
+    }
+}
+
+void MoppyJitterBuffer::clear() {
+    JITTER_LOCK();
+    head = 0;
+    count = 0;
+    JITTER_UNLOCK();
+}
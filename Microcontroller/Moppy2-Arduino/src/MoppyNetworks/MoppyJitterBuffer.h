@@ -0,0 +1,106 @@
+/*
+ * MoppyJitterBuffer.h
+ * Optional receive-side jitter buffer for wireless networks.  Messages are held for an
+ * adaptive playout delay and released in order so that variations in arrival time
+ * don't turn into variations in rhythm.
+ *
+ * The delay follows how much arrival times vary: from sender timestamps when the stream has
+ * them, otherwise from how far arrivals fall behind the stream's own pulse.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYJITTERBUFFER_H_
+#define SRC_MOPPYNETWORKS_MOPPYJITTERBUFFER_H_
+
+#include "../MoppyConfig.h"
+#include "../MoppyMessageConsumer.h"
+#include "MoppyNetwork.h"
+#include "MoppyTrace.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+// Number of messages that can be held at once, and the largest payload (command byte
+// excluded) that will be held.  Larger messages are dispatched immediately.
+#define MOPPY_JITTER_CAPACITY 32
+#define MOPPY_JITTER_MAX_PAYLOAD 6
+
+// Limits for the playout delay in milliseconds.  Set both to the same value for a fixed delay.
+#ifndef MOPPY_JITTER_MIN_DELAY
+#define MOPPY_JITTER_MIN_DELAY 5
+#endif
+#ifndef MOPPY_JITTER_MAX_DELAY
+#define MOPPY_JITTER_MAX_DELAY 80
+#endif
+
+// The playout delay is this many times the mean transit deviation
+#define MOPPY_JITTER_MULTIPLIER 3
+
+// Sender timestamps older than this are ignored and the stream is treated as unstamped
+#define MOPPY_JITTER_STAMP_TIMEOUT 1000
+
+// In unstamped streams, a silence longer than this many milliseconds starts the arrival
+// timeline over (e.g. between songs, or after a tempo change)
+#define MOPPY_JITTER_TIMELINE_RESET 2000
+
+class MoppyJitterBuffer {
+public:
+    /*
+     * Called by the network when a NETBYTE_SYS_TIMESTAMP message arrives.  Messages pushed
+     * after this are taken to have been sent at senderTime (sender's millis(), 16 bits).
+     */
+    void setSenderTime(uint16_t senderTime);
+
+    /*
+     * Hold a message until its playout time.  deviceAddress is SYSTEM_ADDRESS for system
+     * messages, and arrivedMillis is the local millis() when it came off the network.  Returns false if the message couldn't be held and should be dispatched
+     * right away by the caller.  NETBYTE_SYS_STOP and NETBYTE_SYS_RESET are never held, and
+     * clear() the buffer so nothing from before them plays afterwards.
+     */
+    bool push(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, const uint8_t payload[], uint8_t payloadLength, uint32_t arrivedMillis);
+
+    // Dispatch every message whose playout time has come
+    void release(MoppyMessageConsumer *consumer);
+
+    // Drop everything that's being held (e.g. on NETBYTE_SYS_STOP)
+    void clear();
+
+    uint8_t getDelay() const { return playoutDelay; }   // Current playout delay in milliseconds
+    uint16_t getUnderruns() const { return underruns; } // Messages that arrived too late to be smoothed
+    uint8_t getDepth() const { return count; }          // Messages currently held
+    void clearUnderruns() { underruns = 0; }
+
+private:
+    struct Entry {
+        uint32_t releaseMicros;
+        uint8_t deviceAddress;
+        uint8_t subAddress;
+        uint8_t command;
+        uint8_t payload[MOPPY_JITTER_MAX_PAYLOAD];
+#ifdef MOPPY_TRACE
+        MoppyTrace::Stamp stamp;
+#endif
+    };
+
+    Entry entries[MOPPY_JITTER_CAPACITY];
+    uint8_t head = 0;
+    uint8_t count = 0;
+
+    uint16_t senderMillis = 0;     // Sender time of the current group of messages
+    uint32_t stampReceived = 0;    // Local millis() when senderMillis was received
+    bool stamped = false;          // True once a sender time has been seen
+    uint8_t currentLateness = 0;   // How late (ms) the current group of messages arrived
+    uint16_t baseTransit = 0;      // Smallest recently observed (arrival - sender) time
+    uint8_t baseCreep = 0;         // Late messages seen since baseTransit last crept up
+    uint16_t transitDeviation = 0; // Mean deviation above baseTransit, in 1/16ths of a millisecond
+    uint32_t lastArrival = 0;      // Local millis() when the last group of unstamped messages arrived
+    uint32_t timeline = 0;         // Where the arrival timeline put that group (lastArrival less its lateness)
+    uint16_t pulse = 0;            // Smoothed beat between unstamped groups, in 1/16ths of a millisecond (0 for unknown)
+    uint8_t arrivalLateness = 0;   // How late (ms) the last group of unstamped messages arrived
+    uint8_t playoutDelay = MOPPY_JITTER_MIN_DELAY;
+    uint16_t underruns = 0;
+    uint32_t lastReleaseMicros = 0;
+
+    void sampleArrival(uint32_t now);
+    void sampleDeviation(uint16_t excess);
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYJITTERBUFFER_H_ */
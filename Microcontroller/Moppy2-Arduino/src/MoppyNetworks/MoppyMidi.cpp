@@ -4,10 +4,11 @@
  * Serial communications implementation for Arduino.  Handler
  * functions are called to consume system and device messages received from
  * midi devices.
+ *
+ * Bytes are parsed one at a time, so running status, realtime messages in the middle
+ * of other messages, and SysEx dumps don't throw the parser out of sync.
  */
 
-
-byte actPlayingNote[MAX_SUB_ADDRESS]; // MAX_SUB_ADDRESS = Number of Drives
 MoppyMidi::MoppyMidi(MoppyMessageConsumer *messageConsumer) {
     targetConsumer = messageConsumer;
 }
@@ -17,97 +18,167 @@ void MoppyMidi::begin() {
 }
 
 void MoppyMidi::readMessages() {
-    
-    // Check if minimum needed data availabel
-    // if minimum neede data is not reached it stops the function
-    if(Serial.available() < 3){
+    while (Serial.available()) {
+        parseByte(Serial.read());
+    }
+}
+
+void MoppyMidi::parseByte(uint8_t midiByte) {
+    // Realtime messages (0xF8 - 0xFF) are a single byte and can show up anywhere, even
+    // between the data bytes of another message, so they never touch the parser state
+    if (midiByte >= 0xF8) {
+        if (MIDI_THRU_REALTIME) {
+            Serial.write(midiByte);
+        }
         return;
     }
-    
-    // Check if the byte is a "firstByte" (because they are bigger than 127 (128...255))
-    // if it is not a first byte restart the routine
-    byte firstByte = Serial.read(); // also called statusByte
-    if(firstByte < 128){
-        Serial.write(firstByte);
+
+    if (midiByte & 0x80) {
+        // Status byte
+        if (midiByte == 0xF7 && !inSysEx) {
+            return; // End of a SysEx dump we never saw start, nothing to end
+        }
+        if (midiByte == 0xF0 || midiByte == 0xF7) {
+            inSysEx = (midiByte == 0xF0);
+            if (MIDI_THRU_SYSEX) {
+                Serial.write(midiByte);
+            }
+            status = runningStatus = 0; // SysEx cancels running status
+            return;
+        }
+        inSysEx = false; // Any other status byte also ends a SysEx dump
+
+        status = midiByte;
+        runningStatus = (midiByte < 0xF0) ? midiByte : 0; // System common messages cancel running status
+        expectedData = dataLength(midiByte);
+        dataCount = 0;
+        if (expectedData == 0) {
+            handleMessage();
+            status = 0;
+        }
         return;
     }
-    
-    
-    // Check if the byte is a "secondByte"/"thirdByte" (because they are smaller than 128  (0...127))
-    byte secondByte = Serial.read(); // Databyte
-    if(secondByte > 127){
-        Serial.write(firstByte);
-        Serial.write(secondByte);
+
+    // Data byte
+    if (inSysEx) {
+        if (MIDI_THRU_SYSEX) {
+            Serial.write(midiByte);
+        }
+        return;
+    }
+    if (status == 0) {
+        if (runningStatus == 0) {
+            return; // Stray data byte, nothing to attach it to
+        }
+        status = runningStatus; // Running status: the previous status applies again
+        expectedData = dataLength(status);
+        dataCount = 0;
+    }
+
+    data[dataCount++] = midiByte;
+    if (dataCount == expectedData) {
+        handleMessage();
+        status = 0;
+    }
+}
+
+void MoppyMidi::handleMessage() {
+    switch (status & 0xF0) {
+    case 0x90: // Note on (velocity 0 means note off)
+        if (data[1] == 0) {
+            noteOff(data[0]);
+        } else {
+            noteOn(data[0], data[1]);
+        }
+        break;
+    case 0x80: // Note off
+        noteOff(data[0]);
+        break;
+    case 0xE0: // Pitch bend
+        bendPitch(data[0], data[1]);
+        break;
+    default:
+        thru();
+        break;
+    }
+}
+
+// Voices are picked by the instrument's voice allocator, so notes are sent as channel notes
+void MoppyMidi::noteOn(uint8_t note, uint8_t velocity) {
+    uint8_t payload[3] = {note, velocity, (uint8_t)(status & 0x0F)};
+    MoppyVoiceAllocator *allocator = targetConsumer->getVoiceAllocator();
+
+    if (allocator == nullptr || !allocator->hasRoom(note)) {
+        thru(); // No free voice, maybe the next device down the line can play it
         return;
     }
-    
-    
-    // Can be deleted because data is not needed
-    byte thirdByte = Serial.read(); // dataByte
-    if(thirdByte > 127){
-        Serial.write(firstByte);
-        Serial.write(secondByte);
-        Serial.write(thirdByte);
+    targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_CHANNEL_NOTEON, payload);
+    if (STEREO && allocator->hasRoom(note)) {
+        targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_CHANNEL_NOTEON, payload); // Same note on a second voice
+    }
+    bendChannel(payload[2]); // The voice may still be bent for whichever channel used it last
+}
+
+void MoppyMidi::noteOff(uint8_t note) {
+    uint8_t payload[3] = {note, 0, (uint8_t)(status & 0x0F)};
+    MoppyVoiceAllocator *allocator = targetConsumer->getVoiceAllocator();
 
+    if (allocator == nullptr || !allocator->isPlaying(payload[2], note)) {
+        thru(); // Not one of ours
         return;
     }
-    
-    // start docode
-    boolean firstBits[8];// = getBits(firstByte); // Not used because of limitations of C++/INO
-    
-    
-    
-    for( int i = 0; i < 8; i++){
-        firstBits[i] = bitRead(firstByte, 7-i);
+    targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_CHANNEL_NOTEOFF, payload);
+    if (STEREO) {
+        targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_CHANNEL_NOTEOFF, payload);
     }
-    
-    // Debug:
-    //Serial.println(String(firstByte) + " : " + String(secondByte) + " : " + String(thirdByte));
-    
-    // Not needed, information will be get direct out of byte
-    //boolean secondBits[8] = getBits(secondByte);
-    
-    //Not needed, Floppy has no dynmaics ("loudness")
-    //boolean thirdBits[8] = getBits(thirdByte);
-    
-    
-    if( (firstBits[1] == 0 && firstBits[2] == 0 && firstBits[3] == 1)){
-        if(secondByte == 0){
-            firstBits[3] = 0;
-        }else{
-            if(STEREO){
-                for(int i = 0; i <= MAX_SUB_ADDRESS/2; i++){
-                    if(actPlayingNote[i] == 0){
-                        actPlayingNote[i] = secondByte;
-                        actPlayingNote[i+MAX_SUB_ADDRESS/2] = secondByte;
-                        targetConsumer->handleDeviceMessage(i+1, NETBYTE_DEV_NOTEON, &secondByte);
-                        targetConsumer->handleDeviceMessage(i+1+MAX_SUB_ADDRESS/2, NETBYTE_DEV_NOTEON, &secondByte);
-                        i = MAX_SUB_ADDRESS + 1;
-                        return;
-                    }
-                }
-            }else{
-                for(int i = 0; i <= MAX_SUB_ADDRESS; i++){
-                    if(actPlayingNote[i] == 0){
-                        actPlayingNote[i] = secondByte;
-                        targetConsumer->handleDeviceMessage(i+1, NETBYTE_DEV_NOTEON, &secondByte);
-                        i = MAX_SUB_ADDRESS + 1;
-                        return;
-                    }
-                }
-            }
+}
+
+void MoppyMidi::bendPitch(uint8_t lsb, uint8_t msb) {
+    // MIDI sends 14 bits centered on 0x2000, instruments expect a signed value from -8192 to 8191
+    uint8_t channel = status & 0x0F;
+    channelBend[channel] = ((msb << 7) | lsb) - 8192;
+    bendChannel(channel);
+}
+
+// Bend only the voices the allocator gave to this channel's notes
+void MoppyMidi::bendChannel(uint8_t channel) {
+    MoppyVoiceAllocator *allocator = targetConsumer->getVoiceAllocator();
+    if (allocator == nullptr) {
+        return;
+    }
+    uint8_t payload[2] = {(uint8_t)(channelBend[channel] >> 8), (uint8_t)channelBend[channel]};
+    for (uint8_t sub = MIN_SUB_ADDRESS; sub <= MAX_SUB_ADDRESS; sub++) {
+        if (allocator->isPlayingChannel(sub, channel)) {
+            targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, sub, NETBYTE_DEV_BENDPITCH, payload);
         }
     }
-    if( (firstBits[1] == 0 && firstBits[2] == 0 && firstBits[3] == 0)){
-        for (int i = 0; i <= MAX_SUB_ADDRESS; i++){
-            if(secondByte == actPlayingNote[i]){
-                actPlayingNote[i] = 0;
-                targetConsumer->handleDeviceMessage(i + 1, NETBYTE_DEV_NOTEON, &secondByte);
-                return;
-            }
+}
+
+// Echo the current message back out for anything further down the MIDI chain
+void MoppyMidi::thru() {
+    if (MIDI_THRU) {
+        Serial.write(status);
+        Serial.write(data, dataCount);
+    }
+}
+
+// Number of data bytes following a status byte
+uint8_t MoppyMidi::dataLength(uint8_t statusByte) {
+    switch (statusByte & 0xF0) {
+    case 0xC0: // Program change
+    case 0xD0: // Channel pressure
+        return 1;
+    case 0xF0:
+        switch (statusByte) {
+        case 0xF1: // MTC quarter frame
+        case 0xF3: // Song select
+            return 1;
+        case 0xF2: // Song position
+            return 2;
+        default: // Tune request, undefined
+            return 0;
         }
+    default: // Note off/on, poly pressure, control change, pitch bend
+        return 2;
     }
-    Serial.write(firstByte);
-    Serial.write(secondByte);
-    Serial.write(thirdByte);
 }
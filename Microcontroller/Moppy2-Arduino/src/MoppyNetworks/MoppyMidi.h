@@ -3,8 +3,8 @@
  *
  */
 
-#ifndef SRC_MOPPYNETWORKS_MOPPYSERIAL_H_
-#define SRC_MOPPYNETWORKS_MOPPYSERIAL_H_
+#ifndef SRC_MOPPYNETWORKS_MOPPYMIDI_H_
+#define SRC_MOPPYNETWORKS_MOPPYMIDI_H_
 
 #include <stdint.h>
 #include "Arduino.h"
@@ -13,8 +13,13 @@
 #include "MoppyNetwork.h"
 
 #define MOPPY_BAUD_RATE 31250
-#define STEREO false
-#define ONLY3BYTE false
+#define STEREO false // Play every note on two voices
+
+// Messages that aren't played are echoed back out (MIDI thru).  Realtime messages (clock,
+// start/stop, active sensing) and SysEx can be forwarded or filtered separately.
+#define MIDI_THRU true
+#define MIDI_THRU_REALTIME true
+#define MIDI_THRU_SYSEX false
 
 class MoppyMidi {
   public:
@@ -22,8 +27,25 @@ class MoppyMidi {
     void begin();
     void readMessages();
   private:
-      MoppyMessageConsumer *targetConsumer;
+    MoppyMessageConsumer *targetConsumer;
+
+    uint8_t status = 0;        // Status of the message being received (0 if none)
+    uint8_t runningStatus = 0; // Last channel status, reused when a message starts with data
+    uint8_t expectedData = 0;  // Number of data bytes the current status takes
+    uint8_t dataCount = 0;     // Number of data bytes received so far
+    uint8_t data[2];
+    bool inSysEx = false;
+    int16_t channelBend[16] = {}; // Last pitch bend on each channel, applied to the voices playing it
+
+    void parseByte(uint8_t midiByte);
+    void handleMessage();
+    void noteOn(uint8_t note, uint8_t velocity);
+    void noteOff(uint8_t note);
+    void bendPitch(uint8_t lsb, uint8_t msb);
+    void bendChannel(uint8_t channel);
+    void thru();
+    static uint8_t dataLength(uint8_t statusByte);
 };
 
 
-#endif /* SRC_MOPPYNETWORKS_MOPPYSERIAL_H_ */
+#endif /* SRC_MOPPYNETWORKS_MOPPYMIDI_H_ */
@@ -6,6 +6,8 @@
 #ifndef SRC_MOPPYNETWORKS_MOPPYNETWORK_H_
 #define SRC_MOPPYNETWORKS_MOPPYNETWORK_H_
 
+#include <stdint.h>
+
 // Definitions for command byte values
 
 #define START_BYTE 0x4d
@@ -17,14 +19,74 @@
 #define NETBYTE_SYS_START 0xfa
 #define NETBYTE_SYS_STOP 0xfc
 
+// Diagnostics and timing.  Kept clear of 0x82, which MoppyLib's MoppyDevice treats as a reset.
+#define NETBYTE_SYS_STATS 0xa0        // Request counters (see MoppyStats.h), payload 1 to clear them afterwards
+#define NETBYTE_SYS_STATS_REPORT 0xa1 // Counters from one device
+#define NETBYTE_SYS_TRACE 0xa2        // Request latency traces (see MoppyTrace.h)
+#define NETBYTE_SYS_TRACE_REPORT 0xa3 // Latency traces from one device
+#define NETBYTE_SYS_TIMESTAMP 0xa4    // Sender's millis() (2 bytes) for the messages that follow
+
+// On-device file playback (see MoppyPlayers)
+#define NETBYTE_SYS_PLAYER_PLAY 0x90  // Start the file from the beginning
+#define NETBYTE_SYS_PLAYER_STOP 0x91
+#define NETBYTE_SYS_PLAYER_TEMPO 0x92 // Tempo as a percentage of the file's tempo (1 byte)
+#define NETBYTE_SYS_PLAYER_LOOP 0x93  // 1 to repeat the file, 0 to stop at the end
+
 #define NETBYTE_DEV_RESET 0x00
 #define NETBYTE_DEV_NOTEOFF 0x08
 #define NETBYTE_DEV_NOTEON 0x09
 #define NETBYTE_DEV_BENDPITCH 0x0e
 
+// Sent to sub-address 0 with [note, velocity, channel]; the device picks the voice
+#define NETBYTE_DEV_CHANNEL_NOTEOFF 0x18
+#define NETBYTE_DEV_CHANNEL_NOTEON 0x19
+
 // Microcontroller/device-specific commands (still defined here to prevent overlap)
 #define NETBYTE_DEV_SETTARGETCOLOR 0x61
 #define NETBYTE_DEV_SETBGCOLOR 0x62
 #define NETBYTE_DEV_SETMOVEMENT 0x64
+#define NETBYTE_DEV_SETMODULATION 0x65 // [target, waveform, rate, depth] (see MoppyModulation.h)
+#define NETBYTE_DEV_SETGLIDE 0x66 // [glide, bendSlew] (see MoppyModulation.h)
+#define NETBYTE_DEV_SETARPEGGIO 0x67 // [rate, pattern] (see MoppyArpeggiator.h)
+#define NETBYTE_DEV_SETSTEPMODE 0x68 // [mode] (see L298N.h)
+
+// Payload bytes (command byte excluded) of the messages that always have the same length, or
+// -1 for any other
+inline int8_t moppyPayloadLength(uint8_t deviceAddress, uint8_t command) {
+    if (deviceAddress == SYSTEM_ADDRESS) {
+        switch (command) {
+        case NETBYTE_SYS_RESET:
+        case NETBYTE_SYS_START:
+        case NETBYTE_SYS_STOP:
+        case NETBYTE_SYS_PLAYER_PLAY:
+        case NETBYTE_SYS_PLAYER_STOP:
+            return 0;
+        case NETBYTE_SYS_PLAYER_TEMPO:
+        case NETBYTE_SYS_PLAYER_LOOP:
+            return 1;
+        default:
+            return -1;
+        }
+    }
+    switch (command) {
+    case NETBYTE_DEV_RESET:
+        return 0;
+    case NETBYTE_DEV_NOTEOFF: // [note]
+    case NETBYTE_DEV_SETSTEPMODE:
+        return 1;
+    case NETBYTE_DEV_NOTEON: // [note, velocity]
+    case NETBYTE_DEV_BENDPITCH:
+    case NETBYTE_DEV_SETGLIDE:
+    case NETBYTE_DEV_SETARPEGGIO:
+        return 2;
+    case NETBYTE_DEV_CHANNEL_NOTEOFF:
+    case NETBYTE_DEV_CHANNEL_NOTEON:
+        return 3;
+    case NETBYTE_DEV_SETMODULATION:
+        return 4;
+    default:
+        return -1;
+    }
+}
 
 #endif /* SRC_MOPPYNETWORKS_MOPPYNETWORK_H_ */
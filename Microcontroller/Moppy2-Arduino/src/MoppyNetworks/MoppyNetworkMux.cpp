@@ -0,0 +1,132 @@
+/*
+ * MoppyNetworkMux.cpp
+ *
+ * Copies are matched oldest first, so a message repeated on purpose (e.g. the same drum hit
+ * twice) pairs up with the right copy on each link even when one link lags behind.
+ *
+ * Every network passes its messages on from readMessages() in the main loop, so the links never
+ * run at the same time and nothing here needs locking.
+ */
+#include "MoppyNetworkMux.h"
+
+MoppyNetworkMux::MoppyNetworkMux(MoppyMessageConsumer *messageConsumer) {
+    targetConsumer = messageConsumer;
+    for (uint8_t l = 0; l < MOPPY_MUX_LINKS; l++) {
+        links[l].mux = this;
+        links[l].index = l;
+        lastHeard[l] = 0;
+        lag[l] = 0;
+    }
+    for (uint8_t e = 0; e < MOPPY_MUX_HISTORY; e++) {
+        entries[e].length = 0;
+        entries[e].link = 0;
+        entries[e].matchedLinks = 0xFF; // Never matched
+        entries[e].delivered = true;
+        entries[e].receivedMillis = 0;
+    }
+}
+
+void MoppyNetworkMux::receive(uint8_t link, uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    int8_t payloadBytes = moppyPayloadLength(deviceAddress, command);
+    uint16_t now = millis();
+    if (payloadBytes < 0 || payloadBytes > MOPPY_MUX_MAX_PAYLOAD) {
+        lastHeard[link] = now;
+        heardLinks |= 1 << link;
+        deliver(deviceAddress, subAddress, command, payload); // Can't tell copies apart
+        return;
+    }
+
+    uint8_t message[3 + MOPPY_MUX_MAX_PAYLOAD] = {deviceAddress, subAddress, command};
+    memcpy(message + 3, payload, payloadBytes);
+    uint8_t length = 3 + payloadBytes;
+
+    releaseExpired(now); // Anything still held back goes ahead of this message
+    lastHeard[link] = now;
+    heardLinks |= 1 << link;
+    bool passOn;
+    Entry *copy = findCopy(link, message, length, now);
+    if (copy != nullptr) {
+        copy->matchedLinks |= 1 << link;
+        sampleLag(copy->link, 0);
+        sampleLag(link, now - copy->receivedMillis);
+        // If the first copy came from a link that was too slow, this one's played instead
+        passOn = !copy->delivered;
+        copy->delivered = true;
+        if (!passOn) {
+            duplicates++;
+        }
+    } else {
+        passOn = !isTooSlow(link, now);
+        Entry &entry = entries[head];
+        release(entry); // About to be overwritten, so it's now or never
+        head = (head + 1) % MOPPY_MUX_HISTORY;
+        memcpy(entry.message, message, length);
+        entry.length = length;
+        entry.link = link;
+        entry.matchedLinks = 0;
+        entry.delivered = passOn;
+        entry.receivedMillis = now;
+    }
+
+    if (passOn) {
+        deliver(deviceAddress, subAddress, command, payload);
+    }
+}
+
+void MoppyNetworkMux::deliver(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    if (deviceAddress == SYSTEM_ADDRESS) {
+        targetConsumer->handleSystemMessage(command, payload);
+    } else {
+        targetConsumer->handleDeviceMessage(deviceAddress, subAddress, command, payload);
+    }
+}
+
+void MoppyNetworkMux::release(Entry &entry) {
+    if (!entry.delivered) {
+        entry.delivered = true;
+        deliver(entry.message[0], entry.message[1], entry.message[2], entry.message + 3);
+    }
+}
+
+// Passes on, oldest first, the held back messages whose window has run out without a copy
+void MoppyNetworkMux::releaseExpired(uint16_t now) {
+    for (uint8_t i = 0; i < MOPPY_MUX_HISTORY; i++) {
+        Entry &entry = entries[(head + i) % MOPPY_MUX_HISTORY];
+        if (!entry.delivered && (uint16_t)(now - entry.receivedMillis) > MOPPY_MUX_WINDOW) {
+            release(entry);
+        }
+    }
+}
+
+// The oldest message from another link within the window that this is a copy of, if any
+MoppyNetworkMux::Entry *MoppyNetworkMux::findCopy(uint8_t link, const uint8_t message[], uint8_t length, uint16_t now) {
+    for (uint8_t i = 0; i < MOPPY_MUX_HISTORY; i++) {
+        Entry &entry = entries[(head + i) % MOPPY_MUX_HISTORY];
+        if (entry.link == link || (entry.matchedLinks & (1 << link)) ||
+            (uint16_t)(now - entry.receivedMillis) > MOPPY_MUX_WINDOW) {
+            continue;
+        }
+        if (entry.length == length && memcmp(entry.message, message, length) == 0) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+// True if another healthy link is so far ahead that copies from this one might miss the window
+bool MoppyNetworkMux::isTooSlow(uint8_t link, uint16_t now) const {
+    for (uint8_t l = 0; l < MOPPY_MUX_LINKS; l++) {
+        if (l == link || !(heardLinks & (1 << l)) || (uint16_t)(now - lastHeard[l]) > MOPPY_MUX_TIMEOUT) {
+            continue;
+        }
+        if (lag[l] + MOPPY_MUX_WINDOW * 16 / 2 < lag[link]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MoppyNetworkMux::sampleLag(uint8_t link, uint16_t millisLate) {
+    int32_t sample = (int32_t)millisLate * 16;
+    lag[link] += (sample - lag[link]) / 8; // Moving average over about 8 copies
+}
@@ -0,0 +1,101 @@
+/*
+ * MoppyNetworkMux.h
+ * Lets a device listen on several networks at once (e.g. ESP-Now for playback with UDP or USB
+ * serial alongside) when the Controller sends the same messages over each of them.  Every
+ * network is given one of the mux's links as its consumer.  The first copy of a message to
+ * arrive is passed on, and copies of it that arrive on the other links within MOPPY_MUX_WINDOW
+ * are dropped.
+ *
+ * How far each link lags behind the first copy is tracked as well.  A link lagging more than
+ * half the window behind one that's healthy (heard from within MOPPY_MUX_TIMEOUT) is too slow
+ * for its copies to be matched reliably, so it's only listened to once the faster links go
+ * quiet.  E.g. if a congested ESP-Now channel starts delivering late, UDP takes over until
+ * ESP-Now catches up again.  A message that only arrives on a too-slow link (the faster one
+ * lost it) is still passed on once the window runs out without a copy: late beats never.
+ * update() should be called regularly so that happens even when nothing else arrives.
+ *
+ * Only messages with a known payload length are merged (see moppyPayloadLength()).  Anything
+ * else is passed on from every link.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYNETWORKMUX_H_
+#define SRC_MOPPYNETWORKS_MOPPYNETWORKMUX_H_
+
+#include "../MoppyConfig.h"
+#include "../MoppyMessageConsumer.h"
+#include "MoppyNetwork.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+// Most networks that can be merged
+#define MOPPY_MUX_LINKS 3
+
+// Number of recent messages remembered for matching copies, and the longest payload merged
+#define MOPPY_MUX_HISTORY 32
+#define MOPPY_MUX_MAX_PAYLOAD 4
+
+// Milliseconds a copy can arrive after the first and still be recognised as one
+#ifndef MOPPY_MUX_WINDOW
+#define MOPPY_MUX_WINDOW 100
+#endif
+
+// A link that hasn't delivered anything for this many milliseconds isn't healthy
+#define MOPPY_MUX_TIMEOUT 1000
+
+class MoppyNetworkMux {
+public:
+    MoppyNetworkMux(MoppyMessageConsumer *messageConsumer);
+
+    // The consumer for a network to pass its messages to (index 0 to MOPPY_MUX_LINKS - 1)
+    MoppyMessageConsumer *link(uint8_t index) { return &links[index]; }
+
+    // Passes on messages from too-slow links that no faster copy turned up for in time
+    void update() { releaseExpired(millis()); }
+
+    uint16_t getDuplicates() const { return duplicates; } // Copies dropped
+    uint16_t getLag(uint8_t index) const { return lag[index] / 16; } // Milliseconds behind the first copy, on average
+
+private:
+    // Passes everything a network receives on to the mux, tagged with the link it came from
+    class Link : public MoppyMessageConsumer {
+    public:
+        MoppyNetworkMux *mux;
+        uint8_t index;
+
+        void handleSystemMessage(uint8_t command, uint8_t payload[]) override {
+            mux->receive(index, SYSTEM_ADDRESS, 0x00, command, payload);
+        };
+
+        void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) override {
+            mux->receive(index, deviceAddress, subAddress, command, payload);
+        };
+    };
+
+    struct Entry {
+        uint8_t message[3 + MOPPY_MUX_MAX_PAYLOAD]; // Device address, sub-address, command, payload
+        uint8_t length;
+        uint8_t link;         // Link the first copy came from
+        uint8_t matchedLinks; // Bit per link whose copy has been seen since
+        bool delivered;       // False if the first copy came from a link that was too slow
+        uint16_t receivedMillis;
+    };
+
+    MoppyMessageConsumer *targetConsumer;
+    Link links[MOPPY_MUX_LINKS];
+    uint16_t lastHeard[MOPPY_MUX_LINKS];
+    uint8_t heardLinks = 0;           // Bit per link that has delivered anything yet
+    uint16_t lag[MOPPY_MUX_LINKS];    // In 1/16ths of a millisecond
+    Entry entries[MOPPY_MUX_HISTORY]; // Ring buffer, oldest at head once it's full
+    uint8_t head = 0;
+    uint16_t duplicates = 0;
+
+    void receive(uint8_t link, uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]);
+    void deliver(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]);
+    void release(Entry &entry);
+    void releaseExpired(uint16_t now);
+    Entry *findCopy(uint8_t link, const uint8_t message[], uint8_t length, uint16_t now);
+    bool isTooSlow(uint8_t link, uint16_t now) const;
+    void sampleLag(uint8_t link, uint16_t millisLate);
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYNETWORKMUX_H_ */
@@ -4,11 +4,7 @@
  * Serial communications implementation for Arduino.  Instrument
  * has its handler functions called for device and system messages
  */
-MoppySerial::MoppySerial(MoppyMessageConsumer *messageConsumer) {
-    targetConsumer = messageConsumer;
-}
-
-void MoppySerial::begin() {
+void MoppySerialPort::begin() {
     Serial.begin(MOPPY_BAUD_RATE);
 }
 
@@ -21,8 +17,9 @@ void MoppySerial::begin() {
  *  5... - Optional payload
  */
 
-void MoppySerial::readMessages() {
-
+// Reads until a whole message for the consumer is buffered, and returns true.  Returns false once
+// there's nothing more to read for now.
+bool MoppySerialPort::readMessage() {
     // If we're waiting for position 4, then we know how many bytes we're waiting for, no need
     // to start reading until they're all there.
     // TODO: This will break for large messages because the Arduino buffer size is only 64 bytes.
@@ -32,7 +29,10 @@ void MoppySerial::readMessages() {
         switch (messagePos) {
         case 0:
             if (Serial.read() == START_BYTE) {
+                MOPPY_TRACE_RECEIVED();
                 messagePos = 1;
+            } else {
+                MoppyStats::bytesDiscarded++;
             }
             break;
         case 1:
@@ -45,7 +45,8 @@ void MoppySerial::readMessages() {
 
             // For Serial communications it's extremely unlikely that we'll be receiving messages not meant
             // for us, but this can help squash noise from being treated as a message
-            if (messageBuffer[1] != DEVICE_ADDRESS) {
+            if (!MoppyAddresses::acceptsDevice(messageBuffer[1])) {
+                MoppyStats::framesFiltered++;
                 messagePos = 0; // This message isn't for us
                 break;
             }
@@ -55,37 +56,81 @@ void MoppySerial::readMessages() {
         case 2:
             messageBuffer[2] = Serial.read(); // Read sub address
 
-            if (messageBuffer[2] == 0x00 || (messageBuffer[2] >= MIN_SUB_ADDRESS && messageBuffer[2] <= MAX_SUB_ADDRESS)) {
+            if (MoppyAddresses::accepts(messageBuffer[1], messageBuffer[2])) {
                 messagePos++; // Valid subAddress, continue
                 break;
             }
 
+            MoppyStats::framesFiltered++;
             messagePos = 0; // Not listening to this subAddress, skip this message
             break;
         case 3:
             messageBuffer[3] = Serial.read(); // Read message body size
+            if (messageBuffer[3] == 0) {
+                MoppyStats::framesBad++; // There's always a command byte
+                messagePos = 0;
+                break;
+            }
             messagePos++;
             break;
         case 4:
             // Read command and payload
-            Serial.readBytes(messageBuffer + 4, messageBuffer[3]);
+            if (Serial.readBytes(messageBuffer + 4, messageBuffer[3]) != messageBuffer[3]) {
+                MoppyStats::framesBad++;
+                messagePos = 0;
+                break;
+            }
+            MoppyStats::framesOk++;
+            MOPPY_TRACE_FRAMED();
+
+            messagePos = 0; // Start looking for a new message
 
-            // Call appropriate handler
+            // Answer the network's own messages, anything else is for the consumer
             if (messageBuffer[1] == SYSTEM_ADDRESS) {
                 if (messageBuffer[4] == NETBYTE_SYS_PING) {
                     sendPong(); // Respond with pong if requested
-                } else {
-                    targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
+                    break;
+                } else if (messageBuffer[4] == NETBYTE_SYS_STATS) {
+                    sendStats(messageBuffer[3] > 1 && messageBuffer[5] != 0);
+                    break;
+#ifdef MOPPY_TRACE
+                } else if (messageBuffer[4] == NETBYTE_SYS_TRACE) {
+                    sendTrace();
+                    break;
+#endif
                 }
-            } else {
-                targetConsumer->handleDeviceMessage(messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
             }
-
-            messagePos = 0; // Start looking for a new message
+            return true;
         }
     }
+    return false;
+}
+
+void MoppySerialPort::sendPong() {
+    uint8_t pongBytes[MOPPY_PONG_LENGTH];
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        MoppyAddresses::pong(r, pongBytes);
+        Serial.write(pongBytes, sizeof(pongBytes));
+    }
 }
 
-void MoppySerial::sendPong() {
-    Serial.write(pongBytes, sizeof(pongBytes));
-}
\ No newline at end of file
+void MoppySerialPort::sendStats(bool clear) {
+    uint8_t statsBytes[MOPPY_STATS_REPORT_LENGTH];
+    MoppyStats::report(DEVICE_ADDRESS, statsBytes);
+    Serial.write(statsBytes, sizeof(statsBytes));
+    if (clear) {
+        MoppyStats::reset();
+    }
+}
+
+#ifdef MOPPY_TRACE
+void MoppySerialPort::sendTrace() {
+    uint8_t traceBytes[MOPPY_TRACE_REPORT_LENGTH];
+    uint8_t length;
+    bool more;
+    do {
+        more = MoppyTrace::report(DEVICE_ADDRESS, traceBytes, &length);
+        Serial.write(traceBytes, length);
+    } while (more);
+}
+#endif
\ No newline at end of file
@@ -10,7 +10,10 @@
 #include "Arduino.h"
 #include "../MoppyConfig.h"
 #include "../MoppyMessageConsumer.h"
+#include "MoppyAddresses.h"
 #include "MoppyNetwork.h"
+#include "MoppyStats.h"
+#include "MoppyTrace.h"
 
 #if defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
   #define MOPPY_BAUD_RATE 115200
@@ -18,17 +21,46 @@
   #define MOPPY_BAUD_RATE 57600
 #endif
 
-class MoppySerial {
+// Reading and framing of messages, and the replies the network sends itself.  Shared by every
+// MoppySerial, whatever it passes messages on to.
+class MoppySerialPort {
   public:
-      MoppySerial(MoppyMessageConsumer *messageConsumer);
       void begin();
-      void readMessages();
-  private:
-    MoppyMessageConsumer *targetConsumer;
+  protected:
     uint8_t messagePos = 0; // Track current message read position
     uint8_t messageBuffer[259]; // Max message length for Moppy messages is 259
-    uint8_t pongBytes[8] = {START_BYTE, 0x00, 0x00, 0x04, 0x81, DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
+    bool readMessage();
+  private:
     void sendPong();
+    void sendStats(bool clear);
+#ifdef MOPPY_TRACE
+    void sendTrace();
+#endif
+};
+
+/*
+ * Passes messages on to a Consumer.  Given the instrument's own (final) type rather than
+ * MoppyMessageConsumer, the handlers are called directly instead of through the vtable (see
+ * MoppyStaticInstrument).
+ */
+template <class Consumer = MoppyMessageConsumer>
+class MoppySerial : public MoppySerialPort {
+  public:
+      MoppySerial(Consumer *messageConsumer) : targetConsumer(messageConsumer) {}
+
+      void readMessages() {
+          MoppyStats::rxWaiting(Serial.available());
+          while (readMessage()) {
+              // Call appropriate handler
+              if (messageBuffer[1] == SYSTEM_ADDRESS) {
+                  targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
+              } else {
+                  targetConsumer->handleDeviceMessage(messageBuffer[1], messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
+              }
+          }
+      }
+  private:
+    Consumer *targetConsumer;
 };
 
 
@@ -0,0 +1,100 @@
+#include "MoppyStats.h"
+
+uint32_t MoppyStats::framesOk = 0;
+uint32_t MoppyStats::framesBad = 0;
+uint32_t MoppyStats::framesFiltered = 0;
+uint32_t MoppyStats::bytesDiscarded = 0;
+uint16_t MoppyStats::rxHighWater = 0;
+uint16_t MoppyStats::handlerMicros = 0;
+uint16_t MoppyStats::sendStalls = 0;
+uint8_t MoppyStats::activeVoices = 0;
+uint8_t MoppyStats::peakVoices = 0;
+uint16_t MoppyStats::taskOverruns = 0;
+uint8_t MoppyStats::lastOverrunTask = 0xFF;
+uint16_t MoppyStats::timerMicros = 0;
+uint8_t MoppyStats::jitterDelay = 0;
+uint16_t MoppyStats::jitterLate = 0;
+uint8_t MoppyStats::jitterDepth = 0;
+uint8_t MoppyStats::soundingVoices[];
+
+void MoppyStats::handlerTime(uint32_t micros) {
+    if (micros > handlerMicros) {
+        handlerMicros = micros > 0xFFFF ? 0xFFFF : micros;
+    }
+}
+
+void MoppyStats::voiceOn(uint8_t voice) {
+    if (voice >= MOPPY_VOICE_COUNT) {
+        return;
+    }
+    uint8_t mask = 1 << (voice % 8);
+    if (!(soundingVoices[voice / 8] & mask)) {
+        soundingVoices[voice / 8] |= mask;
+        if (++activeVoices > peakVoices) {
+            peakVoices = activeVoices;
+        }
+    }
+}
+
+void MoppyStats::voiceOff(uint8_t voice) {
+    if (voice >= MOPPY_VOICE_COUNT) {
+        return;
+    }
+    uint8_t mask = 1 << (voice % 8);
+    if (soundingVoices[voice / 8] & mask) {
+        soundingVoices[voice / 8] &= ~mask;
+        activeVoices--;
+    }
+}
+
+void MoppyStats::voicesOff(uint8_t firstVoice, uint8_t count) {
+    for (uint8_t v = firstVoice; v < firstVoice + count; v++) {
+        voiceOff(v);
+    }
+}
+
+void MoppyStats::report(uint8_t deviceAddress, uint8_t message[]) {
+    message[0] = START_BYTE;
+    message[1] = SYSTEM_ADDRESS;
+    message[2] = 0x00;
+    message[3] = MOPPY_STATS_REPORT_LENGTH - 4;
+    message[4] = NETBYTE_SYS_STATS_REPORT;
+    message[5] = deviceAddress;
+
+    uint8_t *out = message + 6;
+    out = putLong(out, framesOk);
+    out = putLong(out, framesBad);
+    out = putLong(out, framesFiltered);
+    out = putLong(out, bytesDiscarded);
+    out = putShort(out, rxHighWater);
+    out = putShort(out, handlerMicros);
+    out = putShort(out, sendStalls);
+    out[0] = activeVoices;
+    out[1] = peakVoices;
+    out = putShort(out + 2, taskOverruns);
+    out[0] = lastOverrunTask;
+    out = putShort(out + 1, timerMicros);
+    out[0] = jitterDelay;
+    out = putShort(out + 1, jitterLate);
+    out[0] = jitterDepth;
+}
+
+void MoppyStats::reset() {
+    framesOk = framesBad = framesFiltered = bytesDiscarded = 0;
+    rxHighWater = handlerMicros = sendStalls = 0;
+    peakVoices = activeVoices;
+    taskOverruns = 0;
+    lastOverrunTask = 0xFF;
+    timerMicros = 0;
+}
+
+uint8_t *MoppyStats::putLong(uint8_t *out, uint32_t value) {
+    out = putShort(out, value >> 16);
+    return putShort(out, value);
+}
+
+uint8_t *MoppyStats::putShort(uint8_t *out, uint16_t value) {
+    out[0] = value >> 8;
+    out[1] = value;
+    return out + 2;
+}
@@ -0,0 +1,94 @@
+/*
+ * MoppyStats.h
+ * Counters for finding out where messages are being lost or delayed.  Networks and instruments
+ * update them as they go, and networks answer NETBYTE_SYS_STATS with a NETBYTE_SYS_STATS_REPORT
+ * message built by report().
+ *
+ * Report payload (multi-byte values are big-endian):
+ *  0     - Device address (0x00 from a gateway)
+ *  1-4   - framesOk
+ *  5-8   - framesBad
+ *  9-12  - framesFiltered
+ *  13-16 - bytesDiscarded
+ *  17-18 - rxHighWater
+ *  19-20 - handlerMicros
+ *  21-22 - sendStalls
+ *  23    - activeVoices
+ *  24    - peakVoices
+ *  25-26 - taskOverruns
+ *  27    - lastOverrunTask
+ *  28-29 - timerMicros
+ *  30    - jitterDelay
+ *  31-32 - jitterLate
+ *  33    - jitterDepth
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYSTATS_H_
+#define SRC_MOPPYNETWORKS_MOPPYSTATS_H_
+
+#include "../MoppyConfig.h"
+#include "MoppyAddresses.h"
+#include "MoppyNetwork.h"
+#include <stdint.h>
+
+// Length of the whole NETBYTE_SYS_STATS_REPORT message, header included
+#define MOPPY_STATS_REPORT_LENGTH 39
+
+class MoppyStats {
+public:
+    static uint32_t framesOk;       // Messages handled (relayed, on a gateway)
+    static uint32_t framesBad;      // Messages dropped because they were malformed or cut short
+    static uint32_t framesFiltered; // Messages for other devices or sub-addresses
+    static uint32_t bytesDiscarded; // Bytes skipped while looking for the start of a message
+    static uint16_t rxHighWater;    // Most bytes ever waiting to be read
+    static uint16_t handlerMicros;  // Longest time the instrument took to handle one message
+    static uint16_t sendStalls;     // Times a send had to wait for (or gave up on) the radio
+    static uint8_t activeVoices;    // Voices currently playing a note
+    static uint8_t peakVoices;      // Most voices ever playing at once
+    static uint16_t taskOverruns;   // Main loop tasks that ran longer than their budget (see MoppyScheduler)
+    static uint8_t lastOverrunTask; // Id of the last task that overran (0xFF if none has)
+    static uint16_t timerMicros;    // Longest MoppyTimer interrupt, callbacks included (only measured with MOPPY_TRACE)
+    static uint8_t jitterDelay;     // Playout delay of the jitter buffer in milliseconds (with MOPPY_JITTER_BUFFER)
+    static uint16_t jitterLate;     // Messages that arrived too late for the jitter buffer to smooth
+    static uint8_t jitterDepth;     // Messages the jitter buffer was holding
+
+    static void rxWaiting(uint16_t waiting) {
+        if (waiting > rxHighWater) {
+            rxHighWater = waiting;
+        }
+    }
+    static void handlerTime(uint32_t micros);
+    static void timerTime(uint32_t micros) {
+        if (micros > timerMicros) {
+            timerMicros = micros > 0xFFFF ? 0xFFFF : micros;
+        }
+    }
+    static void taskOverrun(uint8_t taskId) {
+        taskOverruns++;
+        lastOverrunTask = taskId;
+    }
+    // Networks with a jitter buffer pass on its state before asking for a report
+    static void jitterState(uint8_t delay, uint16_t underruns, uint8_t depth) {
+        jitterDelay = delay;
+        jitterLate = underruns;
+        jitterDepth = depth;
+    }
+    // Voices are numbered across the board (see moppyVoiceBase()), out of range ones are ignored
+    static void voiceOn(uint8_t voice);
+    static void voiceOff(uint8_t voice);
+    static void voicesOff(uint8_t firstVoice, uint8_t count);
+
+    // Write a NETBYTE_SYS_STATS_REPORT message (MOPPY_STATS_REPORT_LENGTH bytes) into message
+    static void report(uint8_t deviceAddress, uint8_t message[]);
+
+    // Clear the counters (voices that are playing stay active)
+    static void reset();
+
+private:
+    static uint8_t soundingVoices[(MOPPY_VOICE_COUNT + 7) / 8]; // One bit per voice
+
+    static uint8_t *putLong(uint8_t *out, uint32_t value);
+    static uint8_t *putShort(uint8_t *out, uint16_t value);
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYSTATS_H_ */
@@ -0,0 +1,92 @@
+#include "MoppyTrace.h"
+
+#ifdef MOPPY_TRACE
+
+MoppyTrace::Record MoppyTrace::records[MOPPY_TRACE_RECORDS];
+uint8_t MoppyTrace::oldest = 0;
+uint8_t MoppyTrace::count = 0;
+volatile uint8_t MoppyTrace::pendingEdge[MOPPY_TRACE_VOICES];
+volatile uint32_t MoppyTrace::receivedTime = 0;
+volatile uint32_t MoppyTrace::framedTime = 0;
+
+void MoppyTrace::dispatched(uint8_t voice) {
+    uint32_t dispatchedTime = now();
+    if (voice >= MOPPY_TRACE_VOICES) {
+        return;
+    }
+
+    // Take the next slot, overwriting the oldest record once the ring is full
+    uint8_t index = (oldest + count) % MOPPY_TRACE_RECORDS;
+    if (count == MOPPY_TRACE_RECORDS) {
+        oldest = (oldest + 1) % MOPPY_TRACE_RECORDS;
+    } else {
+        count++;
+    }
+
+    noInterrupts();
+    for (uint8_t v = 0; v < MOPPY_TRACE_VOICES; v++) {
+        if (pendingEdge[v] == index + 1) {
+            pendingEdge[v] = 0; // That record is gone
+        }
+    }
+    Record &record = records[index];
+    record.times[TRACE_RECEIVED] = receivedTime;
+    record.times[TRACE_FRAMED] = framedTime;
+    record.times[TRACE_DISPATCHED] = dispatchedTime;
+    record.voice = voice;
+    record.stepped = false;
+    pendingEdge[voice] = index + 1;
+    interrupts();
+}
+
+bool MoppyTrace::report(uint8_t deviceAddress, uint8_t message[], uint8_t *length) {
+    uint8_t reported = count < MOPPY_TRACE_RECORDS_PER_REPORT ? count : MOPPY_TRACE_RECORDS_PER_REPORT;
+
+    message[0] = START_BYTE;
+    message[1] = SYSTEM_ADDRESS;
+    message[2] = 0x00;
+    message[4] = NETBYTE_SYS_TRACE_REPORT;
+    message[5] = deviceAddress;
+#ifdef ARDUINO_ARCH_AVR
+    message[6] = 1;
+#else
+    message[6] = ESP.getCpuFreqMHz();
+#endif
+    message[7] = reported;
+
+    uint8_t *out = message + 8;
+    for (uint8_t r = 0; r < reported; r++) {
+        noInterrupts();
+        Record record = records[oldest];
+        if (!record.stepped) {
+            // Still waiting (or never will, e.g. the note was out of range)
+            for (uint8_t v = 0; v < MOPPY_TRACE_VOICES; v++) {
+                if (pendingEdge[v] == oldest + 1) {
+                    pendingEdge[v] = 0;
+                }
+            }
+        }
+        interrupts();
+        oldest = (oldest + 1) % MOPPY_TRACE_RECORDS;
+        count--;
+
+        *out++ = record.voice + MIN_SUB_ADDRESS;
+        for (uint8_t stage = TRACE_FRAMED; stage <= TRACE_EDGE; stage++) {
+            uint32_t elapsed = record.times[stage] - record.times[TRACE_RECEIVED];
+            if (stage == TRACE_EDGE && !record.stepped) {
+                elapsed = 0xFFFFFFFF;
+            }
+            out[0] = elapsed >> 24;
+            out[1] = elapsed >> 16;
+            out[2] = elapsed >> 8;
+            out[3] = elapsed;
+            out += 4;
+        }
+    }
+
+    *length = out - message;
+    message[3] = *length - 4;
+    return count > 0;
+}
+
+#endif /* MOPPY_TRACE */
@@ -0,0 +1,132 @@
+/*
+ * MoppyTrace.h
+ * Optional (MOPPY_TRACE) latency tracing.  Every note-on gets a record with timestamps at four
+ * stages:
+ *  - TRACE_RECEIVED:   the first byte of the frame was read, or its packet arrived
+ *  - TRACE_FRAMED:     the parser has the whole frame
+ *  - TRACE_DISPATCHED: the instrument is handed the note
+ *  - TRACE_EDGE:       the first step/pin edge for the note
+ *
+ * Records are kept in a small ring (oldest overwritten) and sent back in answer to
+ * NETBYTE_SYS_TRACE as one or more NETBYTE_SYS_TRACE_REPORT messages:
+ *  0     - Device address
+ *  1     - Timestamp ticks per microsecond (CPU cycles on ESP boards, microseconds on AVR)
+ *  2     - Number of records in this message
+ *  3...  - Records: sub-address, then the FRAMED, DISPATCHED and EDGE times relative to
+ *          RECEIVED (4 bytes each, big-endian, 0xFFFFFFFF if the note never stepped)
+ *
+ * Notes are traced by voice (see moppyVoiceBase()), so with INSTRUMENT_COMPOSITE the reported
+ * sub-addresses carry on from one range to the next rather than starting over.
+ *
+ * Use the MOPPY_TRACE_* macros at the trace points, they compile to nothing without MOPPY_TRACE.
+ * Anything that holds on to a frame before dispatching it (a jitter buffer, a queue) keeps the
+ * frame's Stamp with it and restore()s it first, so the note is traced from its own arrival.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYTRACE_H_
+#define SRC_MOPPYNETWORKS_MOPPYTRACE_H_
+
+#include "../MoppyConfig.h"
+#include "MoppyAddresses.h"
+#include "MoppyNetwork.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+#ifdef MOPPY_TRACE
+
+#ifdef ARDUINO_ARCH_AVR
+#define MOPPY_TRACE_RECORDS 8
+#else
+#define MOPPY_TRACE_RECORDS 64
+#endif
+
+// Records per NETBYTE_SYS_TRACE_REPORT message, and the length of the largest message
+#define MOPPY_TRACE_RECORDS_PER_REPORT (MOPPY_TRACE_RECORDS < 16 ? MOPPY_TRACE_RECORDS : 16)
+#define MOPPY_TRACE_RECORD_LENGTH 13
+#define MOPPY_TRACE_REPORT_LENGTH (8 + MOPPY_TRACE_RECORDS_PER_REPORT * MOPPY_TRACE_RECORD_LENGTH)
+
+#define MOPPY_TRACE_RECEIVED() MoppyTrace::received(MoppyTrace::now())
+#define MOPPY_TRACE_RECEIVED_AT(time) MoppyTrace::received(time)
+#define MOPPY_TRACE_NOW() MoppyTrace::now()
+#define MOPPY_TRACE_FRAMED() MoppyTrace::framed()
+#define MOPPY_TRACE_NOTE(voice) MoppyTrace::dispatched(voice)
+#define MOPPY_TRACE_EDGE(voice) MoppyTrace::edge(voice)
+
+class MoppyTrace {
+public:
+    // When the current frame arrived and was parsed
+    struct Stamp {
+        uint32_t received;
+        uint32_t framed;
+    };
+
+    static void received(uint32_t time) { receivedTime = time; }
+    static void framed() { framedTime = now(); }
+    static void dispatched(uint8_t voice);
+
+    static Stamp stamp() { return {receivedTime, framedTime}; }
+    static void restore(const Stamp &stamp) {
+        receivedTime = stamp.received;
+        framedTime = stamp.framed;
+    }
+
+    // Called from the timer interrupt on every step, so it does as little as possible when
+    // there's nothing to record
+    static inline __attribute__((always_inline)) void edge(uint8_t voice) {
+        if (voice < MOPPY_TRACE_VOICES && pendingEdge[voice] != 0) {
+            Record &record = records[pendingEdge[voice] - 1];
+            record.times[TRACE_EDGE] = now();
+            record.stepped = true;
+            pendingEdge[voice] = 0;
+        }
+    }
+
+    /*
+     * Write the next NETBYTE_SYS_TRACE_REPORT message (oldest records first) into message and
+     * set length to its length.  The reported records are forgotten.  Returns true if there
+     * are more records for another message.
+     */
+    static bool report(uint8_t deviceAddress, uint8_t message[], uint8_t *length);
+
+    static inline __attribute__((always_inline)) uint32_t now() {
+#ifdef ARDUINO_ARCH_AVR
+        return micros();
+#else
+        return ESP.getCycleCount(); // NOTE: ESP32 cores count separately, but start together
+#endif
+    }
+
+private:
+    static const uint8_t MOPPY_TRACE_VOICES = MOPPY_VOICE_COUNT;
+
+    enum Stage : uint8_t {
+        TRACE_RECEIVED,
+        TRACE_FRAMED,
+        TRACE_DISPATCHED,
+        TRACE_EDGE
+    };
+
+    struct Record {
+        uint32_t times[4];
+        uint8_t voice;
+        volatile bool stepped;
+    };
+
+    static Record records[MOPPY_TRACE_RECORDS];
+    static uint8_t oldest; // Index of the oldest record
+    static uint8_t count;  // Number of records in the ring
+    static volatile uint8_t pendingEdge[MOPPY_TRACE_VOICES]; // Record (plus one) waiting for each voice's first edge, 0 if none
+    static volatile uint32_t receivedTime;
+    static volatile uint32_t framedTime;
+};
+
+#else
+#define MOPPY_TRACE_RECEIVED()
+#define MOPPY_TRACE_RECEIVED_AT(time)
+#define MOPPY_TRACE_NOW() 0
+#define MOPPY_TRACE_FRAMED()
+#define MOPPY_TRACE_NOTE(voice)
+#define MOPPY_TRACE_EDGE(voice)
+#endif /* MOPPY_TRACE */
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYTRACE_H_ */
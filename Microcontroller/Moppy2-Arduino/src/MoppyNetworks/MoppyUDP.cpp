@@ -3,7 +3,17 @@
 #if !defined ARDUINO_ARCH_ESP8266 && !defined ARDUINO_ARCH_ESP32
 #else
 
+#ifdef ARDUINO_ARCH_ESP32
+// On the ESP32 packets are parsed by the AsyncUDP task as they arrive, straight from lwIP's
+// buffer, and the decoded messages are queued for readMessages() to dispatch.  The ESP8266
+// still polls WiFiUDP from readMessages().
+AsyncUDP UDP;
+static portMUX_TYPE udpMux = portMUX_INITIALIZER_UNLOCKED;
+#define UDP_LOCK() portENTER_CRITICAL(&udpMux)
+#define UDP_UNLOCK() portEXIT_CRITICAL(&udpMux)
+#else
 WiFiUDP UDP;
+#endif
 
 /*
  * Serial communications implementation for Arduino.  Instrument
@@ -37,7 +47,11 @@ bool MoppyUDP::startUDP() {
     if (UDP.beginMulticast(WiFi.localIP(), IPAddress(239, 2, 2, 7), MOPPY_UDP_PORT) == 1) {
 #elif ARDUINO_ARCH_ESP32
     WiFi.setSleep(false);
-    if (UDP.beginMulticast(IPAddress(239, 2, 2, 7), MOPPY_UDP_PORT) == 1) {
+    commandQueue = xQueueCreate(MOPPY_UDP_QUEUE_LENGTH, sizeof(Command));
+    if (UDP.listenMulticast(IPAddress(239, 2, 2, 7), MOPPY_UDP_PORT)) {
+        UDP.onPacket([this](AsyncUDPPacket &packet) {
+            parseMessage(packet.data(), packet.length(), MOPPY_TRACE_NOW());
+        });
 #endif
         Serial.println("Connection successful");
         connected = true;
@@ -86,34 +100,49 @@ void MoppyUDP::startOTA() {
     ArduinoOTA.begin();
 }
 
-void MoppyUDP::readMessages() {
-    // Handle OTA
+void MoppyUDP::handleOTA() {
     ArduinoOTA.handle();
+}
 
-    // Handle UDP packets
-    int packetSize = UDP.parsePacket();
-    if (packetSize) {
-        // Serial.println("");
-        // Serial.print("Received packet of size ");
-        // Serial.println(packetSize);
-        // Serial.print("From ");
-        // IPAddress remote = UDP.remoteIP();
-        // for (int i = 0; i < 4; i++) {
-        //     Serial.print(remote[i], DEC);
-        //     if (i < 3) {
-        //         Serial.print(".");
-        //     }
-        // }
-        // Serial.print(", port ");
-        // Serial.println(UDP.remotePort());
-
+void MoppyUDP::readMessages() {
+#ifdef ARDUINO_ARCH_ESP8266
+    // Handle every UDP packet that's waiting, not just the first one
+    while (UDP.parsePacket() > 0) {
+        uint32_t receivedTime = MOPPY_TRACE_NOW();
+        MoppyStats::rxWaiting(UDP.available());
         // read the packet into messageBuffer
-        int messageLength = UDP.read(messageBuffer, MOPPY_MAX_PACKET_LENGTH);
+        int messageLength = UDP.read(messageBuffer, MOPPY_UDP_PACKET_LENGTH);
         // Parse
-        parseMessage(messageBuffer, messageLength);
+        parseMessage(messageBuffer, messageLength, receivedTime);
 
         UDP.flush(); // Just incase we got a really long packet
     }
+#else
+    UDP_LOCK();
+    FrameCounts counts = taskCounts;
+    taskCounts = {0, 0, 0, 0};
+    UDP_UNLOCK();
+    MoppyStats::framesOk += counts.ok;
+    MoppyStats::framesBad += counts.bad;
+    MoppyStats::framesFiltered += counts.filtered;
+    MoppyStats::bytesDiscarded += counts.discarded;
+
+    Command command;
+    uint16_t waiting = 0;
+    while (xQueueReceive(commandQueue, &command, 0) == pdTRUE) {
+        waiting += command.frameLength;
+#ifdef MOPPY_TRACE
+        MoppyTrace::restore(command.stamp);
+#endif
+        dispatch(command.deviceAddress, command.subAddress, command.command, command.payload, command.frameLength - 5, command.arrivedMillis);
+    }
+    MoppyStats::rxWaiting(waiting);
+#endif
+
+#ifdef MOPPY_JITTER_BUFFER
+    // Play out whatever is due
+    jitterBuffer.release(targetConsumer);
+#endif
 }
 
 /* MoppyMessages contain the following bytes:
@@ -123,27 +152,155 @@ void MoppyUDP::readMessages() {
  *  3    - Size of message body (number of bytes following this one)
  *  4    - Command byte
  *  5... - Optional payload
+ *
+ * A single datagram may contain several MoppyMessages back-to-back (e.g. all the
+ * notes of a chord), so keep parsing until the datagram is used up.  On the ESP32 this runs
+ * in the AsyncUDP task, straight from lwIP's buffer.
  */
-void MoppyUDP::parseMessage(uint8_t message[], int length) {
-    if (length < 5 || message[0] != START_BYTE || length != (4 + message[3])) {
-        return; // Message is too short, not a Moppy Message, or wrongly sized
+void MoppyUDP::parseMessage(const uint8_t message[], int length, uint32_t receivedTime) {
+    FrameCounts counts = {0, 0, 0, 0};
+    int pos = 0;
+    while (length - pos >= 5 && message[pos] == START_BYTE) {
+        const uint8_t *frame = message + pos;
+        int frameLength = 4 + frame[3];
+        if (frame[3] == 0 || frameLength > length - pos) {
+            counts.bad++;
+            break; // Message is wrongly sized, ignore the rest of the datagram
+        }
+
+        // Only worry about this if it's addressed to us
+        if (MoppyAddresses::accepts(frame[1], frame[2])) {
+            handleFrame(frame, receivedTime, counts);
+        } else {
+            counts.filtered++;
+        }
+
+        pos += frameLength;
+    }
+    counts.discarded += length - pos; // Trailing bytes that aren't a message
+
+#ifdef ARDUINO_ARCH_ESP32
+    UDP_LOCK();
+    taskCounts.ok += counts.ok;
+    taskCounts.bad += counts.bad;
+    taskCounts.filtered += counts.filtered;
+    taskCounts.discarded += counts.discarded;
+    UDP_UNLOCK();
+#else
+    MoppyStats::framesOk += counts.ok;
+    MoppyStats::framesBad += counts.bad;
+    MoppyStats::framesFiltered += counts.filtered;
+    MoppyStats::bytesDiscarded += counts.discarded;
+#endif
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+// Queue the message for readMessages(), since the consumer isn't safe to call from this task
+void MoppyUDP::handleFrame(const uint8_t frame[], uint32_t receivedTime, FrameCounts &counts) {
+    if (frame[3] - 1 > MOPPY_UDP_MAX_PAYLOAD) {
+        counts.bad++;
+        return;
     }
+    Command command;
+    command.deviceAddress = frame[1];
+    command.subAddress = frame[2];
+    command.command = frame[4];
+    command.frameLength = 4 + frame[3];
+    memset(command.payload, 0, MOPPY_UDP_MAX_PAYLOAD);
+    memcpy(command.payload, &frame[5], frame[3] - 1);
+    command.arrivedMillis = millis();
+#ifdef MOPPY_TRACE
+    command.stamp = {receivedTime, MoppyTrace::now()};
+#endif
+    if (xQueueSend(commandQueue, &command, 0) == pdTRUE) {
+        counts.ok++;
+    } else {
+        counts.discarded += command.frameLength; // readMessages() has fallen behind
+    }
+}
+#else
+void MoppyUDP::handleFrame(const uint8_t frame[], uint32_t receivedTime, FrameCounts &counts) {
+#ifdef MOPPY_TRACE
+    MoppyTrace::restore({receivedTime, MoppyTrace::now()});
+#endif
+    counts.ok++;
+    dispatch(frame[1], frame[2], frame[4], (uint8_t *)&frame[5], frame[3] - 1, millis());
+}
+#endif
 
-    // Only worry about this if it's addressed to us
-    if (message[1] == SYSTEM_ADDRESS) {
-        if (messageBuffer[4] == NETBYTE_SYS_PING) {
+void MoppyUDP::dispatch(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength, uint32_t arrivedMillis) {
+    if (deviceAddress == SYSTEM_ADDRESS) {
+        if (command == NETBYTE_SYS_PING) {
             sendPong(); // Respond with pong if requested
+        } else if (command == NETBYTE_SYS_STATS) {
+            sendStats(payloadLength > 0 && payload[0] != 0);
+#ifdef MOPPY_TRACE
+        } else if (command == NETBYTE_SYS_TRACE) {
+            sendTrace();
+#endif
+#ifdef MOPPY_JITTER_BUFFER
+        } else if (command == NETBYTE_SYS_TIMESTAMP) {
+            if (payloadLength >= 2) {
+                jitterBuffer.setSenderTime(payload[0] << 8 | payload[1]);
+            }
+        } else if (!jitterBuffer.push(SYSTEM_ADDRESS, 0, command, payload, payloadLength, arrivedMillis)) {
+            targetConsumer->handleSystemMessage(command, payload);
+#else
         } else {
-            targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
+            targetConsumer->handleSystemMessage(command, payload);
+#endif
         }
-    } else if (message[1] == DEVICE_ADDRESS) {
-        targetConsumer->handleDeviceMessage(messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
+        return;
     }
+#ifdef MOPPY_JITTER_BUFFER
+    if (!jitterBuffer.push(deviceAddress, subAddress, command, payload, payloadLength, arrivedMillis))
+#endif
+    targetConsumer->handleDeviceMessage(deviceAddress, subAddress, command, payload);
 }
 
 void MoppyUDP::sendPong() {
-    UDP.beginPacket(IPAddress(239, 2, 2, 7), 30994);
-    UDP.write(pongBytes, sizeof(pongBytes));
+    uint8_t pongBytes[MOPPY_PONG_LENGTH];
+    for (uint8_t r = 0; r < MOPPY_ADDRESS_COUNT; r++) {
+        MoppyAddresses::pong(r, pongBytes);
+        sendUpstream(pongBytes, sizeof(pongBytes));
+    }
+}
+
+void MoppyUDP::sendStats(bool clear) {
+    uint8_t statsBytes[MOPPY_STATS_REPORT_LENGTH];
+#ifdef MOPPY_JITTER_BUFFER
+    MoppyStats::jitterState(jitterBuffer.getDelay(), jitterBuffer.getUnderruns(), jitterBuffer.getDepth());
+#endif
+    MoppyStats::report(DEVICE_ADDRESS, statsBytes);
+    sendUpstream(statsBytes, sizeof(statsBytes));
+    if (clear) {
+        MoppyStats::reset();
+#ifdef MOPPY_JITTER_BUFFER
+        jitterBuffer.clearUnderruns();
+#endif
+    }
+}
+
+#ifdef MOPPY_TRACE
+void MoppyUDP::sendTrace() {
+    uint8_t traceBytes[MOPPY_TRACE_REPORT_LENGTH];
+    uint8_t length;
+    bool more;
+    do {
+        more = MoppyTrace::report(DEVICE_ADDRESS, traceBytes, &length);
+        sendUpstream(traceBytes, length);
+    } while (more);
+}
+#endif
+
+// Sends a message to the multicast group, where the Controller is listening
+void MoppyUDP::sendUpstream(const uint8_t data[], size_t length) {
+#ifdef ARDUINO_ARCH_ESP32
+    UDP.writeTo(data, length, IPAddress(239, 2, 2, 7), MOPPY_UDP_PORT);
+#else
+    UDP.beginPacket(IPAddress(239, 2, 2, 7), MOPPY_UDP_PORT);
+    UDP.write(data, length);
     UDP.endPacket();
+#endif
 }
 #endif /* ARDUINO_ARCH_ESP8266 or ARDUINO_ARCH_ESP32 */
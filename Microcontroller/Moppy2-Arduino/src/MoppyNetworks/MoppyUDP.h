@@ -11,7 +11,13 @@
 #include "../MoppyConfig.h"
 #include "../MoppyMessageConsumer.h"
 #include "Arduino.h"
+#include "MoppyAddresses.h"
 #include "MoppyNetwork.h"
+#include "MoppyStats.h"
+#include "MoppyTrace.h"
+#ifdef MOPPY_JITTER_BUFFER
+#include "MoppyJitterBuffer.h"
+#endif
 #include <ArduinoOTA.h>
 #ifdef ARDUINO_ARCH_ESP8266
 #include <ESP8266WiFi.h>
@@ -20,27 +26,77 @@
 #endif
 #include <ESPAsyncWebServer.h>   //Local WebServer used to serve the configuration portal
 #include <ESPAsyncWiFiManager.h> // https://github.com/alanswx/ESPAsyncWiFiManager WiFi Configuration Magic
+#ifdef ARDUINO_ARCH_ESP32
+#include <AsyncUDP.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#else
 #include <WiFiUdp.h>
+#endif
 #include <stdint.h>
 
 #define MOPPY_UDP_PORT 30994
-#define MOPPY_MAX_PACKET_LENGTH 259
+// Datagrams can carry several MoppyMessages, so size the buffer for a whole unfragmented
+// datagram (1500 byte MTU minus IP and UDP headers) rather than a single 259 byte message
+#define MOPPY_UDP_PACKET_LENGTH 1472
+
+#ifdef ARDUINO_ARCH_ESP32
+// Messages the AsyncUDP task can have waiting for readMessages(), and the longest payload
+// (command byte excluded) one can carry.  Longer messages are dropped as bad frames.
+#define MOPPY_UDP_QUEUE_LENGTH 32
+#define MOPPY_UDP_MAX_PAYLOAD 8
+#endif
 
 class MoppyUDP {
 public:
     MoppyUDP(MoppyMessageConsumer *messageConsumer);
     void begin();
     void readMessages();
+    void handleOTA(); // Called separately from readMessages() so it can run less often
 
 private:
+    // Frame counts from one datagram, for MoppyStats
+    struct FrameCounts {
+        uint16_t ok;
+        uint16_t bad;
+        uint16_t filtered;
+        uint16_t discarded; // Bytes
+    };
+
     MoppyMessageConsumer *targetConsumer;
-    uint8_t messagePos = 0;                         // Track current message read position
-    uint8_t messageBuffer[MOPPY_MAX_PACKET_LENGTH]; // Max message length for Moppy messages is 259
-    const uint8_t pongBytes[8] = {START_BYTE, 0x00, 0x00, 0x04, 0x81, DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
+#ifdef ARDUINO_ARCH_ESP32
+    // A message parsed by the AsyncUDP task, waiting to be dispatched
+    struct Command {
+        uint8_t deviceAddress;
+        uint8_t subAddress;
+        uint8_t command;
+        uint8_t frameLength; // Whole message, for MoppyStats::rxWaiting()
+        uint8_t payload[MOPPY_UDP_MAX_PAYLOAD];
+        uint32_t arrivedMillis; // For the jitter buffer, since it may wait a while in the queue
+#ifdef MOPPY_TRACE
+        MoppyTrace::Stamp stamp;
+#endif
+    };
+
+    QueueHandle_t commandQueue = NULL;
+    FrameCounts taskCounts = {0, 0, 0, 0}; // Counted by the AsyncUDP task, not yet in MoppyStats
+#else
+    uint8_t messageBuffer[MOPPY_UDP_PACKET_LENGTH]; // Buffer for the current datagram
+#endif
+#ifdef MOPPY_JITTER_BUFFER
+    MoppyJitterBuffer jitterBuffer;
+#endif
     void startOTA();
     bool startUDP();
-    void parseMessage(uint8_t message[], int length);
+    void parseMessage(const uint8_t message[], int length, uint32_t receivedTime);
+    void handleFrame(const uint8_t frame[], uint32_t receivedTime, FrameCounts &counts);
+    void dispatch(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength, uint32_t arrivedMillis);
     void sendPong();
+    void sendStats(bool clear);
+#ifdef MOPPY_TRACE
+    void sendTrace();
+#endif
+    void sendUpstream(const uint8_t data[], size_t length);
 };
 
 #endif /* SRC_MOPPYNETWORKS_MOPPYUDP_H_ */
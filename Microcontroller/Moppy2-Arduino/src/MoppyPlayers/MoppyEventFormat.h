@@ -0,0 +1,29 @@
+/*
+ * MoppyEventFormat.h
+ * Layout of precompiled Moppy event streams, shared with the mid2moppy host tool (so nothing
+ * Arduino-specific in here).
+ *
+ * A stream is a header followed by records, all multi-byte values big-endian:
+ *
+ *   "MPEV"                   magic
+ *   version                  1 byte (MOPPY_EVENTS_VERSION)
+ *   tick length              2 bytes, microseconds per tick
+ *   record length            4 bytes, number of record bytes after the header
+ *
+ *   record: delta-ticks (MIDI-style variable length), sub-address, command, payload length, payload
+ *
+ * Tempo changes are resolved and voices are allocated when the stream is compiled, so the
+ * records can be handed to the instrument exactly as they are.
+ */
+
+#ifndef SRC_MOPPYPLAYERS_MOPPYEVENTFORMAT_H_
+#define SRC_MOPPYPLAYERS_MOPPYEVENTFORMAT_H_
+
+#define MOPPY_EVENTS_MAGIC "MPEV"
+#define MOPPY_EVENTS_VERSION 1
+#define MOPPY_EVENTS_HEADER_LENGTH 11
+
+// Largest payload a record may carry
+#define MOPPY_EVENTS_MAX_PAYLOAD 8
+
+#endif /* SRC_MOPPYPLAYERS_MOPPYEVENTFORMAT_H_ */
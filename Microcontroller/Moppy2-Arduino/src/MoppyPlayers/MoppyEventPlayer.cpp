@@ -0,0 +1,142 @@
+/*
+ * MoppyEventPlayer.cpp
+ */
+#include "MoppyEventPlayer.h"
+
+MoppyEventPlayer::MoppyEventPlayer(MoppyMessageConsumer *messageConsumer, const uint8_t *events) {
+    targetConsumer = messageConsumer;
+    this->events = events;
+}
+
+void MoppyEventPlayer::begin() {
+    // Check the header before trusting anything else in the stream
+    for (uint8_t i = 0; i < 4; i++) {
+        if (pgm_read_byte(events + i) != MOPPY_EVENTS_MAGIC[i]) {
+            return;
+        }
+    }
+    if (pgm_read_byte(events + 4) != MOPPY_EVENTS_VERSION) {
+        return;
+    }
+    tickMicros = pgm_read_byte(events + 5) << 8 | pgm_read_byte(events + 6);
+    uint32_t length = 0;
+    for (uint8_t i = 7; i < MOPPY_EVENTS_HEADER_LENGTH; i++) {
+        length = (length << 8) | pgm_read_byte(events + i);
+    }
+    end = events + MOPPY_EVENTS_HEADER_LENGTH + length; // Started by main.cpp for MOPPY_PLAYER_AUTOSTART
+}
+
+void MoppyEventPlayer::rewind() {
+    next = events + MOPPY_EVENTS_HEADER_LENGTH;
+    eventMicros = micros();
+    scheduleNext();
+}
+
+// Read the next record's delta-time and work out when it's due
+void MoppyEventPlayer::scheduleNext() {
+    if (next >= end) {
+        return;
+    }
+    uint32_t delta = 0;
+    uint8_t b;
+    do {
+        b = readByte();
+        delta = (delta << 7) | (b & 0x7F);
+    } while (b & 0x80);
+    // delta * tickMicros * 100 / tempoScale, with delta split by tempoScale first so that
+    // neither product can overflow 32 bits
+    uint32_t tickSpan = (uint32_t)tickMicros * 100;
+    uint32_t wholeTicks = delta / tempoScale;
+    uint32_t span = delta % tempoScale * tickSpan / tempoScale;
+    if (tickSpan != 0 && wholeTicks > (MOPPY_PLAYER_MAX_REST - span) / tickSpan) {
+        span = MOPPY_PLAYER_MAX_REST;
+    } else {
+        span += wholeTicks * tickSpan;
+    }
+    eventMicros += span;
+}
+
+void MoppyEventPlayer::play() {
+    if (end == nullptr) {
+        return; // No valid stream
+    }
+    rewind();
+    playing = true;
+}
+
+void MoppyEventPlayer::stop() {
+    if (playing) {
+        playing = false;
+        silence();
+    }
+}
+
+void MoppyEventPlayer::setTempoScale(uint8_t percent) {
+    if (percent > 0) {
+        tempoScale = percent;
+    }
+}
+
+// Stop any sounding notes on the instrument
+void MoppyEventPlayer::silence() {
+    targetConsumer->handleSystemMessage(NETBYTE_SYS_STOP, nullptr);
+}
+
+void MoppyEventPlayer::update() {
+    for (uint8_t burst = 0; playing && burst < MOPPY_PLAYER_MAX_BURST; burst++) {
+        if (next >= end) {
+            silence();
+            if (looping) {
+                rewind();
+                continue;
+            }
+            playing = false;
+            return;
+        }
+        if ((int32_t)(micros() - eventMicros) < 0) {
+            return; // Not due yet
+        }
+
+        uint8_t subAddress = readByte();
+        uint8_t command = readByte();
+        uint8_t length = readByte();
+        uint8_t payload[MOPPY_EVENTS_MAX_PAYLOAD];
+        for (uint8_t i = 0; i < length; i++) {
+            uint8_t b = readByte();
+            if (i < MOPPY_EVENTS_MAX_PAYLOAD) {
+                payload[i] = b;
+            }
+        }
+
+        targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, subAddress, command, payload);
+        scheduleNext();
+    }
+}
+
+//
+//// Message Handlers
+//
+
+void MoppyEventPlayer::handleSystemMessage(uint8_t command, uint8_t payload[]) {
+    switch (command) {
+    case NETBYTE_SYS_PLAYER_PLAY:
+        play();
+        break;
+    case NETBYTE_SYS_PLAYER_STOP:
+        stop();
+        break;
+    case NETBYTE_SYS_PLAYER_TEMPO:
+        setTempoScale(payload[0]);
+        break;
+    case NETBYTE_SYS_PLAYER_LOOP:
+        setLooping(payload[0] != 0);
+        break;
+    default:
+        targetConsumer->handleSystemMessage(command, payload);
+        break;
+    }
+}
+
+void MoppyEventPlayer::handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    targetConsumer->handleDeviceMessage(deviceAddress, subAddress, command, payload);
+}
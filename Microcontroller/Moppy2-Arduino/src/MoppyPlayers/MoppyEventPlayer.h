@@ -0,0 +1,58 @@
+/*
+ * MoppyEventPlayer.h
+ * Plays a precompiled Moppy event stream (see MoppyEventFormat.h) stored in program memory.
+ * Like MoppySMFPlayer it sits between the network and the instrument and handles the
+ * NETBYTE_SYS_PLAYER_* messages, but playback is just read-and-dispatch so it runs on AVR too.
+ */
+
+#ifndef SRC_MOPPYPLAYERS_MOPPYEVENTPLAYER_H_
+#define SRC_MOPPYPLAYERS_MOPPYEVENTPLAYER_H_
+
+#include "../MoppyConfig.h"
+#include "../MoppyMessageConsumer.h"
+#include "../MoppyNetworks/MoppyNetwork.h"
+#include "MoppyEventFormat.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+// Maximum number of events dispatched per update() so the network still gets serviced
+#define MOPPY_PLAYER_MAX_BURST 16
+
+// Longest rest between two records in microseconds (about 35 minutes).  Longer ones are cut
+// short, since update() compares times as signed 32 bit values.
+#define MOPPY_PLAYER_MAX_REST 0x7FFFFFFFUL
+
+class MoppyEventPlayer : public MoppyMessageConsumer {
+public:
+    // events must point to a complete stream in PROGMEM
+    MoppyEventPlayer(MoppyMessageConsumer *messageConsumer, const uint8_t *events);
+    void begin();
+    void update();
+
+    void play();
+    void stop();
+    void setTempoScale(uint8_t percent);
+    void setLooping(bool loop) { looping = loop; }
+
+    void handleSystemMessage(uint8_t command, uint8_t payload[]) override;
+    void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) override;
+
+private:
+    MoppyMessageConsumer *targetConsumer;
+    const uint8_t *events;
+    const uint8_t *next = nullptr; // Next unread byte of the records
+    const uint8_t *end = nullptr;  // Just past the last record (nullptr if the stream is invalid)
+    uint16_t tickMicros = 0;
+
+    bool playing = false;
+    bool looping = MOPPY_PLAYER_LOOP;
+    uint8_t tempoScale = 100;  // Percentage of the stream's own tempo
+    uint32_t eventMicros = 0;  // micros() at which the next record is due
+
+    void rewind();
+    void scheduleNext();
+    void silence();
+    uint8_t readByte() { return pgm_read_byte(next++); }
+};
+
+#endif /* SRC_MOPPYPLAYERS_MOPPYEVENTPLAYER_H_ */
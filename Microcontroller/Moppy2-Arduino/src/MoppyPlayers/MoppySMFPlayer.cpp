@@ -0,0 +1,286 @@
+/*
+ * MoppySMFPlayer.cpp
+ *
+ * Tracks are merged on the fly: each track keeps a small read buffer and the tick of its next
+ * event, and update() always plays the earliest pending event.  Memory use doesn't depend on
+ * the size of the file.
+ */
+#if !defined ARDUINO_ARCH_ESP8266 && !defined ARDUINO_ARCH_ESP32
+// This will only work with ESP8266 or ESP32
+#else
+#include "MoppySMFPlayer.h"
+#ifdef MOPPY_PLAYER_SD
+#include <SD.h>
+#define PLAYER_FS SD
+#else
+#include <LittleFS.h>
+#define PLAYER_FS LittleFS
+#endif
+
+MoppySMFPlayer::MoppySMFPlayer(MoppyMessageConsumer *messageConsumer) {
+    targetConsumer = messageConsumer;
+}
+
+void MoppySMFPlayer::begin() {
+#ifdef MOPPY_PLAYER_SD
+    if (!SD.begin(MOPPY_PLAYER_SD_CS)) {
+        return;
+    }
+#else
+    if (!LittleFS.begin()) {
+        return;
+    }
+#endif
+    load(); // Started by main.cpp for MOPPY_PLAYER_AUTOSTART, once the instrument is ready
+}
+
+// Open the file and find the tracks.  Returns false if it isn't a MIDI file we can play.
+bool MoppySMFPlayer::load() {
+    trackCount = 0;
+    file = PLAYER_FS.open(MOPPY_PLAYER_FILE, "r");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t header[14];
+    if (file.read(header, 14) != 14 || memcmp(header, "MThd", 4) != 0) {
+        return false;
+    }
+    division = (header[12] << 8) | header[13];
+    if (division == 0 || (division & 0x8000)) {
+        return false; // SMPTE time divisions aren't supported
+    }
+
+    // Walk the chunks and remember where each track is
+    uint32_t offset = 8 + ((uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | header[6] << 8 | header[7]);
+    uint8_t chunk[8];
+    while (trackCount < MOPPY_PLAYER_MAX_TRACKS && file.seek(offset) && file.read(chunk, 8) == 8) {
+        uint32_t length = (uint32_t)chunk[4] << 24 | (uint32_t)chunk[5] << 16 | chunk[6] << 8 | chunk[7];
+        if (memcmp(chunk, "MTrk", 4) == 0) {
+            tracks[trackCount].start = offset + 8;
+            tracks[trackCount].end = offset + 8 + length;
+            trackCount++;
+        }
+        offset += 8 + length;
+    }
+    return trackCount > 0;
+}
+
+// Move every track back to its start and read the first delta-times
+void MoppySMFPlayer::rewind() {
+    for (uint8_t t = 0; t < trackCount; t++) {
+        Track &track = tracks[t];
+        track.position = track.start;
+        track.bufferPos = track.bufferLength = 0;
+        track.runningStatus = 0;
+        track.finished = false;
+        track.nextTick = 0;
+        track.nextTick = readVarLength(track);
+    }
+    tempo = 500000;
+    lastTick = 0;
+    eventMicros = micros();
+}
+
+void MoppySMFPlayer::play() {
+    if (trackCount == 0 && !load()) {
+        return;
+    }
+    rewind();
+    playing = true;
+}
+
+void MoppySMFPlayer::stop() {
+    if (playing) {
+        playing = false;
+        silence();
+    }
+}
+
+void MoppySMFPlayer::setTempoScale(uint8_t percent) {
+    if (percent > 0) {
+        tempoScale = percent;
+    }
+}
+
+// Stop any sounding notes on the instrument
+void MoppySMFPlayer::silence() {
+    targetConsumer->handleSystemMessage(NETBYTE_SYS_STOP, nullptr);
+}
+
+void MoppySMFPlayer::update() {
+    for (uint8_t burst = 0; playing && burst < MOPPY_PLAYER_MAX_BURST; burst++) {
+        // Find the track with the earliest pending event
+        Track *next = nullptr;
+        for (uint8_t t = 0; t < trackCount; t++) {
+            if (!tracks[t].finished && (next == nullptr || tracks[t].nextTick < next->nextTick)) {
+                next = &tracks[t];
+            }
+        }
+
+        if (next == nullptr) {
+            // Every track has ended
+            silence();
+            if (looping) {
+                rewind();
+                continue;
+            }
+            playing = false;
+            return;
+        }
+
+        if (next->nextTick != lastTick) {
+            // Schedule against the previous event rather than against the start of the file so
+            // that tempo changes only affect what follows them
+            eventMicros += (uint64_t)(next->nextTick - lastTick) * tempo * 100 / ((uint32_t)division * tempoScale);
+            lastTick = next->nextTick;
+        }
+        if ((int32_t)(micros() - eventMicros) < 0) {
+            return; // Not due yet
+        }
+
+        playEvent(*next);
+        if (!next->finished) {
+            next->nextTick += readVarLength(*next);
+        }
+    }
+}
+
+void MoppySMFPlayer::playEvent(Track &track) {
+    uint8_t status = readByte(track);
+    uint8_t data1 = 0;
+    if (status & 0x80) {
+        if (status < 0xF0) {
+            track.runningStatus = status;
+            data1 = readByte(track);
+        }
+    } else {
+        // Running status: this byte was already the first data byte
+        data1 = status;
+        status = track.runningStatus;
+        if (status == 0) {
+            track.finished = true; // Corrupt track, nothing we can do with it
+            return;
+        }
+    }
+
+    if (status == 0xFF) {
+        // Meta event
+        uint8_t type = readByte(track);
+        uint32_t length = readVarLength(track);
+        if (type == 0x51 && length == 3) {
+            tempo = (uint32_t)readByte(track) << 16;
+            tempo |= (uint32_t)readByte(track) << 8;
+            tempo |= readByte(track);
+        } else if (type == 0x2F) {
+            track.finished = true; // End of track
+        } else {
+            skip(track, length);
+        }
+        return;
+    }
+    if (status >= 0xF0) {
+        // SysEx (0xF0 or 0xF7), never played
+        skip(track, readVarLength(track));
+        return;
+    }
+
+    uint8_t data2 = ((status & 0xE0) == 0xC0) ? 0 : readByte(track); // Program change and channel pressure have one data byte
+    uint8_t channel = status & 0x0F;
+    if (MOPPY_PLAYER_SKIP_DRUMS && channel == 9) {
+        return;
+    }
+
+    switch (status & 0xF0) {
+    case 0x90: // Note on (velocity 0 means note off)
+        if (data2 != 0) {
+            uint8_t payload[3] = {data1, data2, channel};
+            targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_CHANNEL_NOTEON, payload);
+            break;
+        }
+        // Fall through
+    case 0x80: {
+        uint8_t payload[3] = {data1, 0, channel};
+        targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_CHANNEL_NOTEOFF, payload);
+        break;
+    }
+    case 0xE0: {
+        // 14 bits centered on 0x2000, instruments expect a signed value from -8192 to 8191
+        int16_t bendDeflection = ((data2 << 7) | data1) - 8192;
+        uint8_t payload[2] = {(uint8_t)(bendDeflection >> 8), (uint8_t)bendDeflection};
+        targetConsumer->handleDeviceMessage(DEVICE_ADDRESS, 0x00, NETBYTE_DEV_BENDPITCH, payload);
+        break;
+    }
+    }
+}
+
+uint8_t MoppySMFPlayer::readByte(Track &track) {
+    if (track.bufferPos == track.bufferLength) {
+        uint32_t remaining = track.end - track.position;
+        if (track.position >= track.end || !file.seek(track.position)) {
+            track.finished = true;
+            return 0;
+        }
+        track.bufferLength = file.read(track.buffer, min(remaining, (uint32_t)MOPPY_PLAYER_TRACK_BUFFER));
+        track.bufferPos = 0;
+        if (track.bufferLength == 0) {
+            track.finished = true;
+            return 0;
+        }
+        track.position += track.bufferLength;
+    }
+    return track.buffer[track.bufferPos++];
+}
+
+// MIDI variable-length quantity: 7 bits per byte, high bit set on all but the last byte
+uint32_t MoppySMFPlayer::readVarLength(Track &track) {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        uint8_t b = readByte(track);
+        value = (value << 7) | (b & 0x7F);
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+void MoppySMFPlayer::skip(Track &track, uint32_t length) {
+    uint8_t buffered = track.bufferLength - track.bufferPos;
+    if (length <= buffered) {
+        track.bufferPos += length;
+    } else {
+        track.position += length - buffered;
+        track.bufferPos = track.bufferLength;
+    }
+}
+
+//
+//// Message Handlers
+//
+
+void MoppySMFPlayer::handleSystemMessage(uint8_t command, uint8_t payload[]) {
+    switch (command) {
+    case NETBYTE_SYS_PLAYER_PLAY:
+        play();
+        break;
+    case NETBYTE_SYS_PLAYER_STOP:
+        stop();
+        break;
+    case NETBYTE_SYS_PLAYER_TEMPO:
+        setTempoScale(payload[0]);
+        break;
+    case NETBYTE_SYS_PLAYER_LOOP:
+        setLooping(payload[0] != 0);
+        break;
+    default:
+        targetConsumer->handleSystemMessage(command, payload);
+        break;
+    }
+}
+
+void MoppySMFPlayer::handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    targetConsumer->handleDeviceMessage(deviceAddress, subAddress, command, payload);
+}
+
+#endif /* ARDUINO_ARCH_ESP8266 or ARDUINO_ARCH_ESP32 */
@@ -0,0 +1,80 @@
+/*
+ * MoppySMFPlayer.h
+ * Plays a Standard MIDI File (type 0 or 1) straight from LittleFS or an SD card, so a device
+ * can perform without the Controller.  The player sits between the network and the instrument:
+ * it handles the NETBYTE_SYS_PLAYER_* messages itself and passes everything else through.
+ */
+#if !defined ARDUINO_ARCH_ESP8266 && !defined ARDUINO_ARCH_ESP32
+// This will only work with ESP8266 or ESP32
+#else
+#ifndef SRC_MOPPYPLAYERS_MOPPYSMFPLAYER_H_
+#define SRC_MOPPYPLAYERS_MOPPYSMFPLAYER_H_
+
+#include "../MoppyConfig.h"
+#include "../MoppyMessageConsumer.h"
+#include "../MoppyNetworks/MoppyNetwork.h"
+#include <Arduino.h>
+#include <FS.h>
+#include <stdint.h>
+
+// Tracks beyond this many are ignored, and each track reads the file this many bytes at a time
+#define MOPPY_PLAYER_MAX_TRACKS 16
+#define MOPPY_PLAYER_TRACK_BUFFER 32
+
+// Maximum number of events dispatched per update() so the network still gets serviced
+#define MOPPY_PLAYER_MAX_BURST 16
+
+// Don't play MIDI channel 10 (percussion) on pitched instruments
+#define MOPPY_PLAYER_SKIP_DRUMS true
+
+class MoppySMFPlayer : public MoppyMessageConsumer {
+public:
+    MoppySMFPlayer(MoppyMessageConsumer *messageConsumer);
+    void begin();
+    void update();
+
+    void play();
+    void stop();
+    void setTempoScale(uint8_t percent);
+    void setLooping(bool loop) { looping = loop; }
+
+    void handleSystemMessage(uint8_t command, uint8_t payload[]) override;
+    void handleDeviceMessage(uint8_t deviceAddress, uint8_t subAddress, uint8_t command, uint8_t payload[]) override;
+
+private:
+    struct Track {
+        uint32_t start;      // File offset of the first event
+        uint32_t end;        // File offset just past the track
+        uint32_t position;   // File offset of the next byte to be buffered
+        uint32_t nextTick;   // Absolute tick of the track's next event
+        uint8_t runningStatus;
+        bool finished;
+        uint8_t bufferPos;
+        uint8_t bufferLength;
+        uint8_t buffer[MOPPY_PLAYER_TRACK_BUFFER];
+    };
+
+    MoppyMessageConsumer *targetConsumer;
+    fs::File file;
+    Track tracks[MOPPY_PLAYER_MAX_TRACKS];
+    uint8_t trackCount = 0;
+    uint16_t division = 0;       // Ticks per quarter note
+
+    bool playing = false;
+    bool looping = MOPPY_PLAYER_LOOP;
+    uint8_t tempoScale = 100;    // Percentage of the file's own tempo
+    uint32_t tempo = 500000;     // Microseconds per quarter note (120 bpm until the file says otherwise)
+    uint32_t lastTick = 0;       // Tick of the last scheduled event
+    uint32_t eventMicros = 0;    // micros() at which lastTick is due
+
+    bool load();
+    void rewind();
+    void silence();
+    void playEvent(Track &track);
+    uint8_t readByte(Track &track);
+    uint32_t readVarLength(Track &track);
+    void skip(Track &track, uint32_t length);
+};
+
+#endif /* SRC_MOPPYPLAYERS_MOPPYSMFPLAYER_H_ */
+#endif /* ARDUINO_ARCH_ESP8266 or ARDUINO_ARCH_ESP32 */
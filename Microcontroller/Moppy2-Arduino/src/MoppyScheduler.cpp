@@ -0,0 +1,75 @@
+#include "MoppyScheduler.h"
+
+MoppyScheduler::Task MoppyScheduler::tasks[MOPPY_MAX_TASKS];
+uint8_t MoppyScheduler::taskCount = 0;
+
+int8_t MoppyScheduler::addTask(TaskFunction function, uint8_t priority, uint32_t periodMicros, uint32_t budgetMicros) {
+    if (taskCount == MOPPY_MAX_TASKS) {
+        return -1;
+    }
+
+    // Insert after any tasks of the same or higher priority
+    uint8_t t = taskCount;
+    while (t > 0 && tasks[t - 1].priority > priority) {
+        tasks[t] = tasks[t - 1];
+        t--;
+    }
+    tasks[t].function = function;
+    tasks[t].periodMicros = periodMicros;
+    tasks[t].budgetMicros = budgetMicros;
+    tasks[t].lastRun = micros();
+    tasks[t].overruns = 0;
+    tasks[t].priority = priority;
+    tasks[t].id = taskCount;
+    return taskCount++;
+}
+
+void MoppyScheduler::run() {
+    for (uint8_t t = 0; t < taskCount; t++) {
+        if (tasks[t].periodMicros == 0) {
+            runTask(tasks[t], micros());
+        }
+    }
+
+    // Then one periodic task: the first that's overdue by a whole period, or failing that the
+    // first that's due, by priority
+    uint32_t now = micros();
+    int8_t due = -1;
+    for (uint8_t t = 0; t < taskCount; t++) {
+        Task &task = tasks[t];
+        if (task.periodMicros == 0) {
+            continue;
+        }
+        uint32_t waited = now - task.lastRun;
+        if (waited >= task.periodMicros * 2) {
+            runTask(task, now);
+            return;
+        }
+        if (due < 0 && waited >= task.periodMicros) {
+            due = t;
+        }
+    }
+    if (due >= 0) {
+        runTask(tasks[due], now);
+    }
+}
+
+uint16_t MoppyScheduler::getOverruns(int8_t taskId) {
+    for (uint8_t t = 0; t < taskCount; t++) {
+        if (tasks[t].id == taskId) {
+            return tasks[t].overruns;
+        }
+    }
+    return 0;
+}
+
+void MoppyScheduler::runTask(Task &task, uint32_t now) {
+    task.lastRun = now;
+    task.function();
+
+    uint32_t elapsed = micros() - now;
+    if (elapsed > task.budgetMicros) {
+        task.overruns++;
+        MoppyStats::taskOverrun(task.id);
+    }
+}
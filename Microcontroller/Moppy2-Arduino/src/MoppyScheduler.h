@@ -0,0 +1,60 @@
+/*
+ * MoppyScheduler.h
+ * Cooperative scheduler for the main loop.  Each task has a priority, a period and a time
+ * budget.  Every pass runs all of the continuous (period 0) tasks, highest priority first,
+ * and then at most one periodic task that is due, so receiving messages never waits behind
+ * more than one slow job.  The due task with the highest priority goes first, unless a task
+ * has been kept waiting for a whole extra period; then that one does, so that a frequent
+ * high-priority task can't starve the rest.  Tasks that run longer than their budget are
+ * counted in MoppyStats.
+ */
+
+#ifndef MOPPY_SRC_MOPPYSCHEDULER_H_
+#define MOPPY_SRC_MOPPYSCHEDULER_H_
+
+#include "MoppyNetworks/MoppyStats.h"
+#include <Arduino.h>
+#include <stdint.h>
+
+#define MOPPY_MAX_TASKS 8
+
+// Suggested priorities (lower runs first)
+#define TASK_PRIORITY_RECEIVE 0
+#define TASK_PRIORITY_PLAYBACK 1
+#define TASK_PRIORITY_CONTROL 2
+#define TASK_PRIORITY_HOUSEKEEPING 3
+
+class MoppyScheduler {
+public:
+    typedef void (*TaskFunction)();
+
+    /*
+     * Add a task.  periodMicros is the time between runs (0 to run on every pass) and
+     * budgetMicros is how long a single run may take before it counts as an overrun.
+     * Returns the task's id (the order it was added in), or -1 if there's no room.
+     */
+    static int8_t addTask(TaskFunction function, uint8_t priority, uint32_t periodMicros, uint32_t budgetMicros);
+
+    // One pass of the scheduler, called from loop()
+    static void run();
+
+    static uint16_t getOverruns(int8_t taskId);
+
+private:
+    struct Task {
+        TaskFunction function;
+        uint32_t periodMicros;
+        uint32_t budgetMicros;
+        uint32_t lastRun;
+        uint16_t overruns;
+        uint8_t priority;
+        int8_t id;
+    };
+
+    static Task tasks[MOPPY_MAX_TASKS]; // Sorted by priority
+    static uint8_t taskCount;
+
+    static void runTask(Task &task, uint32_t now);
+};
+
+#endif /* MOPPY_SRC_MOPPYSCHEDULER_H_ */
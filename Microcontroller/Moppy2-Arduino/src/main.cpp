@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include "MoppyConfig.h"
 #include "MoppyInstruments/MoppyInstrument.h"
+#include "MoppyScheduler.h"
 
 /**********
  * MoppyInstruments handle the sound-creation logic for your setup.  The
@@ -14,43 +15,83 @@
 // Floppy drives directly connected to the Arduino's digital pins
 #ifdef INSTRUMENT_FLOPPIES
 #include "MoppyInstruments/FloppyDrives.h"
-MoppyInstrument *instrument = new instruments::FloppyDrives();
+typedef instruments::FloppyDrives Instrument;
+Instrument *instrument = new Instrument();
 #endif
 
 // Buzzers directly connected to the Arduino's digital pins
 #ifdef INSTRUMENT_BUZZERS
 #include "MoppyInstruments/Buzzers.h"
-MoppyInstrument *instrument = new instruments::Buzzers();
+typedef instruments::Buzzers Instrument;
+Instrument *instrument = new Instrument();
 #endif
 
 // Hard drives connected to L293/298 motor drivers
 #ifdef INSTRUMENT_HARDDRIVES
 #include "MoppyInstruments/HardDrives.h"
-MoppyInstrument *instrument = new instruments::HardDrives();
+typedef instruments::HardDrives Instrument;
+Instrument *instrument = new Instrument();
 #endif
 
 // EasyDriver stepper motor driver
 #ifdef INSTRUMENT_EASYDRIVER
 #include "MoppyInstruments/EasyDrivers.h"
-MoppyInstrument *instrument = new instruments::EasyDrivers();
+typedef instruments::EasyDrivers Instrument;
+Instrument *instrument = new Instrument();
 #endif
 
 // L298N stepper motor driver
 #ifdef INSTRUMENT_L298N
 #include "MoppyInstruments/L298N.h"
-MoppyInstrument *instrument = new instruments::L298N();
+typedef instruments::L298N Instrument;
+Instrument *instrument = new Instrument();
 #endif
 
 // A single device (e.g. xylophone, drums, etc.) connected to shift registers
 #ifdef INSTRUMENT_SHIFT_REGISTER
 #include "MoppyInstruments/ShiftRegister.h"
-MoppyInstrument *instrument = new instruments::ShiftRegister();
+typedef instruments::ShiftRegister Instrument;
+Instrument *instrument = new Instrument();
 #endif
 
 // Floppy drives connected to 74HC595 shift registers
 #ifdef INSTRUMENT_SHIFTED_FLOPPIES
 #include "MoppyInstruments/ShiftedFloppyDrives.h"
-MoppyInstrument *instrument = new instruments::ShiftedFloppyDrives();
+typedef instruments::ShiftedFloppyDrives Instrument;
+Instrument *instrument = new Instrument();
+#endif
+
+// Several instruments on one board, each at its own address from COMPOSITE_ADDRESSES.  List
+// them here in the same order (e.g. floppy drives and hard drives on a Mega).
+#ifdef INSTRUMENT_COMPOSITE
+#include "MoppyInstruments/MoppyComposite.h"
+#include "MoppyInstruments/FloppyDrives.h"
+#include "MoppyInstruments/HardDrives.h"
+MoppyInstrument *compositeInstruments[] = {new instruments::FloppyDrives(), new instruments::HardDrives()};
+typedef MoppyComposite Instrument;
+Instrument *instrument = new MoppyComposite(compositeInstruments);
+#endif
+
+/**********
+ * Optionally, a player can sit between the network and the instrument and
+ * play music stored on the device itself.  It passes messages on through the
+ * virtual handlers, so without one the network is given the instrument's own
+ * type (Consumer) and calls it directly.
+ */
+#ifdef PLAYER_SMF
+#include "MoppyPlayers/MoppySMFPlayer.h"
+MoppySMFPlayer player = MoppySMFPlayer(instrument);
+typedef MoppyMessageConsumer Consumer;
+Consumer *consumer = &player;
+#elif defined PLAYER_EVENTS
+#include "MoppyPlayers/MoppyEventPlayer.h"
+#include MOPPY_PLAYER_EVENTS_HEADER
+MoppyEventPlayer player = MoppyEventPlayer(instrument, moppyEvents);
+typedef MoppyMessageConsumer Consumer;
+Consumer *consumer = &player;
+#elif !defined INSTRUMENT_GATEWAY
+typedef Instrument Consumer;
+Consumer *consumer = instrument;
 #endif
 
 /**********
@@ -61,46 +102,116 @@ MoppyInstrument *instrument = new instruments::ShiftedFloppyDrives();
  * Configure the appropriate networking class for your setup in MoppyConfig.h
  */
 
+// With more than one network, each passes its messages to its own link of a mux, which merges
+// the copies that arrive over several of them (see MoppyNetworkMux.h)
+#if (defined(NETWORK_SERIAL) + defined(NETWORK_UDP) + defined(NETWORK_ESPNOW)) > 1
+#include "MoppyNetworks/MoppyNetworkMux.h"
+MoppyNetworkMux mux = MoppyNetworkMux(consumer);
+typedef MoppyMessageConsumer NetworkConsumer;
+#define NETWORK_CONSUMER(index) mux.link(index)
+#elif !defined INSTRUMENT_GATEWAY
+typedef Consumer NetworkConsumer;
+#define NETWORK_CONSUMER(index) consumer
+#endif
+
 // Standard Arduino HardwareSerial implementation
 #ifdef NETWORK_SERIAL
 #include "MoppyNetworks/MoppySerial.h"
-MoppySerial network = MoppySerial(instrument);
+MoppySerial<NetworkConsumer> serialNetwork = MoppySerial<NetworkConsumer>(NETWORK_CONSUMER(0));
 #endif
 
 //// UDP Implementation using some sort of network stack?  (Not implemented yet)
 #ifdef NETWORK_UDP
 #include "MoppyNetworks/MoppyUDP.h"
-MoppyUDP network = MoppyUDP(instrument);
+MoppyUDP udpNetwork = MoppyUDP(NETWORK_CONSUMER(1));
 #endif
 
 //// ESP-Now Implementation
 #ifdef NETWORK_ESPNOW
 #include "MoppyNetworks/MoppyESPNow.h"
-MoppyESPNow network = MoppyESPNow(instrument);
+MoppyESPNow espNowNetwork = MoppyESPNow(NETWORK_CONSUMER(2));
 #endif
 
 //// Standard Arduino HardwareSerial ---> ESP-Now Gateway Implementation
 #ifdef NETWORK_ESPNOW_GATEWAY
 #include "MoppyNetworks/MoppyESPNowGateway.h"
-MoppyESPNowGateway network = MoppyESPNowGateway();
+MoppyESPNowGateway gatewayNetwork = MoppyESPNowGateway();
 #endif
 
 //The setup function is called once at startup of the sketch
 void setup()
 {
+    // Tell the network to start receiving messages.  This comes first so the device can be
+    // found (and updated) right away, while the instrument is still homing.  UDP goes before
+    // ESP-Now, which then stays on the access point's channel.
+    #ifdef NETWORK_SERIAL
+    serialNetwork.begin();
+    #endif
+    #ifdef NETWORK_UDP
+    udpNetwork.begin();
+    #endif
+    #ifdef NETWORK_ESPNOW
+    espNowNetwork.begin();
+    #endif
+    #ifdef NETWORK_ESPNOW_GATEWAY
+    gatewayNetwork.begin();
+    #endif
+
     #ifndef INSTRUMENT_GATEWAY
-    // Call setup() on the instrument to allow to to prepare for action
+    // Call setup() on the instrument to allow to to prepare for action.  Homing and the
+    // startup sound carry on in the background (see instrument->update() below).
     instrument->setup();
     #endif
 
-    // Tell the network to start receiving messages
-    network.begin();
+    #if defined PLAYER_SMF || defined PLAYER_EVENTS
+    player.begin();
+    #endif
+
+    // Everything loop() has to do is a task for the scheduler.  Reading messages and the
+    // player run on every pass; the rest only when due, one at a time, so a slow job can
+    // never hold up more than one pass of message handling.  The network implementation
+    // will call the system or device handlers on the intrument whenever a message is received.
+    MoppyScheduler::addTask([]() {
+        #ifdef NETWORK_SERIAL
+        serialNetwork.readMessages();
+        #endif
+        #ifdef NETWORK_UDP
+        udpNetwork.readMessages();
+        #endif
+        #ifdef NETWORK_ESPNOW
+        espNowNetwork.readMessages();
+        #endif
+        #ifdef NETWORK_ESPNOW_GATEWAY
+        gatewayNetwork.readMessages();
+        #endif
+        #if (defined(NETWORK_SERIAL) + defined(NETWORK_UDP) + defined(NETWORK_ESPNOW)) > 1
+        mux.update();
+        #endif
+    }, TASK_PRIORITY_RECEIVE, 0, 1000);
+
+    #if defined PLAYER_SMF || defined PLAYER_EVENTS
+    MoppyScheduler::addTask([]() {
+        // Autostart waits for the startup sequence, so the first notes aren't held back
+        static bool autostarted = !MOPPY_PLAYER_AUTOSTART;
+        if (!autostarted && instrument->isStarted()) {
+            player.play();
+            autostarted = true;
+        }
+        player.update();
+    }, TASK_PRIORITY_PLAYBACK, 0, 1000);
+    #endif
+
+    #ifndef INSTRUMENT_GATEWAY
+    MoppyScheduler::addTask([]() { instrument->update(); }, TASK_PRIORITY_CONTROL, 1000, 500);
+    #endif
+
+    #ifdef NETWORK_UDP
+    MoppyScheduler::addTask([]() { udpNetwork.handleOTA(); }, TASK_PRIORITY_HOUSEKEEPING, 50000, 5000);
+    #endif
 }
 
 // The loop function is called in an endless loop
 void loop()
 {
-	// Endlessly read messages on the network.  The network implementation
-	// will call the system or device handlers on the intrument whenever a message is received.
-    network.readMessages();
+    MoppyScheduler::run();
 }
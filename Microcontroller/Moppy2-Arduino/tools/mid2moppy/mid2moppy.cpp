@@ -0,0 +1,426 @@
+/*
+ * mid2moppy.cpp
+ * Compiles a Standard MIDI File into a Moppy event stream (see MoppyEventFormat.h) for
+ * MoppyEventPlayer.  Tempo changes are resolved and notes are allocated to sub-addresses
+ * here, so the device only has to read records and pass them on.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "../../src/MoppyInstruments/MoppyNotes.h"
+#include "../../src/MoppyNetworks/MoppyNetwork.h"
+#include "../../src/MoppyPlayers/MoppyEventFormat.h"
+
+namespace {
+
+struct Options {
+    int voices = 4;
+    int firstSubAddress = 1;
+    int lowestNote = 0;
+    int highestNote = 127;
+    int tickMicros = 1000;
+    bool keepDrums = false;
+    bool cHeader = false;
+    std::string input;
+    std::string output;
+};
+
+// A channel event or tempo change, with its position in the merged file
+struct MidiEvent {
+    uint32_t tick;
+    uint32_t order;  // Position in the file, to keep the sort stable across tracks
+    uint8_t status;  // 0 for a tempo change
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t tempo;
+
+    // Tempo changes first, then note offs, then everything else
+    int priority() const {
+        if (status == 0) {
+            return 0;
+        }
+        bool noteOff = (status & 0xF0) == 0x80 || ((status & 0xF0) == 0x90 && data2 == 0);
+        return noteOff ? 1 : 2;
+    }
+};
+
+struct Voice {
+    int note = 0; // 0 when free
+    int channel = 0;
+    uint32_t lastUsed = 0;
+};
+
+struct Record {
+    uint32_t tick;
+    uint8_t subAddress;
+    uint8_t command;
+    std::vector<uint8_t> payload;
+};
+
+[[noreturn]] void fail(const std::string &message) {
+    std::fprintf(stderr, "mid2moppy: %s\n", message.c_str());
+    std::exit(1);
+}
+
+void usage() {
+    std::fprintf(stderr,
+            "usage: mid2moppy [options] input.mid output\n"
+            "  -v N   number of voices (default 4)\n"
+            "  -s N   sub-address of the first voice (default 1)\n"
+            "  -l N   lowest note to play (default 0)\n"
+            "  -h N   highest note to play (default 127, use 71 for floppy drives)\n"
+            "  -r N   microseconds per tick (default 1000)\n"
+            "  -d     keep MIDI channel 10 (percussion)\n"
+            "  -c     write a C header for PROGMEM instead of a binary stream\n");
+    std::exit(1);
+}
+
+class Reader {
+public:
+    Reader(const std::vector<uint8_t> &data, size_t pos, size_t end) : data(data), pos(pos), end(end) {}
+
+    bool atEnd() const { return pos >= end; }
+    uint8_t byte() {
+        if (pos >= end) {
+            fail("unexpected end of track");
+        }
+        return data[pos++];
+    }
+    uint32_t varLength() {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            uint8_t b = byte();
+            value = (value << 7) | (b & 0x7F);
+            if (!(b & 0x80)) {
+                break;
+            }
+        }
+        return value;
+    }
+    void skip(uint32_t length) { pos += length; }
+
+private:
+    const std::vector<uint8_t> &data;
+    size_t pos;
+    size_t end;
+};
+
+uint32_t bigEndian(const std::vector<uint8_t> &data, size_t pos, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | data.at(pos + i);
+    }
+    return value;
+}
+
+// Reads every track and returns the events merged into playing order
+std::vector<MidiEvent> readMidiFile(const std::vector<uint8_t> &data, uint16_t &division) {
+    if (data.size() < 14 || std::memcmp(data.data(), "MThd", 4) != 0) {
+        fail("not a MIDI file");
+    }
+    division = bigEndian(data, 12, 2);
+    if (division == 0 || (division & 0x8000)) {
+        fail("SMPTE time divisions aren't supported");
+    }
+
+    std::vector<MidiEvent> events;
+    uint32_t order = 0;
+    size_t offset = 8 + bigEndian(data, 4, 4);
+    while (offset + 8 <= data.size()) {
+        size_t length = bigEndian(data, offset + 4, 4);
+        size_t start = offset + 8;
+        offset = start + length;
+        if (std::memcmp(&data[start - 8], "MTrk", 4) != 0) {
+            continue;
+        }
+
+        Reader track(data, start, std::min(offset, data.size()));
+        uint32_t tick = 0;
+        uint8_t runningStatus = 0;
+        while (!track.atEnd()) {
+            tick += track.varLength();
+            uint8_t status = track.byte();
+            uint8_t data1 = 0;
+            if (status & 0x80) {
+                if (status < 0xF0) {
+                    runningStatus = status;
+                    data1 = track.byte();
+                }
+            } else {
+                data1 = status;
+                status = runningStatus;
+                if (status == 0) {
+                    fail("data byte without a status");
+                }
+            }
+
+            if (status == 0xFF) {
+                uint8_t type = track.byte();
+                uint32_t metaLength = track.varLength();
+                if (type == 0x51 && metaLength == 3) {
+                    uint32_t tempo = track.byte() << 16;
+                    tempo |= track.byte() << 8;
+                    tempo |= track.byte();
+                    events.push_back({tick, order++, 0, 0, 0, tempo});
+                } else if (type == 0x2F) {
+                    break;
+                } else {
+                    track.skip(metaLength);
+                }
+            } else if (status >= 0xF0) {
+                track.skip(track.varLength());
+            } else {
+                uint8_t data2 = ((status & 0xE0) == 0xC0) ? 0 : track.byte();
+                events.push_back({tick, order++, status, data1, data2, 0});
+            }
+        }
+    }
+
+    std::sort(events.begin(), events.end(), [](const MidiEvent &a, const MidiEvent &b) {
+        if (a.tick != b.tick) {
+            return a.tick < b.tick;
+        }
+        if (a.priority() != b.priority()) {
+            return a.priority() < b.priority();
+        }
+        return a.order < b.order;
+    });
+    return events;
+}
+
+// Same least-recently-used allocation as MoppyVoiceAllocator on the device
+class Allocator {
+public:
+    explicit Allocator(int count) : voices(count) {}
+
+    int noteOn(int channel, int note, int &stolenNote) {
+        int chosen = oldest(true);
+        if (chosen < 0) {
+            chosen = oldest(false);
+        }
+        stolenNote = voices[chosen].note;
+        voices[chosen].note = note;
+        voices[chosen].channel = channel;
+        voices[chosen].lastUsed = ++useCounter;
+        return chosen;
+    }
+
+    int noteOff(int channel, int note) {
+        for (size_t v = 0; v < voices.size(); v++) {
+            if (voices[v].note == note && voices[v].channel == channel) {
+                voices[v].note = 0;
+                voices[v].lastUsed = ++useCounter;
+                return v;
+            }
+        }
+        return -1;
+    }
+
+    std::vector<Voice> voices;
+
+private:
+    uint32_t useCounter = 0;
+
+    int oldest(bool free) const {
+        int found = -1;
+        for (size_t v = 0; v < voices.size(); v++) {
+            if ((voices[v].note == 0) == free && (found < 0 || voices[v].lastUsed < voices[found].lastUsed)) {
+                found = v;
+            }
+        }
+        return found;
+    }
+};
+
+std::vector<Record> compile(const std::vector<MidiEvent> &events, uint16_t division, const Options &options) {
+    std::vector<Record> records;
+    Allocator allocator(options.voices);
+    int16_t channelBend[16] = {0};
+
+    double eventMicros = 0;
+    uint32_t lastTick = 0;
+    uint32_t tempo = 500000;
+
+    for (const MidiEvent &event : events) {
+        eventMicros += (double)(event.tick - lastTick) * tempo / division;
+        lastTick = event.tick;
+        uint32_t tick = (uint32_t)std::llround(eventMicros / options.tickMicros);
+
+        if (event.status == 0) {
+            tempo = event.tempo;
+            continue;
+        }
+        int channel = event.status & 0x0F;
+        if (channel == 9 && !options.keepDrums) {
+            continue;
+        }
+        auto emit = [&](int voice, uint8_t command, std::vector<uint8_t> payload) {
+            records.push_back({tick, (uint8_t)(options.firstSubAddress + voice), command, payload});
+        };
+        auto bendPayload = [](int16_t bend) {
+            return std::vector<uint8_t>{(uint8_t)(bend >> 8), (uint8_t)bend};
+        };
+
+        switch (event.status & 0xF0) {
+        case 0x90:
+            if (event.data2 != 0) {
+                int note = event.data1;
+                if (note < options.lowestNote || note > options.highestNote || notePeriods[note] == 0) {
+                    break; // Can't be played
+                }
+                int stolenNote;
+                int voice = allocator.noteOn(channel, note, stolenNote);
+                if (stolenNote != 0) {
+                    emit(voice, NETBYTE_DEV_NOTEOFF, {(uint8_t)stolenNote, 0});
+                }
+                emit(voice, NETBYTE_DEV_NOTEON, {(uint8_t)note, event.data2});
+                if (channelBend[channel] != 0) {
+                    emit(voice, NETBYTE_DEV_BENDPITCH, bendPayload(channelBend[channel]));
+                }
+                break;
+            }
+            // Velocity 0 means note off
+            // Fall through
+        case 0x80: {
+            int voice = allocator.noteOff(channel, event.data1);
+            if (voice >= 0) {
+                emit(voice, NETBYTE_DEV_NOTEOFF, {event.data1, 0});
+            }
+            break;
+        }
+        case 0xE0: {
+            channelBend[channel] = ((event.data2 << 7) | event.data1) - 8192;
+            for (size_t v = 0; v < allocator.voices.size(); v++) {
+                if (allocator.voices[v].note != 0 && allocator.voices[v].channel == channel) {
+                    emit(v, NETBYTE_DEV_BENDPITCH, bendPayload(channelBend[channel]));
+                }
+            }
+            break;
+        }
+        }
+    }
+    return records;
+}
+
+std::vector<uint8_t> encode(const std::vector<Record> &records, const Options &options) {
+    std::vector<uint8_t> body;
+    uint32_t lastTick = 0;
+    for (const Record &record : records) {
+        uint32_t delta = record.tick - lastTick;
+        lastTick = record.tick;
+
+        uint8_t varLength[5];
+        int count = 0;
+        varLength[count++] = delta & 0x7F;
+        while (delta >>= 7) {
+            varLength[count++] = 0x80 | (delta & 0x7F);
+        }
+        while (count > 0) {
+            body.push_back(varLength[--count]);
+        }
+
+        body.push_back(record.subAddress);
+        body.push_back(record.command);
+        body.push_back(record.payload.size());
+        body.insert(body.end(), record.payload.begin(), record.payload.end());
+    }
+
+    std::vector<uint8_t> stream(MOPPY_EVENTS_MAGIC, MOPPY_EVENTS_MAGIC + 4);
+    stream.push_back(MOPPY_EVENTS_VERSION);
+    stream.push_back(options.tickMicros >> 8);
+    stream.push_back(options.tickMicros & 0xFF);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        stream.push_back(body.size() >> shift);
+    }
+    stream.insert(stream.end(), body.begin(), body.end());
+    return stream;
+}
+
+void writeOutput(const std::vector<uint8_t> &stream, const Options &options) {
+    std::ofstream out(options.output, std::ios::binary);
+    if (!out) {
+        fail("can't write " + options.output);
+    }
+    if (!options.cHeader) {
+        out.write((const char *)stream.data(), stream.size());
+        return;
+    }
+
+    out << "// Generated by mid2moppy from " << options.input << "\n"
+        << "#include <Arduino.h>\n\n"
+        << "const uint8_t moppyEvents[] PROGMEM = {";
+    for (size_t i = 0; i < stream.size(); i++) {
+        char hex[8];
+        std::snprintf(hex, sizeof(hex), "0x%02x", stream[i]);
+        out << (i % 16 == 0 ? "\n    " : " ") << hex << (i + 1 < stream.size() ? "," : "");
+    }
+    out << "\n};\n";
+}
+
+int parseNumber(const char *text, int min, int max) {
+    char *end;
+    long value = std::strtol(text, &end, 10);
+    if (*end != '\0' || value < min || value > max) {
+        usage();
+    }
+    return value;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-v" && hasValue) {
+            options.voices = parseNumber(argv[++i], 1, 255);
+        } else if (arg == "-s" && hasValue) {
+            options.firstSubAddress = parseNumber(argv[++i], 1, 255);
+        } else if (arg == "-l" && hasValue) {
+            options.lowestNote = parseNumber(argv[++i], 0, 127);
+        } else if (arg == "-h" && hasValue) {
+            options.highestNote = parseNumber(argv[++i], 0, 127);
+        } else if (arg == "-r" && hasValue) {
+            options.tickMicros = parseNumber(argv[++i], 1, 65535);
+        } else if (arg == "-d") {
+            options.keepDrums = true;
+        } else if (arg == "-c") {
+            options.cHeader = true;
+        } else if (arg[0] == '-') {
+            usage();
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.size() != 2 || options.firstSubAddress + options.voices - 1 > 255) {
+        usage();
+    }
+    options.input = files[0];
+    options.output = files[1];
+
+    std::ifstream in(options.input, std::ios::binary);
+    if (!in) {
+        fail("can't read " + options.input);
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    uint16_t division;
+    std::vector<MidiEvent> events = readMidiFile(data, division);
+    std::vector<Record> records = compile(events, division, options);
+    std::vector<uint8_t> stream = encode(records, options);
+    writeOutput(stream, options);
+
+    std::printf("%zu records, %zu bytes\n", records.size(), stream.size());
+    return 0;
+}
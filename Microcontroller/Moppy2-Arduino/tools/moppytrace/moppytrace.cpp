@@ -0,0 +1,188 @@
+/*
+ * moppytrace.cpp
+ * Decodes the NETBYTE_SYS_TRACE_REPORT messages (see MoppyTrace.h) in a capture of the bytes
+ * a device sent back, and prints a latency histogram for each stage of every device.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../../src/MoppyNetworks/MoppyNetwork.h"
+
+namespace {
+
+const int STAGES = 4;
+const char *const STAGE_NAMES[STAGES] = {
+        "receive -> frame",
+        "frame -> dispatch",
+        "dispatch -> first edge",
+        "receive -> first edge"};
+
+// Histogram buckets are powers of two in microseconds: <1, 1-2, 2-4, ... and everything above
+const int BUCKETS = 18;
+
+const uint32_t NEVER_STEPPED = 0xFFFFFFFF;
+
+struct Device {
+    std::vector<uint32_t> latencies[STAGES]; // Microseconds
+    unsigned records = 0;
+    unsigned neverStepped = 0;
+};
+
+[[noreturn]] void fail(const std::string &message) {
+    std::fprintf(stderr, "moppytrace: %s\n", message.c_str());
+    std::exit(1);
+}
+
+void usage() {
+    std::fprintf(stderr,
+            "usage: moppytrace [capture]\n"
+            "       moppytrace -q\n"
+            "  Reads bytes captured from the device (stdin if no file is given) and prints\n"
+            "  latency histograms for the traces in them.\n"
+            "  -q     write a NETBYTE_SYS_TRACE request to stdout instead, e.g. for a serial port\n");
+    std::exit(1);
+}
+
+uint32_t bigEndian(const std::vector<uint8_t> &data, size_t pos) {
+    return (uint32_t)data[pos] << 24 | data[pos + 1] << 16 | data[pos + 2] << 8 | data[pos + 3];
+}
+
+// Finds every trace report in the capture, skipping anything else (pongs, stats, noise)
+void decode(const std::vector<uint8_t> &data, std::map<int, Device> &devices) {
+    size_t pos = 0;
+    while (pos + 8 <= data.size()) {
+        if (data[pos] != START_BYTE || data[pos + 1] != SYSTEM_ADDRESS || data[pos + 4] != NETBYTE_SYS_TRACE_REPORT) {
+            pos++;
+            continue;
+        }
+        size_t end = pos + 4 + data[pos + 3];
+        int ticksPerMicro = data[pos + 6];
+        size_t count = data[pos + 7];
+        if (end > data.size() || ticksPerMicro == 0 || 8 + count * 13 != end - pos) {
+            pos++; // Not really a report, or cut short
+            continue;
+        }
+
+        Device &device = devices[data[pos + 5]];
+        for (size_t record = pos + 8; record < end; record += 13) {
+            uint32_t framed = bigEndian(data, record + 1);
+            uint32_t dispatched = bigEndian(data, record + 5);
+            uint32_t edge = bigEndian(data, record + 9);
+            device.records++;
+
+            device.latencies[0].push_back(framed / ticksPerMicro);
+            device.latencies[1].push_back((dispatched - framed) / ticksPerMicro);
+            if (edge == NEVER_STEPPED) {
+                device.neverStepped++;
+                continue;
+            }
+            device.latencies[2].push_back((edge - dispatched) / ticksPerMicro);
+            device.latencies[3].push_back(edge / ticksPerMicro);
+        }
+        pos = end;
+    }
+}
+
+int bucket(uint32_t micros) {
+    int b = 0;
+    while (micros > 0 && b < BUCKETS - 1) {
+        micros >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void printHistogram(const char *name, std::vector<uint32_t> latencies) {
+    std::printf("  %s", name);
+    if (latencies.empty()) {
+        std::printf(": no samples\n");
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::printf(": min %uus, median %uus, 99%% %uus, max %uus\n",
+            latencies.front(), latencies[latencies.size() / 2],
+            latencies[latencies.size() * 99 / 100], latencies.back());
+
+    unsigned counts[BUCKETS] = {0};
+    for (uint32_t latency : latencies) {
+        counts[bucket(latency)]++;
+    }
+    unsigned most = *std::max_element(counts, counts + BUCKETS);
+    int first = 0;
+    int last = BUCKETS - 1;
+    while (counts[first] == 0) {
+        first++;
+    }
+    while (counts[last] == 0) {
+        last--;
+    }
+    for (int b = first; b <= last; b++) {
+        char range[24];
+        if (b == 0) {
+            std::snprintf(range, sizeof(range), "<1us");
+        } else if (b == BUCKETS - 1) {
+            std::snprintf(range, sizeof(range), ">=%uus", 1u << (b - 1));
+        } else {
+            std::snprintf(range, sizeof(range), "%u-%uus", 1u << (b - 1), 1u << b);
+        }
+        std::string bar(counts[b] * 40 / most, '#');
+        std::printf("    %14s %6u %s\n", range, counts[b], bar.c_str());
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::string input;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-q") {
+            const uint8_t request[] = {START_BYTE, SYSTEM_ADDRESS, 0x00, 0x01, NETBYTE_SYS_TRACE};
+            std::fwrite(request, 1, sizeof(request), stdout);
+            return 0;
+        } else if (arg[0] == '-' || !input.empty()) {
+            usage();
+        } else {
+            input = arg;
+        }
+    }
+
+    std::vector<uint8_t> data;
+    if (input.empty()) {
+        data.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    } else {
+        std::ifstream in(input, std::ios::binary);
+        if (!in) {
+            fail("can't read " + input);
+        }
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    std::map<int, Device> devices;
+    decode(data, devices);
+    if (devices.empty()) {
+        fail("no trace reports found");
+    }
+
+    for (const auto &entry : devices) {
+        const Device &device = entry.second;
+        std::printf("Device 0x%02x: %u notes", entry.first, device.records);
+        if (device.neverStepped > 0) {
+            std::printf(" (%u never stepped)", device.neverStepped);
+        }
+        std::printf("\n");
+        for (int stage = 0; stage < STAGES; stage++) {
+            printHistogram(STAGE_NAMES[stage], device.latencies[stage]);
+        }
+    }
+    return 0;
+}